@@ -0,0 +1,172 @@
+// microbenchmark of the server catalog: inserts NAMES names, looks every
+// one of them up in random order, looks up as many names that are not
+// there, runs QUERIES substring searches of LIST through the trigram index
+// and by scanning all names, and erases half of the names; lookups are
+// compared with the linear scan of a vector of names that the catalog
+// replaced; results go to stdout as one json object
+#include <algorithm>
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "catalog.h"
+#include "timer.h"
+
+// the scan is too slow to be run for every name
+const size_t SCAN_LOOKUPS = 100;
+// needles of LIST are cut from names at random, this long
+const size_t NEEDLE_LENGTH = 8;
+// names look like those of a real share, a word, a number and extension
+const char *const WORDS[] = {"report", "photo", "backup", "log",
+                             "data",   "config", "video", "thumb",
+                             "invoice", "draft"};
+const char *const EXTENSIONS[] = {".jpg", ".txt", ".tar.gz", ".csv"};
+
+int32_t name_count = 1000000;
+int32_t query_count = 200;
+uint32_t seed = 1;
+
+std::vector<std::string> make_names(size_t count, std::mt19937_64 &rng) {
+    std::vector<std::string> names;
+    names.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        names.push_back(std::string(WORDS[rng() % std::size(WORDS)]) + "_" +
+                        std::to_string(i) + "_" +
+                        std::to_string(rng() % 1000000) +
+                        EXTENSIONS[rng() % std::size(EXTENSIONS)]);
+    }
+    return names;
+}
+
+double ns_per(uint64_t start_us, size_t count) {
+    return count == 0 ? 0 : (monotonic_us() - start_us) * 1000.0 / count;
+}
+
+double per_second(uint64_t start_us, size_t count) {
+    return count * 1e6 / std::max<uint64_t>(monotonic_us() - start_us, 1);
+}
+
+void init(int argc, char **argv) {
+    namespace po = boost::program_options;
+    po::options_description desc(argv[0] + std::string(" flags"));
+    desc.add_options()(",n", po::value<int32_t>(&name_count),
+                       "NAMES (in the catalog, default 1000000)")(
+        ",q", po::value<int32_t>(&query_count),
+        "QUERIES (substring searches, default 200)")(
+        ",s", po::value<uint32_t>(&seed), "SEED (of the names, default 1)");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (name_count <= 0) {
+            throw po::validation_error(
+                po::validation_error::invalid_option_value, "n",
+                std::to_string(name_count));
+        }
+        if (query_count <= 0) {
+            throw po::validation_error(
+                po::validation_error::invalid_option_value, "q",
+                std::to_string(query_count));
+        }
+    }
+    catch (po::error &e) {
+        std::cerr << "INCORRECT USAGE\n" << e.what() << "\n" << desc;
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv) {
+    init(argc, argv);
+    std::mt19937_64 rng(seed);
+    std::vector<std::string> names = make_names(name_count, rng);
+    // looked up in an order unrelated to that of inserting
+    std::vector<size_t> order(names.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), rng);
+    // same shape as the names, but none of them is in the catalog
+    std::vector<std::string> missing = names;
+    for (auto &name : missing) {
+        name.insert(0, "x");
+    }
+
+    Catalog catalog;
+    uint64_t start = monotonic_us();
+    for (const auto &name : names) {
+        catalog.insert(name, name.size(), FileState::COMPLETE);
+    }
+    double insert_ns = ns_per(start, names.size());
+
+    size_t found = 0;
+    start = monotonic_us();
+    for (size_t i : order) {
+        found += catalog.find(names[i]) != nullptr;
+    }
+    double lookup_ns = ns_per(start, names.size());
+
+    start = monotonic_us();
+    for (size_t i : order) {
+        found += catalog.find(missing[i]) != nullptr;
+    }
+    double miss_ns = ns_per(start, names.size());
+
+    std::vector<std::string> needles;
+    for (int32_t k = 0; k < query_count; ++k) {
+        const std::string &name = names[rng() % names.size()];
+        size_t length = std::min(NEEDLE_LENGTH, name.size());
+        needles.push_back(name.substr(rng() % (name.size() - length + 1),
+                                      length));
+    }
+    size_t indexed_hits = 0;
+    start = monotonic_us();
+    for (const auto &needle : needles) {
+        catalog.for_each_containing(
+            needle, [&](const CatalogEntry &) { ++indexed_hits; });
+    }
+    double indexed_qps = per_second(start, needles.size());
+    // what every LIST did before the index
+    size_t scan_hits = 0;
+    start = monotonic_us();
+    for (const auto &needle : needles) {
+        catalog.for_each([&](const CatalogEntry &entry) {
+            scan_hits += entry.name.find(needle) != std::string_view::npos;
+        });
+    }
+    double scan_qps = per_second(start, needles.size());
+
+    start = monotonic_us();
+    for (size_t k = 0; k < order.size(); k += 2) {
+        catalog.erase(names[order[k]]);
+    }
+    double erase_ns = ns_per(start, (order.size() + 1) / 2);
+
+    // what every GET, ADD and DEL did before the catalog
+    size_t scanned = 0;
+    start = monotonic_us();
+    for (size_t k = 0; k < SCAN_LOOKUPS; ++k) {
+        const std::string &name = names[order[k % order.size()]];
+        scanned += std::find(names.begin(), names.end(), name) - names.begin();
+    }
+    double scan_ns = ns_per(start, SCAN_LOOKUPS);
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << "{\"names\":" << names.size() << ",\"insert_ns\":" << insert_ns
+        << ",\"lookup_ns\":" << lookup_ns << ",\"miss_ns\":" << miss_ns
+        << ",\"erase_ns\":" << erase_ns << ",\"scan_lookup_ns\":" << scan_ns
+        << ",\"queries\":" << needles.size()
+        << ",\"indexed_queries_per_s\":" << indexed_qps
+        << ",\"scan_queries_per_s\":" << scan_qps
+        << ",\"indexed_hits\":" << indexed_hits
+        << ",\"scan_hits\":" << scan_hits
+        << ",\"left\":" << catalog.size() << ",\"found\":" << found
+        << ",\"scanned\":" << scanned << "}\n";
+    std::cout << out.str();
+    return 0;
+}
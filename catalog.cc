@@ -0,0 +1,193 @@
+#include "catalog.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace {
+
+uint32_t trigram_at(std::string_view name, size_t i) {
+    return (uint32_t)(unsigned char)name[i] << 16 |
+           (uint32_t)(unsigned char)name[i + 1] << 8 |
+           (uint32_t)(unsigned char)name[i + 2];
+}
+
+// distinct trigrams of name
+std::vector<uint32_t> trigrams(std::string_view name) {
+    std::vector<uint32_t> result;
+    for (size_t i = 0; i + TRIGRAM <= name.size(); ++i) {
+        result.push_back(trigram_at(name, i));
+    }
+    std::sort(result.begin(), result.end());
+    result.erase(std::unique(result.begin(), result.end()), result.end());
+    return result;
+}
+
+} // namespace
+
+CatalogEntry *Catalog::find(std::string_view name) {
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    return &entries[it->second];
+}
+
+const CatalogEntry *Catalog::find(std::string_view name) const {
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    return &entries[it->second];
+}
+
+bool Catalog::insert(std::string_view name, uint64_t size, FileState state) {
+    if (name.empty() || index.find(name) != index.end()) {
+        return false;
+    }
+    size_t position;
+    if (free_entries.empty()) {
+        position = entries.size();
+        entries.emplace_back();
+    }
+    else {
+        position = free_entries.back();
+        free_entries.pop_back();
+    }
+    CatalogEntry &entry = entries[position];
+    entry.name = intern(name);
+    entry.size = size;
+    entry.state = state;
+    index.emplace(entry.name, position);
+    ++version_;
+    for (uint32_t trigram : trigrams(name)) {
+        postings[trigram].push_back(position);
+        ++live_postings;
+    }
+    return true;
+}
+
+bool Catalog::erase(std::string_view name) {
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return false;
+    }
+    size_t position = it->second;
+    index.erase(it);
+    ++version_;
+    size_t indexed = trigrams(entries[position].name).size();
+    wasted_bytes += entries[position].name.size();
+    entries[position].name = std::string_view();
+    if (indexed == 0) {
+        free_entries.push_back(position);
+    }
+    else {
+        dead_entries.push_back(position);
+        live_postings -= indexed;
+        stale_postings += indexed;
+        if (stale_postings > live_postings) {
+            purge_postings();
+        }
+    }
+    if (wasted_bytes > ARENA_CHUNK && wasted_bytes * 2 > arena_bytes) {
+        compact();
+    }
+    return true;
+}
+
+size_t Catalog::size() const {
+    return index.size();
+}
+
+uint64_t Catalog::version() const {
+    return version_;
+}
+
+void Catalog::clear() {
+    entries.clear();
+    free_entries.clear();
+    dead_entries.clear();
+    index.clear();
+    ++version_;
+    postings.clear();
+    live_postings = 0;
+    stale_postings = 0;
+    chunks.clear();
+    chunk_used = ARENA_CHUNK;
+    arena_bytes = 0;
+    wasted_bytes = 0;
+}
+
+std::string_view Catalog::intern(std::string_view name) {
+    char *place;
+    if (name.size() > ARENA_CHUNK) {
+        // the name gets its own chunk, put before the current one, so that
+        // the current one stays last
+        chunks.emplace_back(new char[name.size()]);
+        place = chunks.back().get();
+        if (chunks.size() > 1) {
+            std::swap(chunks[chunks.size() - 1], chunks[chunks.size() - 2]);
+        }
+    }
+    else {
+        if (chunk_used + name.size() > ARENA_CHUNK) {
+            chunks.emplace_back(new char[ARENA_CHUNK]);
+            chunk_used = 0;
+        }
+        place = chunks.back().get() + chunk_used;
+        chunk_used += name.size();
+    }
+    memcpy(place, name.data(), name.size());
+    arena_bytes += name.size();
+    return std::string_view(place, name.size());
+}
+
+void Catalog::compact() {
+    std::vector<std::unique_ptr<char[]>> old_chunks;
+    old_chunks.swap(chunks);
+    chunk_used = ARENA_CHUNK;
+    arena_bytes = 0;
+    wasted_bytes = 0;
+    index.clear();
+    for (size_t i = 0; i < entries.size(); ++i) {
+        if (!entries[i].name.empty()) {
+            entries[i].name = intern(entries[i].name);
+            index.emplace(entries[i].name, i);
+        }
+    }
+}
+
+const std::vector<uint32_t> *
+Catalog::shortest_posting(std::string_view needle) const {
+    const std::vector<uint32_t> *result = nullptr;
+    for (size_t i = 0; i + TRIGRAM <= needle.size(); ++i) {
+        auto it = postings.find(trigram_at(needle, i));
+        if (it == postings.end()) {
+            return nullptr;
+        }
+        if (result == nullptr || it->second.size() < result->size()) {
+            result = &it->second;
+        }
+    }
+    return result;
+}
+
+void Catalog::purge_postings() {
+    for (auto it = postings.begin(); it != postings.end();) {
+        auto &list = it->second;
+        list.erase(std::remove_if(list.begin(), list.end(),
+                                  [this](uint32_t position) {
+                                      return entries[position].name.empty();
+                                  }),
+                   list.end());
+        if (list.empty()) {
+            it = postings.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    stale_postings = 0;
+    free_entries.insert(free_entries.end(), dead_entries.begin(),
+                        dead_entries.end());
+    dead_entries.clear();
+}
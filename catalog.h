@@ -0,0 +1,108 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// names are allocated from chunks of this size, longer names get own chunk
+const size_t ARENA_CHUNK = 1 << 20;
+// length of substrings indexed for searching
+const size_t TRIGRAM = 3;
+
+enum class FileState { UPLOADING, COMPLETE };
+
+class CatalogEntry {
+  public:
+    // points into the arena of the catalog, empty for free entries
+    std::string_view name;
+    // for uploading files it's the size announced in ADD
+    uint64_t size;
+    FileState state;
+};
+
+// files in shared folder, with O(1) lookup by name and trigram index for
+// substring search
+class Catalog {
+  public:
+    // returns nullptr if there is no such file
+    CatalogEntry *find(std::string_view name);
+    const CatalogEntry *find(std::string_view name) const;
+    // returns false if the name is already present
+    bool insert(std::string_view name, uint64_t size, FileState state);
+    // returns false if there was no such file
+    bool erase(std::string_view name);
+    size_t size() const;
+    void clear();
+    // changes whenever a name is added or removed
+    uint64_t version() const;
+
+    template <typename Function>
+    void for_each(Function function) const {
+        for (const auto &entry : entries) {
+            if (!entry.name.empty()) {
+                function(entry);
+            }
+        }
+    }
+
+    // calls function for every file whose name contains needle, needles
+    // shorter than a trigram are matched against all names
+    template <typename Function>
+    void for_each_containing(std::string_view needle,
+                             Function function) const {
+        if (needle.size() < TRIGRAM) {
+            for_each([&](const CatalogEntry &entry) {
+                if (entry.name.find(needle) != std::string_view::npos) {
+                    function(entry);
+                }
+            });
+            return;
+        }
+        const std::vector<uint32_t> *candidates = shortest_posting(needle);
+        if (candidates == nullptr) {
+            return;
+        }
+        for (uint32_t position : *candidates) {
+            const CatalogEntry &entry = entries[position];
+            if (!entry.name.empty() &&
+                entry.name.find(needle) != std::string_view::npos) {
+                function(entry);
+            }
+        }
+    }
+
+  private:
+    std::string_view intern(std::string_view name);
+    // copies live names to fresh chunks once most of the arena is garbage
+    void compact();
+    // returns posting list of the rarest trigram of needle, nullptr if some
+    // trigram of needle does not occur at all
+    const std::vector<uint32_t> *
+    shortest_posting(std::string_view needle) const;
+    // drops postings of erased entries and makes their slots reusable
+    void purge_postings();
+
+    std::vector<CatalogEntry> entries;
+    std::vector<size_t> free_entries;
+    // erased entries still referenced from postings, they are not reused
+    // until the postings are purged, so a posting never points to a name
+    // that was not indexed under it
+    std::vector<size_t> dead_entries;
+    std::unordered_map<std::string_view, size_t> index;
+    uint64_t version_ = 0;
+
+    std::unordered_map<uint32_t, std::vector<uint32_t>> postings;
+    size_t live_postings = 0;
+    size_t stale_postings = 0;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunk_used = ARENA_CHUNK;
+    size_t arena_bytes = 0;
+    size_t wasted_bytes = 0;
+};
+
+#endif
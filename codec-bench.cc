@@ -0,0 +1,90 @@
+// microbenchmark of the wire codec: packs PACKETS commands, alternately a
+// simple LIST and a complex ADD with the same name, into a reused buffer
+// and parses as many back, the way both binaries do it for every datagram;
+// results go to stdout as one json object
+#include <boost/program_options.hpp>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "helper.h"
+#include "timer.h"
+
+int32_t packet_count = 5000000;
+std::string name = "some_file_name.txt";
+
+void init(int argc, char **argv) {
+    namespace po = boost::program_options;
+    po::options_description desc(argv[0] + std::string(" flags"));
+    desc.add_options()(",n", po::value<int32_t>(&packet_count),
+                       "PACKETS (encoded and decoded, default 5000000)")(
+        ",f", po::value<std::string>(&name),
+        "NAME (carried in data, default some_file_name.txt)");
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+        if (packet_count <= 0) {
+            throw po::validation_error(
+                po::validation_error::invalid_option_value, "n",
+                std::to_string(packet_count));
+        }
+        // cmd_seq and param come before the name
+        if (name.size() > BUFFER_SIZE - CMD_SIZE - 2 * sizeof(uint64_t)) {
+            throw po::validation_error(
+                po::validation_error::invalid_option_value, "f", name);
+        }
+    }
+    catch (po::error &e) {
+        std::cerr << "INCORRECT USAGE\n" << e.what() << "\n" << desc;
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv) {
+    init(argc, argv);
+    std::vector<char> buffer(BUFFER_SIZE);
+    // sums of what was packed and parsed, so that no work is optimized away
+    uint64_t check = 0;
+
+    uint64_t start = monotonic_us();
+    for (int32_t i = 0; i < packet_count; ++i) {
+        if (i & 1) {
+            check += pack_cmd(buffer.data(), ADD, i, i * 3, name);
+        }
+        else {
+            check += pack_cmd(buffer.data(), LIST, i, name);
+        }
+        check += buffer[CMD_SIZE + 7];
+    }
+    double encode_ns = (monotonic_us() - start) * 1000.0 / packet_count;
+
+    std::vector<char> simple(BUFFER_SIZE);
+    std::vector<char> complex(BUFFER_SIZE);
+    size_t simple_length = pack_cmd(simple.data(), LIST, 7, name);
+    size_t complex_length = pack_cmd(complex.data(), ADD, 7, 100, name);
+    cmd_view cmd;
+    start = monotonic_us();
+    for (int32_t i = 0; i < packet_count; ++i) {
+        if (i & 1) {
+            parse_cmd(cmd, complex.data(), complex_length);
+        }
+        else {
+            parse_cmd(cmd, simple.data(), simple_length);
+        }
+        check += cmd.cmd + cmd.cmd_seq + cmd.param + cmd.data.size();
+    }
+    double decode_ns = (monotonic_us() - start) * 1000.0 / packet_count;
+
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(1);
+    out << "{\"packets\":" << packet_count << ",\"name_bytes\":"
+        << name.size() << ",\"encode_ns\":" << encode_ns
+        << ",\"decode_ns\":" << decode_ns << ",\"check\":" << check
+        << "}\n";
+    std::cout << out.str();
+    return 0;
+}
@@ -1,89 +1,211 @@
 #include "helper.h"
 
 #include <boost/algorithm/string.hpp>
+#include <charconv>
 #include <endian.h>
 #include <errno.h>
 #include <random>
 #include <stdexcept>
 #include <string.h>
+#include <sys/socket.h>
 
 const std::string ReceiveTimeOutException::what_ = "Timeout while reading";
 
-ConnectionInfo::ConnectionInfo(const boost::posix_time::ptime &start_,
-                               int sock_fd_, int fd_,
+thread_local BufferPool buffer_pool;
+
+char *BufferPool::acquire() {
+    if (free_buffers.empty()) {
+        slabs.emplace_back(new char[BUFFER_SIZE * BUFFERS_PER_SLAB]);
+        char *slab = slabs.back().get();
+        for (size_t i = BUFFERS_PER_SLAB; i > 0; --i) {
+            free_buffers.push_back(slab + (i - 1) * BUFFER_SIZE);
+        }
+    }
+    char *buffer = free_buffers.back();
+    free_buffers.pop_back();
+    ++in_use;
+    return buffer;
+}
+
+void BufferPool::release(char *buffer) {
+    free_buffers.push_back(buffer);
+    --in_use;
+}
+
+size_t BufferPool::slabs_allocated() const {
+    return slabs.size();
+}
+
+size_t BufferPool::buffers_in_use() const {
+    return in_use;
+}
+
+ConnectionInfo::ConnectionInfo(uint64_t start_, int sock_fd_, int fd_,
                                const std::string &filename_,
                                bool was_accepted_, bool writing_,
                                const std::string &ip_, uint16_t port_) {
     start = start_;
+    timer = NO_TIMER;
     sock_fd = sock_fd_;
     fd = fd_;
     filename = filename_;
     was_accepted = was_accepted_;
     writing = writing_;
-    memset(buffer, '\0', BUFFER_SIZE);
+    buffer = nullptr;
     position = 0;
     buf_size = 0;
     ip = ip_;
     port = port_;
+    zero_copy = false;
+    pipe_fds[0] = -1;
+    pipe_fds[1] = -1;
+    token = 0;
+    remaining = UINT64_MAX;
+    phase = SessionPhase::NONE;
+    cmd_seq = 0;
+    began = 0;
 }
 
 ConnectionInfo::ConnectionInfo() {
+    start = 0;
+    timer = NO_TIMER;
     sock_fd = 0;
     fd = 0;
     was_accepted = false;
     writing = false;
-    memset(buffer, '\0', BUFFER_SIZE);
+    buffer = nullptr;
     position = 0;
     buf_size = 0;
     port = 0;
+    zero_copy = false;
+    pipe_fds[0] = -1;
+    pipe_fds[1] = -1;
+    token = 0;
+    remaining = UINT64_MAX;
+    phase = SessionPhase::NONE;
+    cmd_seq = 0;
+    began = 0;
 }
 
-void send_cmd(const simpl_cmd &cmd, int sock) {
-    size_t size = CMD_SIZE + sizeof(cmd.cmd_seq) + cmd.data.size();
-    char buffer[size];
-    memset(buffer, '\0', sizeof(buffer));
-    strcpy(buffer, cmd.cmd.c_str());
-    int64_t seq = htobe64(cmd.cmd_seq);
-    memcpy(buffer + CMD_SIZE, &seq, sizeof(seq));
-    memcpy(buffer + CMD_SIZE + sizeof(cmd.cmd_seq), cmd.data.c_str(),
-           cmd.data.size());
-
-    if (sendto(sock, buffer, size, 0, (const sockaddr *)(&cmd.addr),
-               sizeof(cmd.addr)) < 0) {
+ConnectionInfo::ConnectionInfo(ConnectionInfo &&other) noexcept
+    : buffer(nullptr) {
+    *this = std::move(other);
+}
+
+ConnectionInfo &ConnectionInfo::operator=(ConnectionInfo &&other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+    release_buffer();
+    start = other.start;
+    timer = other.timer;
+    sock_fd = other.sock_fd;
+    fd = other.fd;
+    filename = std::move(other.filename);
+    was_accepted = other.was_accepted;
+    writing = other.writing;
+    buffer = other.buffer;
+    other.buffer = nullptr;
+    position = other.position;
+    buf_size = other.buf_size;
+    ip = std::move(other.ip);
+    port = other.port;
+    zero_copy = other.zero_copy;
+    pipe_fds[0] = other.pipe_fds[0];
+    pipe_fds[1] = other.pipe_fds[1];
+    token = other.token;
+    remaining = other.remaining;
+    phase = other.phase;
+    cmd_seq = other.cmd_seq;
+    began = other.began;
+    return *this;
+}
+
+void ConnectionInfo::attach_buffer() {
+    if (buffer == nullptr) {
+        buffer = buffer_pool.acquire();
+    }
+}
+
+void ConnectionInfo::release_buffer() {
+    if (buffer != nullptr) {
+        buffer_pool.release(buffer);
+        buffer = nullptr;
+    }
+}
+
+namespace {
+
+void send_buffer(const char *buffer, size_t len,
+                 const struct sockaddr_in &addr, int sock) {
+    if (sendto(sock, buffer, len, 0, (const sockaddr *)(&addr),
+               sizeof(addr)) < 0) {
         throw std::logic_error("Failed to send" + std::to_string(errno) + " " +
                                strerror(errno));
     }
 }
 
+// packs header and data, param is written only for complex commands
+size_t pack(char *buffer, Command cmd, uint64_t cmd_seq, bool with_param,
+            uint64_t param, std::string_view data) {
+    const char *name = COMMANDS[cmd].name;
+    size_t name_len = strlen(name);
+    memcpy(buffer, name, name_len);
+    memset(buffer + name_len, '\0', CMD_SIZE - name_len);
+    size_t len = CMD_SIZE;
+    int64_t tmp = htobe64(cmd_seq);
+    memcpy(buffer + len, &tmp, sizeof(tmp));
+    len += sizeof(tmp);
+    if (with_param) {
+        tmp = htobe64(param);
+        memcpy(buffer + len, &tmp, sizeof(tmp));
+        len += sizeof(tmp);
+    }
+    memcpy(buffer + len, data.data(), data.size());
+    return len + data.size();
+}
+
+} // namespace
+
+void send_cmd(const simpl_cmd &cmd, int sock) {
+    char buffer[BUFFER_SIZE];
+    size_t len = pack_cmd(buffer, cmd.cmd, cmd.cmd_seq, cmd.data);
+    send_buffer(buffer, len, cmd.addr, sock);
+}
+
 void send_cmd(const cmplx_cmd &cmd, int sock) {
-    size_t size =
-        CMD_SIZE + sizeof(cmd.cmd_seq) + sizeof(cmd.param) + cmd.data.size();
-    char buffer[size];
-    memset(buffer, '\0', sizeof(buffer));
-    strcpy(buffer, cmd.cmd.c_str());
-    int64_t tmp = htobe64(cmd.cmd_seq);
-    memcpy(buffer + CMD_SIZE, &tmp, sizeof(tmp));
-    tmp = htobe64(cmd.param);
-    memcpy(buffer + CMD_SIZE + sizeof(cmd.cmd_seq), &tmp, sizeof(tmp));
-    memcpy(buffer + CMD_SIZE + sizeof(cmd.cmd_seq) + sizeof(cmd.param),
-           cmd.data.c_str(), cmd.data.size());
+    char buffer[BUFFER_SIZE];
+    size_t len = pack_cmd(buffer, cmd.cmd, cmd.cmd_seq, cmd.param, cmd.data);
+    send_buffer(buffer, len, cmd.addr, sock);
+}
 
-    if (sendto(sock, buffer, size, 0, (const sockaddr *)(&cmd.addr),
-               sizeof(cmd.addr)) < 0) {
-        throw std::logic_error("Failed to send");
-    }
+size_t pack_cmd(char *buffer, Command cmd, uint64_t cmd_seq,
+                std::string_view data) {
+    return pack(buffer, cmd, cmd_seq, false, 0, data);
+}
+
+size_t pack_cmd(char *buffer, Command cmd, uint64_t cmd_seq, uint64_t param,
+                std::string_view data) {
+    return pack(buffer, cmd, cmd_seq, true, param, data);
 }
 
-// determine whether command cmd is a complex command
-bool is_complex(const std::string &cmd) {
-    return cmd == ADD || cmd == GOOD_DAY || cmd == CONNECT_ME ||
-           cmd == CAN_ADD;
+void stamp_cmd_seq(char *packet, uint64_t cmd_seq) {
+    int64_t seq = htobe64(cmd_seq);
+    memcpy(packet + CMD_SIZE, &seq, sizeof(seq));
+}
+
+size_t pack_frame(char *buffer, Command cmd, uint64_t cmd_seq, uint64_t param,
+                  std::string_view data) {
+    size_t len =
+        pack(buffer + FRAME_LENGTH_SIZE, cmd, cmd_seq,
+             COMMANDS[cmd].complex, param, data);
+    uint32_t length = htobe32(len);
+    memcpy(buffer, &length, sizeof(length));
+    return FRAME_LENGTH_SIZE + len;
 }
 
 // cmd is the result
-void recv_cmd(cmplx_cmd &cmd, int sock) {
-    char buffer[BUFFER_SIZE];
-    memset(buffer, '\0', BUFFER_SIZE);
+void recv_cmd(cmd_view &cmd, char *buffer, int sock) {
     ssize_t rcv_len;
     socklen_t addrlen = sizeof(cmd.addr);
     if ((rcv_len = recvfrom(sock, buffer, BUFFER_SIZE, 0,
@@ -96,34 +218,116 @@ void recv_cmd(cmplx_cmd &cmd, int sock) {
     if (addrlen > sizeof(cmd.addr)) {
         throw std::logic_error("Something went terribly wrong");
     }
+    parse_cmd(cmd, buffer, rcv_len);
+}
 
-    if (rcv_len < CMD_SIZE) {
+void parse_cmd(cmd_view &cmd, const char *buffer, size_t len) {
+    if (len < CMD_SIZE + sizeof(cmd.cmd_seq)) {
         throw std::runtime_error("Packet too small.");
     }
-    char temp_buffer[CMD_SIZE + 1];
-    memset(temp_buffer, '\0', sizeof(temp_buffer));
-    memcpy(temp_buffer, buffer, CMD_SIZE);
-    cmd.cmd = std::string(temp_buffer, CMD_SIZE + 1);
-    int64_t tmp = 0;
-    if (uint64_t(rcv_len) < CMD_SIZE + sizeof(cmd.cmd_seq)) {
-        throw std::runtime_error("Packet too small.");
+    cmd.name = std::string_view(buffer, strnlen(buffer, CMD_SIZE));
+    uint64_t head;
+    uint16_t tail;
+    memcpy(&head, buffer, sizeof(head));
+    memcpy(&tail, buffer + sizeof(head), sizeof(tail));
+    CommandKey key(head, tail);
+    cmd.cmd = UNKNOWN_CMD;
+    for (const auto &info : COMMANDS) {
+        if (info.key == key) {
+            cmd.cmd = info.cmd;
+            break;
+        }
     }
+
+    int64_t tmp;
     memcpy(&tmp, buffer + CMD_SIZE, sizeof(tmp));
     cmd.cmd_seq = be64toh(tmp);
-    if (is_complex(cmd.cmd)) {
-        if (uint64_t(rcv_len) <
-            CMD_SIZE + sizeof(cmd.cmd_seq) + sizeof(cmd.param)) {
+    size_t data_start = CMD_SIZE + sizeof(cmd.cmd_seq);
+    cmd.param = 0;
+    if (cmd.cmd != UNKNOWN_CMD && COMMANDS[cmd.cmd].complex) {
+        if (len < data_start + sizeof(cmd.param)) {
             throw std::runtime_error("Packet too small.");
         }
-        memcpy(&tmp, buffer + CMD_SIZE + sizeof(tmp), sizeof(tmp));
+        memcpy(&tmp, buffer + data_start, sizeof(tmp));
         cmd.param = be64toh(tmp);
-        cmd.data = std::string(buffer + CMD_SIZE + sizeof(cmd.cmd_seq) +
-                               sizeof(cmd.param));
+        data_start += sizeof(cmd.param);
+    }
+    // data ends at first '\0', as it would for a string read from the packet
+    cmd.data = std::string_view(
+        buffer + data_start, strnlen(buffer + data_start, len - data_start));
+    size_t payload_start = data_start + cmd.data.size() + 1;
+    cmd.payload = payload_start <= len
+                      ? std::string_view(buffer + payload_start,
+                                         len - payload_start)
+                      : std::string_view();
+}
+
+char *SendBatch::reserve(size_t len, const struct sockaddr_in &addr) {
+    if (storage.size() < used + len) {
+        storage.resize(std::max(used + len, 2 * storage.size()));
+    }
+    offsets.push_back(used);
+    addrs.push_back(addr);
+    return storage.data() + used;
+}
+
+void SendBatch::add(const char *packet, size_t len,
+                    const struct sockaddr_in &addr) {
+    memcpy(reserve(len, addr), packet, len);
+    lengths.push_back(len);
+    used += len;
+}
+
+void SendBatch::add(Command cmd, uint64_t cmd_seq, std::string_view data,
+                    const struct sockaddr_in &addr) {
+    size_t len = pack_cmd(reserve(BUFFER_SIZE, addr), cmd, cmd_seq, data);
+    lengths.push_back(len);
+    used += len;
+}
+
+void SendBatch::add(Command cmd, uint64_t cmd_seq, uint64_t param,
+                    std::string_view data, const struct sockaddr_in &addr) {
+    size_t len =
+        pack_cmd(reserve(BUFFER_SIZE, addr), cmd, cmd_seq, param, data);
+    lengths.push_back(len);
+    used += len;
+}
+
+size_t SendBatch::size() const {
+    return offsets.size();
+}
+
+void SendBatch::flush(int sock) {
+    msgs.resize(offsets.size());
+    iovecs.resize(offsets.size());
+    for (size_t i = 0; i < offsets.size(); ++i) {
+        iovecs[i].iov_base = storage.data() + offsets[i];
+        iovecs[i].iov_len = lengths[i];
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
-    else {
-        cmd.param = 0;
-        cmd.data = std::string(buffer + CMD_SIZE + sizeof(cmd.param));
+    size_t sent = 0;
+    while (sent < msgs.size()) {
+        int count = sendmmsg(sock, msgs.data() + sent, msgs.size() - sent, 0);
+        if (count < 0) {
+            int e = errno;
+            std::cerr << "Error occured: Failed to send datagram "
+                      << strerror(e) << "\n";
+            if (e == EAGAIN || e == EWOULDBLOCK) {
+                break;
+            }
+            // skip the datagram that failed
+            count = 1;
+        }
+        sent += count;
     }
+    used = 0;
+    offsets.clear();
+    lengths.clear();
+    addrs.clear();
 }
 
 uint64_t get_cmd_seq() {
@@ -132,27 +336,32 @@ uint64_t get_cmd_seq() {
     return rng();
 }
 
-int compute_timeout(const std::vector<ConnectionInfo> &connections,
-                    const std::map<uint64_t, boost::posix_time::ptime> &starts,
-                    int timeout) {
-    auto now = boost::posix_time::microsec_clock::local_time();
-    auto mini = now;
-    for (const auto &info : connections) {
-        mini = std::min(mini, info.start);
-    }
-    for (const auto &start : starts) {
-        mini = std::min(mini, start.second);
-    }
-    if (mini == now) {
-        return -1;
+bool fits_inline(std::string_view name, uint64_t size) {
+    // param and the '\0' after the name take room from data too
+    uint64_t room = DATA_MAX - sizeof(uint64_t) - 1;
+    return name.size() <= room && size <= room - name.size();
+}
+
+std::string append_number(std::string_view data, uint64_t number) {
+    std::string result(data);
+    result += NUMBER_SEPARATOR;
+    result += std::to_string(number);
+    return result;
+}
+
+std::string_view split_number(std::string_view data, uint64_t &number) {
+    number = 0;
+    size_t separator = data.rfind(NUMBER_SEPARATOR);
+    if (separator == std::string_view::npos) {
+        return data;
     }
-    auto elapsed = now - mini;
-    int elapsed_miliseconds = elapsed.total_microseconds() / 1000;
-    int new_timeout = timeout * 1000 - elapsed_miliseconds;
-    if (new_timeout < 0) {
-        return 0;
+    const char *end = data.data() + data.size();
+    auto result = std::from_chars(data.data() + separator + 1, end, number);
+    if (result.ec != std::errc() || result.ptr != end) {
+        number = 0;
+        return data;
     }
-    return new_timeout;
+    return data.substr(0, separator);
 }
 
 std::string get_name_from_path(const std::string &path) {
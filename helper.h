@@ -1,9 +1,16 @@
+#include <algorithm>
 #include <arpa/inet.h>
-#include <boost/date_time/posix_time/posix_time_types.hpp>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <sys/socket.h>
 #include <unistd.h>
+#include <vector>
+
+#include "timer.h"
 
 const int32_t TIMEOUT_DEFAULT = 5;
 const int32_t TIMEOUT_MAX = 300;
@@ -11,18 +18,129 @@ const int32_t PORT_MAX = 65535;
 const int32_t DATA_MAX = 65489;
 const uint32_t CMD_SIZE = 10;
 const int32_t BUFFER_SIZE = 65535;
+const size_t BUFFERS_PER_SLAB = 16;
 const int32_t EXIT_INTERRUPT = 130;
+// numbers carried in data after a filename are separated by this character,
+// because it can't occur in a filename:
+// - when the server has a shared data port, CONNECT_ME and CAN_ADD carry
+//   a transfer token, and the client sends the token as the first
+//   TOKEN_SIZE bytes on the connection, in network byte order
+// - GET_RANGE may carry length of the range, param is its offset, its
+//   CONNECT_ME carries size of the whole file before the token, a range
+//   that starts past the end is answered with NO_WAY
+// - GOOD_DAY of a server with a shared data port carries the port after
+//   the multicast address
+const char NUMBER_SEPARATOR = '/';
+const size_t TOKEN_SIZE = sizeof(uint64_t);
+// sent instead of a transfer token, it makes the connection a data session,
+// which carries many transfers one after another: each request and reply is
+// a frame, that is length of the packed command in FRAME_LENGTH_SIZE bytes
+// in network byte order, the command packed as in a datagram and, for ADD
+// and CONNECT_ME, param bytes of the file, requests are answered in order,
+// so the next one can be sent before the previous reply arrives:
+// - GET and GET_RANGE are answered with CONNECT_ME or NO_WAY
+// - ADD is answered with CAN_ADD once the file is stored, or NO_WAY, the
+//   file is sent right after ADD in both cases
+const uint64_t SESSION_TOKEN = UINT64_MAX;
+const size_t FRAME_LENGTH_SIZE = sizeof(uint32_t);
+// files that fit in one datagram can travel inside it, after the name and a
+// '\0' that ends it, param is size of the file:
+// - GET_INLINE is answered with FILE_DATA carrying the file, or like GET if
+//   the file is too big or the server does not send files inline
+// - ADD_INLINE carries the file, it's answered with ADDED once the file is
+//   stored, or like ADD if the server does not take files inline, so the
+//   client sends it over tcp then
+// lost datagrams are sent again with the same cmd_seq, the server answers
+// a repeated ADD_INLINE with ADDED again instead of refusing the name
+// downloads are written here until they finish, so a failed one can be
+// resumed from where it stopped
+const std::string PART_SUFFIX = ".part";
+
+enum Command : uint8_t {
+    HELLO,
+    GOOD_DAY,
+    LIST,
+    MY_LIST,
+    GET,
+    CONNECT_ME,
+    DEL,
+    ADD,
+    NO_WAY,
+    CAN_ADD,
+    GET_RANGE,
+    GET_INLINE,
+    FILE_DATA,
+    ADD_INLINE,
+    ADDED,
+    UNKNOWN_CMD
+};
+
+// command name as an integer pair, equal to the first CMD_SIZE bytes of a
+// packet loaded with memcpy
+class CommandKey {
+  public:
+    uint64_t head;
+    uint16_t tail;
+
+    // name is padded with '\0' to CMD_SIZE
+    constexpr explicit CommandKey(const char *name)
+        : head(word<uint64_t>(name, 0)), tail(word<uint16_t>(name, 8)) {
+    }
+    CommandKey(uint64_t head_, uint16_t tail_) : head(head_), tail(tail_) {
+    }
+    bool operator==(const CommandKey &other) const {
+        return head == other.head && tail == other.tail;
+    }
+
+  private:
+    static constexpr size_t length(const char *name) {
+        size_t len = 0;
+        while (name[len] != '\0') {
+            ++len;
+        }
+        return len;
+    }
 
-const std::string HELLO = std::string("HELLO\0\0\0\0\0\0", CMD_SIZE + 1);
-const std::string GOOD_DAY = std::string("GOOD_DAY\0\0\0", CMD_SIZE + 1);
-const std::string LIST = std::string("LIST\0\0\0\0\0\0\0", CMD_SIZE + 1);
-const std::string MY_LIST = std::string("MY_LIST\0\0\0\0", CMD_SIZE + 1);
-const std::string GET = std::string("GET\0\0\0\0\0\0\0\0", CMD_SIZE + 1);
-const std::string CONNECT_ME = std::string("CONNECT_ME\0", CMD_SIZE + 1);
-const std::string DEL = std::string("DEL\0\0\0\0\0\0\0\0", CMD_SIZE + 1);
-const std::string ADD = std::string("ADD\0\0\0\0\0\0\0\0", CMD_SIZE + 1);
-const std::string NO_WAY = std::string("NO_WAY\0\0\0\0\0", CMD_SIZE + 1);
-const std::string CAN_ADD = std::string("CAN_ADD\0\0\0\0", CMD_SIZE + 1);
+    template <typename Word>
+    static constexpr Word word(const char *name, size_t from) {
+        Word result = 0;
+        size_t len = length(name);
+        for (size_t i = 0; i < sizeof(Word); ++i) {
+            Word byte = from + i < len ? (unsigned char)name[from + i] : 0;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            result |= byte << (8 * i);
+#else
+            result |= byte << (8 * (sizeof(Word) - 1 - i));
+#endif
+        }
+        return result;
+    }
+};
+
+class CommandInfo {
+  public:
+    Command cmd;
+    const char *name;
+    // complex commands carry param
+    bool complex;
+    CommandKey key;
+
+    constexpr CommandInfo(Command cmd_, const char *name_, bool complex_)
+        : cmd(cmd_), name(name_), complex(complex_), key(name_) {
+    }
+};
+
+// indexed by Command
+constexpr CommandInfo COMMANDS[] = {
+    {HELLO, "HELLO", false},           {GOOD_DAY, "GOOD_DAY", true},
+    {LIST, "LIST", false},             {MY_LIST, "MY_LIST", false},
+    {GET, "GET", false},               {CONNECT_ME, "CONNECT_ME", true},
+    {DEL, "DEL", false},               {ADD, "ADD", true},
+    {NO_WAY, "NO_WAY", false},         {CAN_ADD, "CAN_ADD", true},
+    {GET_RANGE, "GET_RANGE", true},     {GET_INLINE, "GET_INLINE", false},
+    {FILE_DATA, "FILE_DATA", true},     {ADD_INLINE, "ADD_INLINE", true},
+    {ADDED, "ADDED", false},
+};
 
 class ReceiveTimeOutException : public std::exception {
   private:
@@ -32,28 +150,89 @@ class ReceiveTimeOutException : public std::exception {
     }
 };
 
+// transfer buffers of BUFFER_SIZE bytes carved from slabs that are never
+// freed, buffers that are given back are reused before a new slab is made
+class BufferPool {
+  public:
+    char *acquire();
+    void release(char *buffer);
+    size_t slabs_allocated() const;
+    size_t buffers_in_use() const;
+
+  private:
+    std::vector<std::unique_ptr<char[]>> slabs;
+    std::vector<char *> free_buffers;
+    size_t in_use = 0;
+};
+
+// every thread has its own pool, a buffer is given back by the thread that
+// took it
+extern thread_local BufferPool buffer_pool;
+
+enum class SessionPhase : uint8_t {
+    // connection of a single transfer
+    NONE,
+    // reading frame of the next request
+    REQUEST,
+    // reading file of ADD, fd is -1 if the file was refused
+    RECEIVE,
+    // sending frame of the reply, it's in buffer
+    REPLY,
+    // sending file of GET
+    SEND
+};
+
+// small handle, it can be moved but not copied, because it may own a buffer
 class ConnectionInfo {
   public:
-    boost::posix_time::ptime start;
+    // monotonic_ms() of the last activity
+    uint64_t start;
+    // timeout timer of the connection, NO_TIMER if there is none
+    uint64_t timer;
     int sock_fd;
     int fd;
     std::string filename;
     bool was_accepted;
     bool writing;
-    char buffer[BUFFER_SIZE];
+    // taken from buffer_pool only while data is moved, nullptr otherwise
+    char *buffer;
     int position;
     int buf_size;
     std::string ip;
     uint16_t port;
-    ConnectionInfo(const boost::posix_time::ptime &start_, int sock_fd_,
-                   int fd_, const std::string &filename_, bool was_accepted_,
+    // whether data is moved without copying it through buffer
+    bool zero_copy;
+    // pipe for splicing socket to file, -1 if not used
+    int pipe_fds[2];
+    // transfer token still to be sent (client) or being received (server),
+    // 0 if there is none
+    uint64_t token;
+    // bytes of the file still to be sent, UINT64_MAX for all up to its end
+    uint64_t remaining;
+    // what a data session is doing, NONE for other connections
+    SessionPhase phase;
+    // cmd_seq of the request a data session is handling
+    uint64_t cmd_seq;
+    // monotonic_us() when the file began to move, 0 if it did not, the
+    // server measures transfers with it
+    uint64_t began;
+    ConnectionInfo(uint64_t start_, int sock_fd_, int fd_,
+                   const std::string &filename_, bool was_accepted_,
                    bool writing_, const std::string &ip_, uint16_t port);
     ConnectionInfo();
+    ConnectionInfo(const ConnectionInfo &) = delete;
+    ConnectionInfo &operator=(const ConnectionInfo &) = delete;
+    ConnectionInfo(ConnectionInfo &&other) noexcept;
+    ConnectionInfo &operator=(ConnectionInfo &&other) noexcept;
+
+    // buffer is not given back on destruction, it has to be released
+    void attach_buffer();
+    void release_buffer();
 };
 
 class simpl_cmd {
   public:
-    std::string cmd;
+    Command cmd;
     uint64_t cmd_seq;
     std::string data;
 
@@ -63,12 +242,31 @@ class simpl_cmd {
 
 class cmplx_cmd {
   public:
-    std::string cmd;
+    Command cmd;
     uint64_t cmd_seq;
     uint64_t param;
     std::string data;
 
-    // used to determine who to send to when sending, filled in when receiving
+    // used to determine who to send to when sending
+    struct sockaddr_in addr;
+};
+
+// received command, name and data point into the buffer it was parsed from
+class cmd_view {
+  public:
+    // UNKNOWN_CMD if name is not a known command
+    Command cmd;
+    // command as it was received, without padding
+    std::string_view name;
+    uint64_t cmd_seq;
+    // 0 for simple commands
+    uint64_t param;
+    std::string_view data;
+    // bytes after the '\0' that ends data, the file of FILE_DATA and
+    // ADD_INLINE, empty if data is not ended by '\0'
+    std::string_view payload;
+
+    // filled in when receiving
     struct sockaddr_in addr;
 };
 
@@ -76,15 +274,59 @@ class cmplx_cmd {
 void send_cmd(const simpl_cmd &cmd, int sock);
 void send_cmd(const cmplx_cmd &cmd, int sock);
 
-// cmd is the result
-// if the command received was simpl_cmd, then param is equal to 0
-void recv_cmd(cmplx_cmd &cmd, int sock);
+// write command into buffer as it is sent over the network and return its
+// length, buffer has to fit CMD_SIZE, cmd_seq, param (for complex commands)
+// and data
+size_t pack_cmd(char *buffer, Command cmd, uint64_t cmd_seq,
+                std::string_view data);
+size_t pack_cmd(char *buffer, Command cmd, uint64_t cmd_seq, uint64_t param,
+                std::string_view data);
+// overwrites cmd_seq of already packed command
+void stamp_cmd_seq(char *packet, uint64_t cmd_seq);
+// write command as a frame of a data session and return its length, param
+// is written only for complex commands, buffer has to fit the length too
+size_t pack_frame(char *buffer, Command cmd, uint64_t cmd_seq, uint64_t param,
+                  std::string_view data);
+
+// cmd is the result, it points into buffer, which should be BUFFER_SIZE long
+void recv_cmd(cmd_view &cmd, char *buffer, int sock);
+// same as recv_cmd, but for datagram already in buffer, addr is not touched
+void parse_cmd(cmd_view &cmd, const char *buffer, size_t len);
+
+// datagrams collected to be sent with as few sendmmsg calls as possible,
+// they are packed into one reused buffer
+class SendBatch {
+  public:
+    void add(const char *packet, size_t len, const struct sockaddr_in &addr);
+    void add(Command cmd, uint64_t cmd_seq, std::string_view data,
+             const struct sockaddr_in &addr);
+    void add(Command cmd, uint64_t cmd_seq, uint64_t param,
+             std::string_view data, const struct sockaddr_in &addr);
+    size_t size() const;
+    // datagrams that could not be sent are dropped, like lost ones would be
+    void flush(int sock);
+
+  private:
+    // makes room for a packet of at most len bytes and returns where it goes
+    char *reserve(size_t len, const struct sockaddr_in &addr);
+
+    std::vector<char> storage;
+    size_t used = 0;
+    std::vector<size_t> offsets;
+    std::vector<size_t> lengths;
+    std::vector<struct sockaddr_in> addrs;
+    std::vector<struct mmsghdr> msgs;
+    std::vector<struct iovec> iovecs;
+};
 
 uint64_t get_cmd_seq();
 
-// timeout in seconds
-int compute_timeout(const std::vector<ConnectionInfo> &connections,
-                    const std::map<uint64_t, boost::posix_time::ptime> &starts,
-                    int timeout);
+// whether file of given name and size fits in FILE_DATA or ADD_INLINE
+bool fits_inline(std::string_view name, uint64_t size);
+
+// returns data with number appended after NUMBER_SEPARATOR
+std::string append_number(std::string_view data, uint64_t number);
+// returns data without number, number is set to 0 if data has none
+std::string_view split_number(std::string_view data, uint64_t &number);
 
 std::string get_name_from_path(const std::string &path);
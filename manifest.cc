@@ -0,0 +1,335 @@
+#include "manifest.h"
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace {
+
+const char MAGIC[8] = {'N', 'S', 'M', 'A', 'N', 'I', 'F', '1'};
+const uint8_t RECORD_ADD = 1;
+const uint8_t RECORD_DEL = 2;
+// records are written in batches of this size by rewrite
+const size_t WRITE_BATCH = 1 << 20;
+
+// the manifest starts with it, sync rewrites it in place
+class Header {
+  public:
+    char magic[8];
+    // identity and mtime of the folder when it matched the manifest
+    uint64_t dev;
+    uint64_t ino;
+    int64_t folder_mtime;
+    // CLOCK_REALTIME of that moment, in nanoseconds
+    int64_t synced_at;
+    // length of the manifest then, anything after it is not covered
+    uint64_t synced_length;
+};
+
+// records follow the header, each is aligned to 8 bytes, so that they can
+// be read in place from the mapping
+class Record {
+  public:
+    // of the whole record, name and padding included
+    uint32_t length;
+    uint8_t kind;
+    uint8_t unused;
+    uint16_t name_length;
+    // size and mtime are 0 for RECORD_DEL
+    uint64_t size;
+    int64_t mtime;
+
+    std::string_view name() const {
+        return std::string_view((const char *)(this + 1), name_length);
+    }
+};
+
+int64_t mtime_ns(const struct stat &st) {
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+}
+
+int64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+size_t record_length(size_t name_length) {
+    return (sizeof(Record) + name_length + 7) & ~(size_t)7;
+}
+
+// appends record to buffer
+void pack_record(std::string &buffer, uint8_t kind, std::string_view name,
+                 uint64_t size, int64_t mtime) {
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.length = record_length(name.size());
+    record.kind = kind;
+    record.name_length = name.size();
+    record.size = size;
+    record.mtime = mtime;
+    size_t start = buffer.size();
+    buffer.append((const char *)&record, sizeof(record));
+    buffer.append(name);
+    buffer.resize(start + record.length, '\0');
+}
+
+bool write_all(int fd, const char *data, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t written = pwrite(fd, data, len, offset);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+    return true;
+}
+
+// live records of the mapped manifest by name, false if it's damaged or
+// does not describe the folder any more
+bool replay(const char *data, uint64_t length, const std::string &folder,
+            std::unordered_map<std::string_view, const Record *> &live,
+            size_t &records) {
+    if (length < sizeof(Header)) {
+        return false;
+    }
+    Header header;
+    memcpy(&header, data, sizeof(header));
+    struct stat st;
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+        stat(folder.c_str(), &st) < 0 || header.dev != st.st_dev ||
+        header.ino != st.st_ino || header.folder_mtime != mtime_ns(st) ||
+        header.synced_at - header.folder_mtime < RACY_NS ||
+        header.synced_length != length) {
+        return false;
+    }
+    uint64_t position = sizeof(Header);
+    while (position < length) {
+        const Record *record = (const Record *)(data + position);
+        if (length - position < sizeof(Record) ||
+            record->length < record_length(record->name_length) ||
+            record->length % 8 != 0 || record->length > length - position) {
+            return false;
+        }
+        if (record->kind == RECORD_ADD) {
+            live[record->name()] = record;
+        }
+        else if (record->kind == RECORD_DEL) {
+            live.erase(record->name());
+        }
+        else {
+            return false;
+        }
+        ++records;
+        position += record->length;
+    }
+    // files changed in place don't change the folder, a few are checked
+    size_t stride = std::max<size_t>(1, live.size() / MANIFEST_SAMPLES);
+    size_t i = 0;
+    for (const auto &entry : live) {
+        if (i++ % stride != 0) {
+            continue;
+        }
+        std::string path = folder + "/" + std::string(entry.first);
+        if (stat(path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) ||
+            (uint64_t)st.st_size != entry.second->size ||
+            mtime_ns(st) != entry.second->mtime) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+std::vector<FolderEntry> scan_folder(const std::string &folder) {
+    DIR *dir = opendir(folder.c_str());
+    if (dir == nullptr) {
+        throw std::runtime_error("Failed to open " + folder + " " +
+                                 strerror(errno));
+    }
+    std::vector<std::string> names;
+    struct dirent *d;
+    while ((d = readdir(dir)) != nullptr) {
+        // directories are known without stat, anything else may be a link
+        // to a regular file
+        if (d->d_type != DT_DIR) {
+            names.emplace_back(d->d_name);
+        }
+    }
+    int dir_fd = dirfd(dir);
+    std::vector<FolderEntry> found(names.size());
+    std::vector<char> regular(names.size(), 0);
+    // every thread takes every SCAN_THREADS-th name, so they share nothing
+    auto stat_names = [&](size_t first) {
+        for (size_t i = first; i < names.size(); i += SCAN_THREADS) {
+            struct stat st;
+            if (fstatat(dir_fd, names[i].c_str(), &st, 0) == 0 &&
+                S_ISREG(st.st_mode)) {
+                found[i].name = std::move(names[i]);
+                found[i].size = st.st_size;
+                found[i].mtime = mtime_ns(st);
+                regular[i] = 1;
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    try {
+        for (int t = 1; t < SCAN_THREADS; ++t) {
+            threads.emplace_back(stat_names, t);
+        }
+    }
+    catch (std::exception &e) {
+        // names of threads that did not start are left to this one
+        for (size_t t = threads.size() + 1; t < (size_t)SCAN_THREADS; ++t) {
+            stat_names(t);
+        }
+    }
+    stat_names(0);
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    closedir(dir);
+
+    std::vector<FolderEntry> files;
+    files.reserve(found.size());
+    for (size_t i = 0; i < found.size(); ++i) {
+        if (regular[i]) {
+            files.push_back(std::move(found[i]));
+        }
+    }
+    return files;
+}
+
+Manifest::Manifest(const std::string &path_, const std::string &folder_)
+    : path(path_), folder(folder_) {
+    open_file();
+}
+
+Manifest::~Manifest() {
+    close(fd);
+}
+
+void Manifest::open_file() {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open manifest " + path + " " +
+                                 strerror(errno));
+    }
+    struct stat st;
+    length = fstat(fd, &st) == 0 ? st.st_size : 0;
+}
+
+bool Manifest::load(
+    const std::function<void(std::string_view, uint64_t)> &add) {
+    if (length < sizeof(Header)) {
+        return false;
+    }
+    void *mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    std::unordered_map<std::string_view, const Record *> live;
+    size_t records = 0;
+    bool valid = replay((const char *)mapped, length, folder, live, records);
+    if (valid) {
+        for (const auto &entry : live) {
+            add(entry.first, entry.second->size);
+        }
+        // records of removed files are dropped once they outnumber the rest
+        if (records > 2 * live.size() + 1024) {
+            std::vector<FolderEntry> files;
+            files.reserve(live.size());
+            for (const auto &entry : live) {
+                files.push_back({std::string(entry.first),
+                                 entry.second->size, entry.second->mtime});
+            }
+            rewrite(files);
+        }
+    }
+    munmap(mapped, length);
+    return valid;
+}
+
+void Manifest::rewrite(const std::vector<FolderEntry> &files) {
+    std::string temporary = path + ".tmp";
+    int out = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0644);
+    if (out < 0) {
+        throw std::runtime_error("Failed to create manifest " + temporary +
+                                 " " + strerror(errno));
+    }
+    // the header is filled in by sync
+    std::string buffer(sizeof(Header), '\0');
+    uint64_t written = 0;
+    bool ok = true;
+    for (const auto &file : files) {
+        pack_record(buffer, RECORD_ADD, file.name, file.size, file.mtime);
+        if (buffer.size() >= WRITE_BATCH) {
+            ok = ok && write_all(out, buffer.data(), buffer.size(), written);
+            written += buffer.size();
+            buffer.clear();
+        }
+    }
+    ok = ok && write_all(out, buffer.data(), buffer.size(), written);
+    close(out);
+    if (!ok || rename(temporary.c_str(), path.c_str()) < 0) {
+        unlink(temporary.c_str());
+        throw std::runtime_error("Failed to write manifest " + path);
+    }
+    close(fd);
+    open_file();
+    sync();
+}
+
+void Manifest::added(std::string_view name, uint64_t size, int64_t mtime) {
+    append(RECORD_ADD, name, size, mtime);
+}
+
+void Manifest::removed(std::string_view name) {
+    append(RECORD_DEL, name, 0, 0);
+}
+
+void Manifest::append(uint8_t kind, std::string_view name, uint64_t size,
+                      int64_t mtime) {
+    std::string buffer;
+    pack_record(buffer, kind, name, size, mtime);
+    // a failed write leaves length behind the file, so the header never
+    // matches it again and the next start scans the folder
+    if (write_all(fd, buffer.data(), buffer.size(), length)) {
+        length += buffer.size();
+    }
+    else {
+        length = UINT64_MAX;
+    }
+}
+
+void Manifest::sync() {
+    struct stat st;
+    if (length == UINT64_MAX || stat(folder.c_str(), &st) < 0) {
+        return;
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.dev = st.st_dev;
+    header.ino = st.st_ino;
+    header.folder_mtime = mtime_ns(st);
+    header.synced_at = realtime_ns();
+    header.synced_length = length;
+    write_all(fd, (const char *)&header, sizeof(header), 0);
+}
@@ -0,0 +1,69 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// threads that stat files of a scanned folder, on network disks every stat
+// waits for a round trip, so there are more of them than cores
+const int SCAN_THREADS = 16;
+// how many files of a loaded manifest are compared with the folder
+const size_t MANIFEST_SAMPLES = 32;
+// a folder changed this close to the moment its mtime was recorded may
+// have changed again within the same timestamp tick
+const int64_t RACY_NS = 1000000000;
+
+// regular file of the shared folder, mtime in nanoseconds
+class FolderEntry {
+  public:
+    std::string name;
+    uint64_t size;
+    int64_t mtime;
+};
+
+// regular files of folder (symlinks to them too), stat calls are spread
+// over SCAN_THREADS threads, throws if folder can't be read
+std::vector<FolderEntry> scan_folder(const std::string &folder);
+
+// append-only log of names, sizes and mtimes of files in the shared folder,
+// with the mtime of the folder at the moment they matched it; if the folder
+// did not change since, the manifest is loaded instead of scanning the
+// folder, it's read through mmap
+class Manifest {
+  public:
+    // the manifest file is created if it does not exist, throws if it can't
+    // be opened
+    Manifest(const std::string &path, const std::string &folder);
+    ~Manifest();
+    Manifest(const Manifest &) = delete;
+    Manifest &operator=(const Manifest &) = delete;
+
+    // calls add for every file if the manifest still describes the folder,
+    // name is valid only during the call, returns false without calling it
+    // if the folder has to be scanned
+    bool load(const std::function<void(std::string_view, uint64_t)> &add);
+    // replaces the manifest with files, after a scan or to drop records of
+    // removed files, the folder is recorded as matching it
+    void rewrite(const std::vector<FolderEntry> &files);
+    void added(std::string_view name, uint64_t size, int64_t mtime);
+    void removed(std::string_view name);
+    // records that the manifest matches the folder now, it's called only
+    // when no upload is changing the folder
+    void sync();
+
+  private:
+    void append(uint8_t kind, std::string_view name, uint64_t size,
+                int64_t mtime);
+    void open_file();
+
+    std::string path;
+    std::string folder;
+    int fd = -1;
+    // bytes of the file, records are written at its end
+    uint64_t length = 0;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+const size_t COUNTERS = (size_t)Counter::COUNT;
+const size_t HISTOGRAMS = (size_t)Histogram::COUNT;
+const uint64_t SUB_BUCKETS = 1 << HISTOGRAM_SUB_BITS;
+// exact values first, then SUB_BUCKETS for every magnitude up to 2^63
+const size_t BUCKETS = (64 - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS;
+
+const char *const COUNTER_NAMES[COUNTERS] = {
+    "netstore_commands_total{command=\"HELLO\"}",
+    "netstore_commands_total{command=\"LIST\"}",
+    "netstore_commands_total{command=\"GET\"}",
+    "netstore_commands_total{command=\"DEL\"}",
+    "netstore_commands_total{command=\"ADD\"}",
+    "netstore_malformed_packets_total",
+    "netstore_no_way_total",
+    "netstore_overloaded_total",
+    "netstore_timeouts_total",
+    "netstore_sent_bytes_total",
+    "netstore_received_bytes_total"};
+const char *const HISTOGRAM_NAMES[HISTOGRAMS] = {
+    "netstore_reply_latency_us", "netstore_transfer_duration_us"};
+const char *const QUANTILES[] = {"0.5", "0.9", "0.99", "0.999"};
+
+class HistogramData {
+  public:
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+// metrics of one thread, aligned so that no two threads write the same
+// cache line
+class alignas(64) Shard {
+  public:
+    std::atomic<uint64_t> counters[COUNTERS];
+    HistogramData histograms[HISTOGRAMS];
+};
+
+std::mutex shards_mutex;
+std::vector<Shard *> shards;
+
+Shard &local_shard() {
+    // threads of the server live until it exits, shards are never freed
+    thread_local Shard *shard = nullptr;
+    if (shard == nullptr) {
+        // value-initialized, so all zero
+        shard = new Shard();
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        shards.push_back(shard);
+    }
+    return *shard;
+}
+
+// only the owning thread writes, so there is no read-modify-write race
+void bump(std::atomic<uint64_t> &value, uint64_t n) {
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+size_t bucket_of(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    unsigned magnitude = 63 - __builtin_clzll(value);
+    uint64_t mantissa =
+        (value >> (magnitude - HISTOGRAM_SUB_BITS)) - SUB_BUCKETS;
+    return (magnitude - HISTOGRAM_SUB_BITS + 1) * SUB_BUCKETS + mantissa;
+}
+
+// highest value that falls into bucket
+uint64_t bucket_top(size_t bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned shift = bucket / SUB_BUCKETS - 1;
+    uint64_t mantissa = bucket % SUB_BUCKETS;
+    return ((SUB_BUCKETS + mantissa + 1) << shift) - 1;
+}
+
+// value of the given quantile, buckets hold count values
+uint64_t quantile(const uint64_t *buckets, uint64_t count, double q,
+                  uint64_t max) {
+    uint64_t rank = std::max<uint64_t>(1, q * count + 0.5);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return std::min(bucket_top(bucket), max);
+        }
+    }
+    return max;
+}
+
+// "# TYPE" line is written once for names that share a family
+void append_type(std::string &out, std::string &family, const char *name,
+                 const char *type) {
+    std::string current(name);
+    current = current.substr(0, current.find('{'));
+    if (current != family) {
+        family = current;
+        out += "# TYPE " + family + " " + type + "\n";
+    }
+}
+
+} // namespace
+
+void metrics_add(Counter counter, uint64_t n) {
+    bump(local_shard().counters[(size_t)counter], n);
+}
+
+void metrics_record(Histogram histogram, uint64_t value, uint64_t n) {
+    HistogramData &data = local_shard().histograms[(size_t)histogram];
+    bump(data.buckets[bucket_of(value)], n);
+    bump(data.sum, value * n);
+    if (value > data.max.load(std::memory_order_relaxed)) {
+        data.max.store(value, std::memory_order_relaxed);
+    }
+}
+
+std::string format_gauge(const char *name, int64_t value) {
+    return std::string("# TYPE ") + name + " gauge\n" + name + " " +
+           std::to_string(value) + "\n";
+}
+
+std::string format_metrics() {
+    uint64_t counters[COUNTERS] = {};
+    std::vector<uint64_t> buckets(HISTOGRAMS * BUCKETS, 0);
+    uint64_t sums[HISTOGRAMS] = {};
+    uint64_t maxes[HISTOGRAMS] = {};
+    {
+        std::lock_guard<std::mutex> lock(shards_mutex);
+        for (const Shard *shard : shards) {
+            for (size_t i = 0; i < COUNTERS; ++i) {
+                counters[i] +=
+                    shard->counters[i].load(std::memory_order_relaxed);
+            }
+            for (size_t h = 0; h < HISTOGRAMS; ++h) {
+                const HistogramData &data = shard->histograms[h];
+                for (size_t b = 0; b < BUCKETS; ++b) {
+                    buckets[h * BUCKETS + b] +=
+                        data.buckets[b].load(std::memory_order_relaxed);
+                }
+                sums[h] += data.sum.load(std::memory_order_relaxed);
+                maxes[h] = std::max(
+                    maxes[h], data.max.load(std::memory_order_relaxed));
+            }
+        }
+    }
+
+    std::string out;
+    std::string family;
+    for (size_t i = 0; i < COUNTERS; ++i) {
+        append_type(out, family, COUNTER_NAMES[i], "counter");
+        out += std::string(COUNTER_NAMES[i]) + " " +
+               std::to_string(counters[i]) + "\n";
+    }
+    for (size_t h = 0; h < HISTOGRAMS; ++h) {
+        const uint64_t *histogram = &buckets[h * BUCKETS];
+        uint64_t count = 0;
+        for (size_t b = 0; b < BUCKETS; ++b) {
+            count += histogram[b];
+        }
+        std::string name(HISTOGRAM_NAMES[h]);
+        append_type(out, family, HISTOGRAM_NAMES[h], "summary");
+        for (const char *q : QUANTILES) {
+            out += name + "{quantile=\"" + q + "\"} ";
+            out += count == 0 ? "NaN"
+                              : std::to_string(quantile(
+                                    histogram, count, std::stod(q),
+                                    maxes[h]));
+            out += "\n";
+        }
+        out += name + "{quantile=\"1\"} " +
+               (count == 0 ? "NaN" : std::to_string(maxes[h])) + "\n";
+        out += name + "_sum " + std::to_string(sums[h]) + "\n";
+        out += name + "_count " + std::to_string(count) + "\n";
+    }
+    return out;
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+enum class Counter {
+    HELLO,
+    LIST,
+    GET,
+    DEL,
+    ADD,
+    MALFORMED,
+    NO_WAY,
+    OVERLOAD,
+    TIMEOUTS,
+    BYTES_SENT,
+    BYTES_RECEIVED,
+    COUNT
+};
+
+// values are in microseconds
+enum class Histogram { REPLY_LATENCY, TRANSFER_DURATION, COUNT };
+
+// values below 2^HISTOGRAM_SUB_BITS are kept exactly, bigger ones in
+// buckets 2^-HISTOGRAM_SUB_BITS of their magnitude wide, as HdrHistogram
+// does, so every quantile is off by less than 7%
+const unsigned HISTOGRAM_SUB_BITS = 4;
+
+// every thread updates its own copy of the metrics, with plain stores to
+// relaxed atomics, so that the hot path has no locked instruction and no
+// shared cache line; readers sum the copies of all threads
+void metrics_add(Counter counter, uint64_t n = 1);
+// records value n times
+void metrics_record(Histogram histogram, uint64_t value, uint64_t n = 1);
+
+// metrics in prometheus text format, a line per counter and quantile
+std::string format_metrics();
+// gauges are read by their owner when metrics are formatted
+std::string format_gauge(const char *name, int64_t value);
+
+#endif
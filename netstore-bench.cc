@@ -0,0 +1,1018 @@
+// load generator for netstore-server: starts SERVERS servers on loopback,
+// each on its own port of the multicast group with its own folder of FILES
+// files, and CLIENTS threads that send a random mix of commands to random
+// servers for DURATION seconds, one request at a time, so latencies are
+// not hidden behind each other; results go to stdout as one json object;
+// -P keeps that many uploads open on the servers during the run, so that
+// the cost of a wakeup can be compared as they grow; with -S, GET and ADD
+// go through a data session per server instead, a batch of requests at a
+// time, with -I files that fit in a datagram go inside it; the time
+// servers take to answer their first HELLO is reported too, with -R for a
+// restart on the same folders, which -M lets them load from a manifest
+#include <atomic>
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <random>
+#include <signal.h>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "helper.h"
+#include "timer.h"
+
+enum Op { OP_HELLO, OP_LIST, OP_GET, OP_ADD, OPS };
+
+const char *const OP_NAMES[OPS] = {"HELLO", "LIST", "GET", "ADD"};
+// servers get this much space, so that ADD is never refused for it
+const int64_t SERVER_SPACE = (int64_t)1 << 50;
+// how long servers have to answer their first HELLO, a million files take
+// seconds to list
+const uint64_t STARTUP_MS = 60000;
+// HELLO is sent again this often until a server answers, which bounds how
+// precisely startup is timed
+const uint64_t STARTUP_POLL_US = 10000;
+// transfers that make no progress for this long fail
+const int TRANSFER_TIMEOUT_S = 5;
+// a LIST is answered once no more MY_LIST packets come for this long
+const uint64_t LIST_QUIET_US = 5000;
+// announced size of a held upload, more bytes than any run sends
+const uint64_t HOLD_SIZE = 1 << 16;
+
+// sizes of generated files, "fixed:N", "uniform:MIN:MAX" or "exp:MEAN"
+class SizeDistribution {
+  public:
+    std::string kind;
+    uint64_t a = 0;
+    uint64_t b = 0;
+
+    uint64_t draw(std::mt19937_64 &rng) const {
+        if (kind == "uniform") {
+            return std::uniform_int_distribution<uint64_t>(a, b)(rng);
+        }
+        if (kind == "exp") {
+            return std::exponential_distribution<double>(1.0 / a)(rng);
+        }
+        return a;
+    }
+};
+
+class BenchServer {
+  public:
+    pid_t pid = -1;
+    std::string folder;
+    int32_t port;
+    struct sockaddr_in group;
+    // files it shares from the start, with their sizes
+    std::vector<std::pair<std::string, uint64_t>> files;
+};
+
+// what one client thread saw, merged after the run
+class ClientStats {
+  public:
+    uint64_t requests[OPS] = {};
+    // no reply within the reply timeout
+    uint64_t lost[OPS] = {};
+    // NO_WAY, unexpected reply or failed transfer
+    uint64_t failed[OPS] = {};
+    // microseconds from sending to the first reply
+    std::vector<uint32_t> latencies[OPS];
+    uint64_t transfers = 0;
+    uint64_t bytes = 0;
+    std::vector<uint32_t> transfer_us;
+};
+
+std::string mcast_addr = "239.10.11.12";
+int32_t cmd_port = 30000;
+int32_t held_count = 0;
+// 0 when servers open a listening port per transfer
+int32_t data_port = 0;
+int32_t session_depth = 0;
+bool manifest_mode = false;
+bool restart_mode = false;
+// timeout of servers, as given to them with -a, held uploads get a byte
+// every half of it, so that they're never reaped
+int32_t server_timeout = TIMEOUT_DEFAULT;
+bool inline_mode = false;
+int32_t server_count = 1;
+int32_t client_count = 4;
+int32_t duration = 5;
+int32_t file_count = 64;
+int32_t reply_timeout = 200;
+std::string mix_spec = "hello:1,list:1,get:4,add:1";
+std::string sizes_spec = "fixed:65536";
+std::string needle;
+std::string server_path = "./netstore-server";
+std::string server_args;
+std::string base_folder = "/tmp";
+
+uint32_t weights[OPS];
+SizeDistribution sizes;
+std::vector<BenchServer> servers;
+std::atomic<bool> stopping{false};
+// held uploads that servers closed before the end of the run
+uint64_t held_dropped = 0;
+
+void handle_sigint(int) {
+    stopping = true;
+}
+
+void parse_mix(const std::string &spec) {
+    namespace po = boost::program_options;
+    std::fill(weights, weights + OPS, 0);
+    std::vector<std::string> parts;
+    boost::split(parts, spec, boost::is_any_of(","));
+    uint64_t total = 0;
+    for (const auto &part : parts) {
+        std::vector<std::string> fields;
+        boost::split(fields, part, boost::is_any_of(":"));
+        int op = OPS;
+        for (int i = 0; i < OPS && fields.size() == 2; ++i) {
+            if (boost::iequals(fields[0], OP_NAMES[i])) {
+                op = i;
+            }
+        }
+        if (op == OPS) {
+            throw po::validation_error(
+                po::validation_error::invalid_option_value, "x", spec);
+        }
+        weights[op] = std::stoul(fields[1]);
+        total += weights[op];
+    }
+    if (total == 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "x", spec);
+    }
+}
+
+void parse_sizes(const std::string &spec) {
+    namespace po = boost::program_options;
+    std::vector<std::string> fields;
+    boost::split(fields, spec, boost::is_any_of(":"));
+    sizes.kind = fields[0];
+    bool valid = (sizes.kind == "fixed" && fields.size() == 2) ||
+                 (sizes.kind == "exp" && fields.size() == 2) ||
+                 (sizes.kind == "uniform" && fields.size() == 3);
+    if (valid) {
+        sizes.a = std::stoull(fields[1]);
+        sizes.b = fields.size() == 3 ? std::stoull(fields[2]) : 0;
+        valid = (sizes.kind != "uniform" || sizes.a <= sizes.b) &&
+                (sizes.kind != "exp" || sizes.a > 0);
+    }
+    if (!valid) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "z", spec);
+    }
+}
+
+void parse_args(int argc, char **argv,
+                const boost::program_options::options_description &desc) {
+    namespace po = boost::program_options;
+    po::variables_map vm;
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+
+    if (server_count <= 0 || cmd_port <= 0 ||
+        cmd_port + server_count - 1 > PORT_MAX) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "p", std::to_string(cmd_port));
+    }
+    if (data_port < 0 ||
+        (data_port > 0 && data_port + server_count - 1 > PORT_MAX)) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "D", std::to_string(data_port));
+    }
+    if (session_depth < 0 || (session_depth > 0 && data_port == 0)) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "S", std::to_string(session_depth));
+    }
+    if (held_count < 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "P", std::to_string(held_count));
+    }
+    if (inline_mode && session_depth > 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "I", "with -S");
+    }
+    if (client_count <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "c", std::to_string(client_count));
+    }
+    if (duration <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "T", std::to_string(duration));
+    }
+    if (file_count <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "F", std::to_string(file_count));
+    }
+    if (reply_timeout <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "r", std::to_string(reply_timeout));
+    }
+    try {
+        parse_mix(mix_spec);
+        parse_sizes(sizes_spec);
+        std::istringstream extra(server_args);
+        std::string arg;
+        while (extra >> arg) {
+            if (arg == "-t" && extra >> arg) {
+                server_timeout = std::stoi(arg);
+            }
+        }
+    }
+    catch (std::logic_error &e) {
+        // stoul failed on a weight or a size
+        if (dynamic_cast<po::error *>(&e) != nullptr) {
+            throw;
+        }
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "x/z/a", mix_spec + " " + sizes_spec +
+                                                " " + server_args);
+    }
+}
+
+void write_file(const std::string &path, uint64_t size) {
+    static const std::vector<char> zeros(1 << 20, 0);
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to create " + path);
+    }
+    while (size > 0) {
+        ssize_t len =
+            write(fd, zeros.data(), std::min<uint64_t>(size, zeros.size()));
+        if (len <= 0) {
+            close(fd);
+            throw std::runtime_error("Failed to write " + path);
+        }
+        size -= len;
+    }
+    close(fd);
+}
+
+// waits for the reply to cmd_seq until deadline_us, replies to earlier
+// requests that come late are skipped, returns false on timeout
+bool await_reply(int sock, uint64_t cmd_seq, uint64_t deadline_us,
+                 char *buffer, cmd_view &reply) {
+    while (true) {
+        uint64_t now = monotonic_us();
+        if (now >= deadline_us) {
+            return false;
+        }
+        struct pollfd pfd = {sock, POLLIN, 0};
+        int millis = (deadline_us - now + 999) / 1000;
+        if (poll(&pfd, 1, millis) <= 0) {
+            continue;
+        }
+        socklen_t addrlen = sizeof(reply.addr);
+        ssize_t len = recvfrom(sock, buffer, BUFFER_SIZE, MSG_DONTWAIT,
+                               (struct sockaddr *)&reply.addr, &addrlen);
+        if (len < 0) {
+            continue;
+        }
+        try {
+            parse_cmd(reply, buffer, len);
+        }
+        catch (std::runtime_error &e) {
+            continue;
+        }
+        if (reply.cmd_seq == cmd_seq) {
+            return true;
+        }
+    }
+}
+
+// opens tcp connection for CONNECT_ME or CAN_ADD, sends its token if the
+// server has a shared data port, -1 on failure
+int connect_transfer(const cmd_view &reply) {
+    uint64_t token;
+    split_number(reply.data, token);
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct timeval limit = {TRANSFER_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    struct sockaddr_in address = reply.addr;
+    address.sin_port = htons(reply.param);
+    uint64_t wire = htobe64(token);
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        (token != 0 &&
+         send(sock, &wire, sizeof(wire), MSG_NOSIGNAL) != sizeof(wire))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// returns bytes received until the server closed the connection, or -1
+int64_t receive_file(const cmd_view &reply, char *buffer) {
+    int sock = connect_transfer(reply);
+    if (sock < 0) {
+        return -1;
+    }
+    int64_t total = 0;
+    while (true) {
+        ssize_t len = recv(sock, buffer, BUFFER_SIZE, 0);
+        if (len < 0) {
+            total = -1;
+            break;
+        }
+        if (len == 0) {
+            break;
+        }
+        total += len;
+    }
+    close(sock);
+    return total;
+}
+
+// sends exactly size bytes of buffer, or its first BUFFER_SIZE bytes over
+// and over if repeat is set, false if the connection failed
+bool send_exact(int sock, const char *buffer, uint64_t size,
+                bool repeat = false) {
+    while (size > 0) {
+        size_t wanted = repeat ? std::min<uint64_t>(size, BUFFER_SIZE) : size;
+        ssize_t len = send(sock, buffer, wanted, MSG_NOSIGNAL);
+        if (len <= 0) {
+            return false;
+        }
+        buffer += repeat ? 0 : len;
+        size -= len;
+    }
+    return true;
+}
+
+bool send_file(const cmd_view &reply, const char *buffer, uint64_t size) {
+    int sock = connect_transfer(reply);
+    if (sock < 0) {
+        return false;
+    }
+    bool sent = send_exact(sock, buffer, size, true);
+    close(sock);
+    return sent;
+}
+
+// reads exactly size bytes into buffer, or only past them if skip is set,
+// false if the connection failed or ended first
+bool read_exact(int sock, char *buffer, uint64_t size, bool skip = false) {
+    while (size > 0) {
+        size_t wanted = skip ? std::min<uint64_t>(size, BUFFER_SIZE) : size;
+        ssize_t len = recv(sock, buffer, wanted, 0);
+        if (len <= 0) {
+            return false;
+        }
+        buffer += skip ? 0 : len;
+        size -= len;
+    }
+    return true;
+}
+
+// connects to the shared data port of server k and makes the connection a
+// data session, -1 on failure
+int open_session(size_t k) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+    struct timeval limit = {TRANSFER_TIMEOUT_S, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+    // requests of a batch are small and must not wait for each other
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(data_port + k);
+    uint64_t wire = htobe64(SESSION_TOKEN);
+    if (connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        !send_exact(sock, (const char *)&wire, sizeof(wire))) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// a request of a session batch, as long as its reply has not come
+class SessionRequest {
+  public:
+    std::string name;
+    uint64_t size = 0;
+    uint64_t sent = 0;
+};
+
+// sends session_depth GETs or ADDs to server k over its session, opened on
+// first use, and then reads their replies, which come in order; GET and
+// ADD are never mixed in a batch, a file of ADD sent while a file of GET
+// comes back could fill the connection both ways; latency of a request
+// runs from sending it to the header of its reply, a session that fails
+// is closed and opened again by the next batch
+void run_session_batch(int &session, size_t k, int op, int id,
+                       uint64_t &added, std::mt19937_64 &rng,
+                       ClientStats *stats, char *buffer, const char *upload) {
+    const BenchServer &server = servers[k];
+    if (session < 0) {
+        session = open_session(k);
+    }
+    bool broken = session < 0;
+    std::vector<char> packet(BUFFER_SIZE);
+    std::vector<SessionRequest> batch(session_depth);
+    for (auto &request : batch) {
+        ++stats->requests[op];
+        uint64_t cmd_seq = rng();
+        size_t length;
+        if (op == OP_GET) {
+            const auto &file = server.files[rng() % server.files.size()];
+            request.name = file.first;
+            request.size = file.second;
+            length = pack_frame(packet.data(), GET, cmd_seq, 0, request.name);
+        }
+        else {
+            request.name = "add_" + std::to_string(id) + "_" +
+                           std::to_string(added++);
+            request.size = sizes.draw(rng);
+            length = pack_frame(packet.data(), ADD, cmd_seq, request.size,
+                                request.name);
+        }
+        request.sent = monotonic_us();
+        broken = broken || !send_exact(session, packet.data(), length) ||
+                 (op == OP_ADD &&
+                  !send_exact(session, upload, request.size, true));
+    }
+    for (const auto &request : batch) {
+        uint32_t length;
+        cmd_view reply;
+        broken = broken ||
+                 !read_exact(session, (char *)&length, sizeof(length)) ||
+                 be32toh(length) > (uint32_t)BUFFER_SIZE ||
+                 !read_exact(session, buffer, be32toh(length));
+        if (!broken) {
+            try {
+                parse_cmd(reply, buffer, be32toh(length));
+            }
+            catch (std::runtime_error &e) {
+                broken = true;
+            }
+        }
+        if (broken) {
+            ++stats->failed[op];
+            continue;
+        }
+        stats->latencies[op].push_back(monotonic_us() - request.sent);
+        bool done;
+        if (op == OP_GET) {
+            done = reply.cmd == CONNECT_ME && reply.param == request.size;
+            uint64_t size = reply.cmd == CONNECT_ME ? reply.param : 0;
+            broken = !read_exact(session, buffer, size, true);
+        }
+        else {
+            done = reply.cmd == CAN_ADD;
+        }
+        if (!done || broken) {
+            ++stats->failed[op];
+            continue;
+        }
+        ++stats->transfers;
+        stats->bytes += request.size;
+        stats->transfer_us.push_back(monotonic_us() - request.sent);
+    }
+    if (broken && session >= 0) {
+        close(session);
+        session = -1;
+    }
+}
+
+void run_client(int id, uint64_t end_us, ClientStats *stats) {
+    std::mt19937_64 rng(std::random_device{}() ^ ((uint64_t)id << 32));
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        std::cerr << "Error occured: Failed to create a socket\n";
+        return;
+    }
+    std::vector<char> packet(BUFFER_SIZE);
+    std::vector<char> buffer(BUFFER_SIZE);
+    // contents of uploads do not matter
+    const std::vector<char> upload(BUFFER_SIZE, 'x');
+    uint32_t total = 0;
+    for (int op = 0; op < OPS; ++op) {
+        total += weights[op];
+    }
+    uint64_t added = 0;
+    // data sessions, by server
+    std::vector<int> sessions(servers.size(), -1);
+
+    while (!stopping && monotonic_us() < end_us) {
+        uint32_t pick = rng() % total;
+        int op = 0;
+        while (pick >= weights[op]) {
+            pick -= weights[op++];
+        }
+        size_t k = rng() % servers.size();
+        const BenchServer &server = servers[k];
+        if (session_depth > 0 && (op == OP_GET || op == OP_ADD)) {
+            run_session_batch(sessions[k], k, op, id, added, rng, stats,
+                              buffer.data(), upload.data());
+            continue;
+        }
+        uint64_t cmd_seq = rng();
+        std::string name;
+        uint64_t size = 0;
+        size_t length;
+        if (op == OP_HELLO) {
+            length = pack_cmd(packet.data(), HELLO, cmd_seq, "");
+        }
+        else if (op == OP_LIST) {
+            length = pack_cmd(packet.data(), LIST, cmd_seq, needle);
+        }
+        else if (op == OP_GET) {
+            const auto &file = server.files[rng() % server.files.size()];
+            name = file.first;
+            size = file.second;
+            length = pack_cmd(packet.data(), inline_mode ? GET_INLINE : GET,
+                              cmd_seq, name);
+        }
+        else {
+            name = "add_" + std::to_string(id) + "_" +
+                   std::to_string(added++);
+            size = sizes.draw(rng);
+            if (inline_mode && fits_inline(name, size)) {
+                std::string data = name;
+                data.push_back('\0');
+                data.append(upload.data(), size);
+                length =
+                    pack_cmd(packet.data(), ADD_INLINE, cmd_seq, size, data);
+            }
+            else {
+                length = pack_cmd(packet.data(), ADD, cmd_seq, size, name);
+            }
+        }
+
+        ++stats->requests[op];
+        uint64_t sent = monotonic_us();
+        if (sendto(sock, packet.data(), length, 0,
+                   (const struct sockaddr *)&server.group,
+                   sizeof(server.group)) < 0) {
+            ++stats->failed[op];
+            continue;
+        }
+        cmd_view reply;
+        if (!await_reply(sock, cmd_seq, sent + reply_timeout * 1000,
+                         buffer.data(), reply)) {
+            ++stats->lost[op];
+            continue;
+        }
+        uint64_t replied = monotonic_us();
+        if (op == OP_HELLO || op == OP_LIST) {
+            bool good = reply.cmd == (op == OP_HELLO ? GOOD_DAY : MY_LIST);
+            // long lists are split over several MY_LIST packets, the last
+            // one only shows as a pause after it
+            while (op == OP_LIST && good &&
+                   await_reply(sock, cmd_seq,
+                               std::min(replied + LIST_QUIET_US,
+                                        sent + reply_timeout * 1000),
+                               buffer.data(), reply)) {
+                replied = monotonic_us();
+                good = reply.cmd == MY_LIST;
+            }
+            stats->latencies[op].push_back(replied - sent);
+            if (!good) {
+                ++stats->failed[op];
+            }
+            continue;
+        }
+        stats->latencies[op].push_back(replied - sent);
+        // the file came or went inside the datagrams, bigger files of -I
+        // are answered as without it
+        if ((op == OP_GET && reply.cmd == FILE_DATA) ||
+            (op == OP_ADD && reply.cmd == ADDED)) {
+            if (op == OP_GET && reply.payload.size() != size) {
+                ++stats->failed[op];
+                continue;
+            }
+            ++stats->transfers;
+            stats->bytes += size;
+            stats->transfer_us.push_back(replied - sent);
+            continue;
+        }
+
+        uint64_t began = monotonic_us();
+        bool done;
+        if (op == OP_GET) {
+            done = reply.cmd == CONNECT_ME &&
+                   receive_file(reply, buffer.data()) == (int64_t)size;
+        }
+        else {
+            done = reply.cmd == CAN_ADD &&
+                   send_file(reply, upload.data(), size);
+        }
+        if (!done) {
+            ++stats->failed[op];
+            continue;
+        }
+        ++stats->transfers;
+        stats->bytes += size;
+        stats->transfer_us.push_back(monotonic_us() - began);
+    }
+    for (int session : sessions) {
+        if (session >= 0) {
+            close(session);
+        }
+    }
+    close(sock);
+}
+
+// makes the folders of the servers with their files
+void prepare_servers() {
+    namespace fs = boost::filesystem;
+    std::mt19937_64 rng(std::random_device{}());
+    for (int32_t k = 0; k < server_count; ++k) {
+        BenchServer server;
+        std::string pattern = base_folder + "/netstore-bench-XXXXXX";
+        if (mkdtemp(&pattern[0]) == nullptr) {
+            throw std::runtime_error("Failed to create folder in " +
+                                     base_folder);
+        }
+        server.folder = pattern;
+        server.port = cmd_port + k;
+        for (int32_t i = 0; i < file_count; ++i) {
+            std::string name = "file_" + std::to_string(i);
+            uint64_t size = sizes.draw(rng);
+            write_file(server.folder + "/" + name, size);
+            server.files.emplace_back(name, size);
+        }
+        memset(&server.group, 0, sizeof(server.group));
+        server.group.sin_family = AF_INET;
+        server.group.sin_port = htons(server.port);
+        if (inet_aton(mcast_addr.c_str(), &server.group.sin_addr) == 0) {
+            throw boost::program_options::validation_error(
+                boost::program_options::validation_error::
+                    invalid_option_value,
+                "g", mcast_addr);
+        }
+        servers.push_back(std::move(server));
+    }
+}
+
+// forks server k, it's not waited for
+void launch_server(BenchServer &server, int32_t k) {
+    std::vector<std::string> args = {
+        server_path,          "-g", mcast_addr,
+        "-p",                 std::to_string(server.port),
+        "-f",                 server.folder,
+        "-b",                 std::to_string(SERVER_SPACE)};
+    if (data_port > 0) {
+        args.push_back("-d");
+        args.push_back(std::to_string(data_port + k));
+    }
+    if (inline_mode) {
+        args.push_back("-i");
+    }
+    // next to the shared folder, it must not be inside
+    if (manifest_mode) {
+        args.push_back("-M");
+        args.push_back(server.folder + ".manifest");
+    }
+    std::istringstream extra(server_args);
+    std::string arg;
+    while (extra >> arg) {
+        args.push_back(arg);
+    }
+    server.pid = fork();
+    if (server.pid < 0) {
+        throw std::runtime_error("Failed to fork");
+    }
+    if (server.pid == 0) {
+        std::vector<char *> argv;
+        for (auto &a : args) {
+            argv.push_back(&a[0]);
+        }
+        argv.push_back(nullptr);
+        // [PCKG ERROR] lines of servers would drown the results
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDERR_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+}
+
+void launch_servers() {
+    for (size_t k = 0; k < servers.size(); ++k) {
+        launch_server(servers[k], k);
+    }
+}
+
+// every server has to answer HELLO before the clients start
+void await_servers() {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::runtime_error("Failed to create a socket");
+    }
+    char packet[CMD_SIZE + sizeof(uint64_t)];
+    std::vector<char> buffer(BUFFER_SIZE);
+    uint64_t give_up = monotonic_us() + STARTUP_MS * 1000;
+    for (const auto &server : servers) {
+        while (true) {
+            uint64_t cmd_seq = get_cmd_seq();
+            size_t length = pack_cmd(packet, HELLO, cmd_seq, "");
+            sendto(sock, packet, length, 0,
+                   (const struct sockaddr *)&server.group,
+                   sizeof(server.group));
+            cmd_view reply;
+            if (await_reply(sock, cmd_seq, monotonic_us() + STARTUP_POLL_US,
+                            buffer.data(), reply)) {
+                break;
+            }
+            int status;
+            if (monotonic_us() > give_up ||
+                waitpid(server.pid, &status, WNOHANG) == server.pid) {
+                close(sock);
+                throw std::runtime_error("Server on port " +
+                                         std::to_string(server.port) +
+                                         " did not start");
+            }
+        }
+    }
+    close(sock);
+}
+
+// opens held_count uploads spread over the servers, they stay open until
+// the servers are stopped
+std::vector<int> open_held_transfers() {
+    int sock = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::runtime_error("Failed to create a socket");
+    }
+    std::vector<int> held;
+    std::vector<char> packet(BUFFER_SIZE);
+    std::vector<char> buffer(BUFFER_SIZE);
+    for (int32_t i = 0; i < held_count; ++i) {
+        const BenchServer &server = servers[i % servers.size()];
+        uint64_t cmd_seq = get_cmd_seq();
+        size_t length = pack_cmd(packet.data(), ADD, cmd_seq, HOLD_SIZE,
+                                 "held_" + std::to_string(i));
+        sendto(sock, packet.data(), length, 0,
+               (const struct sockaddr *)&server.group, sizeof(server.group));
+        cmd_view reply;
+        int transfer = -1;
+        if (await_reply(sock, cmd_seq, monotonic_us() + reply_timeout * 1000,
+                        buffer.data(), reply) &&
+            reply.cmd == CAN_ADD) {
+            transfer = connect_transfer(reply);
+        }
+        if (transfer < 0) {
+            for (int fd : held) {
+                close(fd);
+            }
+            close(sock);
+            throw std::runtime_error("Failed to open held upload " +
+                                     std::to_string(i));
+        }
+        held.push_back(transfer);
+    }
+    close(sock);
+    return held;
+}
+
+// sends a byte to every held upload each half of the server timeout until
+// end_us, spread over that time rather than in bursts, then counts the
+// ones that servers closed meanwhile
+void keep_held(const std::vector<int> &held, uint64_t end_us) {
+    std::vector<bool> alive(held.size(), true);
+    uint64_t interval = (uint64_t)server_timeout * 1000000 / 2;
+    uint64_t start = monotonic_us();
+    for (uint64_t round = 0; !stopping && !held.empty(); ++round) {
+        for (size_t i = 0; i < held.size() && !stopping; ++i) {
+            uint64_t due = start + round * interval +
+                           interval * i / held.size();
+            while (!stopping && monotonic_us() < std::min(due, end_us)) {
+                usleep(std::min<uint64_t>(due - monotonic_us(), 10000));
+            }
+            if (monotonic_us() >= end_us) {
+                break;
+            }
+            alive[i] = alive[i] && send(held[i], "x", 1, MSG_NOSIGNAL) == 1;
+        }
+        if (monotonic_us() >= end_us) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < held.size(); ++i) {
+        char byte;
+        ssize_t len = recv(held[i], &byte, 1, MSG_DONTWAIT);
+        bool open = len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        held_dropped += !(alive[i] && open);
+    }
+}
+
+// servers are stopped, their folders are kept
+void halt_servers() {
+    for (auto &server : servers) {
+        if (server.pid > 0) {
+            kill(server.pid, SIGINT);
+            waitpid(server.pid, NULL, 0);
+            server.pid = -1;
+        }
+    }
+}
+
+void stop_servers() {
+    namespace fs = boost::filesystem;
+    halt_servers();
+    for (const auto &server : servers) {
+        boost::system::error_code error;
+        fs::remove_all(server.folder, error);
+        fs::remove(server.folder + ".manifest", error);
+    }
+    servers.clear();
+}
+
+uint32_t percentile(std::vector<uint32_t> &values, double q) {
+    if (values.empty()) {
+        return 0;
+    }
+    size_t rank = std::min(values.size() - 1, (size_t)(q * values.size()));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+void report(std::vector<ClientStats> &stats, double seconds,
+            uint64_t startup_us, uint64_t restart_us) {
+    ClientStats all;
+    for (auto &client : stats) {
+        for (int op = 0; op < OPS; ++op) {
+            all.requests[op] += client.requests[op];
+            all.lost[op] += client.lost[op];
+            all.failed[op] += client.failed[op];
+            all.latencies[op].insert(all.latencies[op].end(),
+                                     client.latencies[op].begin(),
+                                     client.latencies[op].end());
+        }
+        all.transfers += client.transfers;
+        all.bytes += client.bytes;
+        all.transfer_us.insert(all.transfer_us.end(),
+                               client.transfer_us.begin(),
+                               client.transfer_us.end());
+    }
+    uint64_t requests = 0;
+    uint64_t lost = 0;
+    std::ostringstream ops;
+    for (int op = 0; op < OPS; ++op) {
+        requests += all.requests[op];
+        lost += all.lost[op];
+        ops << (op > 0 ? "," : "") << "\"" << OP_NAMES[op]
+            << "\":{\"requests\":" << all.requests[op]
+            << ",\"lost\":" << all.lost[op]
+            << ",\"failed\":" << all.failed[op]
+            << ",\"p50_us\":" << percentile(all.latencies[op], 0.5)
+            << ",\"p99_us\":" << percentile(all.latencies[op], 0.99) << "}";
+    }
+    std::ostringstream out;
+    out.setf(std::ios::fixed);
+    out.precision(3);
+    out << "{\"servers\":" << server_count << ",\"clients\":" << client_count
+        << ",\"seconds\":" << seconds << ",\"mix\":\"" << mix_spec
+        << "\",\"sizes\":\"" << sizes_spec << "\",\"server_args\":\""
+        << server_args << "\",\"session_depth\":" << session_depth
+        << ",\"held\":" << held_count << ",\"held_dropped\":" << held_dropped
+        << ",\"inline\":" << (inline_mode ? "true" : "false")
+        << ",\"manifest\":" << (manifest_mode ? "true" : "false")
+        << ",\"startup_ms\":" << startup_us / 1000.0
+        << ",\"restart_ms\":" << restart_us / 1000.0
+        << ",\"requests\":" << requests
+        << ",\"requests_per_s\":" << requests / seconds
+        << ",\"lost\":" << lost << ",\"loss\":"
+        << (requests > 0 ? (double)lost / requests : 0.0) << ",\"ops\":{"
+        << ops.str() << "},\"transfers\":{\"count\":" << all.transfers
+        << ",\"bytes\":" << all.bytes
+        << ",\"mb_per_s\":" << all.bytes / seconds / 1e6
+        << ",\"p50_us\":" << percentile(all.transfer_us, 0.5)
+        << ",\"p99_us\":" << percentile(all.transfer_us, 0.99) << "}}\n";
+    std::cout << out.str();
+}
+
+void init(int argc, char **argv) {
+    namespace po = boost::program_options;
+    po::options_description desc(argv[0] + std::string(" flags"));
+    desc.add_options()(",g", po::value<std::string>(&mcast_addr),
+                       "MCAST_ADDR (default 239.10.11.12)")(
+        ",p", po::value<int32_t>(&cmd_port),
+        "CMD_PORT (server k listens on CMD_PORT + k, default 30000)")(
+        ",D", po::value<int32_t>(&data_port),
+        "DATA_PORT (server k gets shared data port DATA_PORT + k, by default "
+        "servers open a port per transfer)")(
+        ",S", po::value<int32_t>(&session_depth),
+        "DEPTH (GET and ADD go through a data session per server, DEPTH "
+        "requests sent before their replies are read, needs -D)")(
+        ",P", po::value<int32_t>(&held_count),
+        "HELD (uploads kept open on the servers during the run, each gets "
+        "a byte every half of the server timeout, default 0)")(
+        ",I", po::bool_switch(&inline_mode),
+        "send GET_INLINE and ADD_INLINE, servers get -i, so files that fit "
+        "in a datagram go inside it")(
+        ",M", po::bool_switch(&manifest_mode),
+        "servers keep their catalogs in manifests next to their folders")(
+        ",R", po::bool_switch(&restart_mode),
+        "servers are restarted once on the same folders before the run")(
+        ",n", po::value<int32_t>(&server_count), "SERVERS (default 1)")(
+        ",c", po::value<int32_t>(&client_count), "CLIENTS (default 4)")(
+        ",T", po::value<int32_t>(&duration), "DURATION (seconds, default 5)")(
+        ",x", po::value<std::string>(&mix_spec),
+        "MIX (weights of commands, default hello:1,list:1,get:4,add:1)")(
+        ",z", po::value<std::string>(&sizes_spec),
+        "SIZES (of shared and added files, fixed:N, uniform:MIN:MAX or "
+        "exp:MEAN, default fixed:65536)")(
+        ",F", po::value<int32_t>(&file_count),
+        "FILES (shared by every server at start, default 64)")(
+        ",l", po::value<std::string>(&needle),
+        "NEEDLE (of LIST, default empty, which lists everything)")(
+        ",r", po::value<int32_t>(&reply_timeout),
+        "REPLY_TIMEOUT (milliseconds after which a request is lost, "
+        "default 200)")(
+        ",s", po::value<std::string>(&server_path),
+        "SERVER (binary, default ./netstore-server)")(
+        ",a", po::value<std::string>(&server_args),
+        "SERVER_ARGS (passed to every server, e.g. \"-m uring -w 2\")")(
+        ",o", po::value<std::string>(&base_folder),
+        "FOLDER (where shared folders of servers are made, default /tmp)");
+
+    try {
+        parse_args(argc, argv, desc);
+    }
+    catch (po::error &e) {
+        std::cerr << "INCORRECT USAGE\n" << e.what() << "\n" << desc;
+        exit(-1);
+    }
+}
+
+int main(int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    init(argc, argv);
+    // servers are stopped and their folders removed on interrupt too
+    signal(SIGINT, handle_sigint);
+
+    // every held upload takes a descriptor here and two in its server
+    struct rlimit files;
+    if (held_count > 0 && getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+    std::vector<int> held;
+    uint64_t startup_us = 0;
+    uint64_t restart_us = 0;
+    try {
+        prepare_servers();
+        uint64_t launched = monotonic_us();
+        launch_servers();
+        await_servers();
+        startup_us = monotonic_us() - launched;
+        if (restart_mode) {
+            halt_servers();
+            launched = monotonic_us();
+            launch_servers();
+            await_servers();
+            restart_us = monotonic_us() - launched;
+        }
+        held = open_held_transfers();
+    }
+    catch (std::exception &e) {
+        std::cerr << "ERROR\n" << e.what() << "\n";
+        stop_servers();
+        exit(-1);
+    }
+
+    std::vector<ClientStats> stats(client_count);
+    std::vector<std::thread> clients;
+    uint64_t start = monotonic_us();
+    uint64_t end = start + (uint64_t)duration * 1000000;
+    for (int32_t i = 0; i < client_count; ++i) {
+        clients.emplace_back(run_client, i, end, &stats[i]);
+    }
+    std::thread keeper(keep_held, std::cref(held), end);
+    for (auto &client : clients) {
+        client.join();
+    }
+    keeper.join();
+    double seconds = (monotonic_us() - start) / 1e6;
+    for (int fd : held) {
+        close(fd);
+    }
+    stop_servers();
+    report(stats, seconds, startup_us, restart_us);
+    return 0;
+}
@@ -1,35 +1,88 @@
 #include <boost/algorithm/string.hpp>
-#include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/program_options.hpp>
+#include <deque>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <glob.h>
 #include <iostream>
 #include <map>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <set>
 #include <signal.h>
 #include <string>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <unordered_map>
 
 #include "helper.h"
+#include "timer.h"
+#include "uring.h"
 
 const std::string DISCOVER = "discover";
 const std::string SEARCH = "search";
 const std::string FETCH = "fetch";
 const std::string UPLOAD = "upload";
+const std::string UPLOAD_DIR = "upload-dir";
 const std::string REMOVE = "remove";
 const std::string EXIT = "exit";
+// in swarm mode files are fetched in chunks of this size
+const uint64_t SWARM_CHUNK = 4 << 20;
+// how many chunks are asked from one server at once
+const int SWARM_WINDOW = 2;
+// seconds between refreshes of the discover cache used by upload
+const int32_t CACHE_TTL_DEFAULT = 30;
+// uploads of upload-dir that are placed or transferred at once
+const int32_t UPLOAD_LIMIT_DEFAULT = 8;
+// files of upload-dir up to this size go through data sessions
+const uint64_t SESSION_FILE_MAX = 1 << 20;
+// GET_INLINE and ADD_INLINE are first sent again after this many ms, the
+// interval doubles with every resend until the timeout
+const uint64_t INLINE_RETRY_MS = 200;
+// how many of them are sent at once, the rest wait, so that a burst of
+// small files does not overflow socket buffers on the way
+const size_t INLINE_WINDOW = 16;
+// submission queue entries of the io_uring
+const unsigned RING_ENTRIES = 256;
 
 std::string mcast_addr, out_fldr;
-int32_t cmd_port, timeout = TIMEOUT_DEFAULT;
+int32_t cmd_port, timeout = TIMEOUT_DEFAULT, cache_ttl = CACHE_TTL_DEFAULT;
+// whether fetch uses all servers that have the file
+bool swarm_mode = false;
+// how many servers are asked to take an upload at once
+int32_t add_fanout = 1;
+int32_t upload_limit = UPLOAD_LIMIT_DEFAULT;
+// whether transfers go through data sessions with servers that have a
+// shared data port
+bool session_mode = false;
+// whether files that fit in one datagram are fetched and uploaded inside it
+bool inline_mode = false;
+// whether plain fetches and uploads move their data with io_uring
+bool ring_mode = false;
 
 // main udp socket used for most of communications
 int main_socket;
+// user input that does not form a whole line yet
+std::string input_buffer;
+// every received command points into this buffer until the next one arrives
+char recv_buffer[BUFFER_SIZE];
 // 0 is signalfd
 // 1 is main socket (or -1 if we're not listening on it)
 // 2 is stdin
+// 3 is io_uring (or -1 if transfers don't use it)
 std::vector<struct pollfd> fds;
 std::vector<ConnectionInfo> connections;
+// timeouts of tcp connections, keyed by socket
+TimerWheel connection_timers(monotonic_ms());
+// timeouts of ADD requests, chunk requests, discover, search and
+// pseudo-discover, keyed by cmd_seq
+TimerWheel request_timers(monotonic_ms());
+// nullptr unless ring_mode is set and the kernel has io_uring
+std::unique_ptr<Ring> ring;
+// transfers moved by the ring, keyed by socket, a connection is here only
+// while operations of its transfer are in flight
+std::unordered_map<int, std::unique_ptr<RingTransfer>> ring_transfers;
 std::vector<std::pair<struct sockaddr_in, std::vector<std::string>>> files;
 std::map<uint64_t, ConnectionInfo> seq_to_conn;
 std::map<uint64_t, std::pair<std::vector<std::tuple<struct sockaddr_in,
@@ -39,20 +92,156 @@ std::map<uint64_t, std::pair<std::vector<std::tuple<struct sockaddr_in,
 
 std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> servers;
 
-// only ADD commands go here, so when they time out, because timeout after
-// sending ADD to one server is equivalent to receiving NO_WAY from that server
-// and should be handled accordingly
-std::map<uint64_t, boost::posix_time::ptime> seq_to_starttime;
+// ADD commands go here, because timeout after sending ADD to one server is
+// equivalent to receiving NO_WAY from that server and should be handled
+// accordingly, and so do chunk requests of swarm downloads
+std::map<uint64_t, uint64_t> seq_to_timer;
+// ADDs waiting for an answer, pointing to the key of their upload in
+// seq_to_conn and seq_to_servers
+std::map<uint64_t, uint64_t> seq_to_upload;
+std::map<uint64_t, std::vector<uint64_t>> upload_adds;
+// ADDs of uploads that were placed elsewhere, a CAN_ADD for them only
+// releases the server
+std::set<uint64_t> released_adds;
+
+// GET_INLINE or ADD_INLINE waiting for an answer, keyed by cmd_seq, its
+// resend timer is in seq_to_timer
+class InlineRequest {
+  public:
+    std::string packet;
+    struct sockaddr_in addr;
+    // monotonic_ms() of the first sending, 0 while it waits for the window
+    uint64_t sent;
+    uint64_t interval;
+};
+
+std::map<uint64_t, InlineRequest> inline_requests;
+// requests that wait for the window, in order of making them
+std::deque<uint64_t> inline_backlog;
+size_t inline_in_flight = 0;
 
 // list of files to send after pseudo-discover finishes
 std::vector<std::string> files_to_upload;
-// start time of last discover or not_a_datetime if no discover is running
-boost::posix_time::ptime discover_start;
+// upload-dir batches waiting for pseudo-discover
+std::vector<std::vector<std::string>> batches_to_upload;
+// files of upload-dir already assigned to servers, each with its list of
+// servers to try, the assigned one last, they're started as others finish
+std::deque<std::pair<
+    std::string,
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>>>
+    upload_queue;
+// whether pseudo-discover is waiting for answers
+bool discover_running = false;
 // output of pseudo-discover
 std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
     discovered_servers;
 // cmd_seq of pseudo_discover
 uint64_t discover_seq;
+// resumed fetches waiting for CONNECT_ME, which carries size of the file
+std::set<uint64_t> ranged_fetches;
+// size the .part file of a resumed download has to reach, keyed by socket
+std::map<int, uint64_t> download_sizes;
+// servers found by the last pseudo-discover, sorted by free space, which is
+// lowered locally by every accepted ADD, uploads are placed from it without
+// waiting as long as it's fresh
+std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
+    server_cache;
+// when server_cache was filled, 0 if never
+uint64_t server_cache_time = 0;
+// key of the timer that starts the next background pseudo-discover
+uint64_t cache_refresh_seq;
+uint64_t cache_refresh_timer = NO_TIMER;
+// uploads placed from the cache, if all of them refuse, the file is tried
+// once more after a fresh pseudo-discover
+std::set<std::string> cached_uploads;
+// discover and search started by the user, they run in the background and
+// their answers are accepted until the timeout
+bool user_discover_running = false;
+uint64_t user_discover_seq;
+bool search_running = false;
+uint64_t search_seq;
+
+class SwarmSource {
+  public:
+    struct sockaddr_in addr;
+    std::string ip;
+    int in_flight;
+    // server that failed to send a chunk is not asked again
+    bool failed;
+};
+
+// file downloaded in chunks from all servers that have it, every server is
+// given next chunk as soon as it finishes one, so faster servers send more
+class SwarmDownload {
+  public:
+    std::string filename;
+    // chunks are written with pwrite, each through its own dup of fd
+    int fd;
+    std::vector<SwarmSource> sources;
+    uint64_t next_chunk;
+    // number of chunks of the file, known once the first CONNECT_ME with
+    // size of the file arrives, UINT64_MAX until then
+    uint64_t chunk_count;
+    std::vector<bool> done;
+    // chunks that failed and have to be asked from another server
+    std::vector<uint64_t> retry_chunks;
+};
+
+class ChunkTransfer {
+  public:
+    uint64_t swarm;
+    size_t source;
+    uint64_t chunk;
+    // size of the chunk, the last one may be shorter
+    uint64_t expected;
+    uint64_t received;
+    // set when the server closed the connection after the whole chunk, a
+    // server that dies closes it too, so closing is not enough on its own
+    bool complete;
+};
+
+class SessionTransfer {
+  public:
+    uint64_t cmd_seq;
+    // name of the file for GET, its path for ADD
+    std::string filename;
+    // .part file of GET, -1 for ADD
+    int fd;
+    // size of the file of ADD
+    uint64_t size;
+    // servers to try for ADD, the last one is the server of the session
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
+        servers;
+};
+
+// data session with one server, requests are sent as soon as they are made
+// and replies come in the same order
+class DataSession {
+  public:
+    // command address of the server
+    struct sockaddr_in addr;
+    // frames to send, out_sent of them are sent already
+    std::string out;
+    size_t out_sent;
+    std::deque<SessionTransfer> waiting;
+    // frame of the reply being read
+    std::string in;
+    // bytes of the file of the current reply still to come
+    uint64_t body_left;
+};
+
+// keyed by socket
+std::map<int, DataSession> sessions;
+// sockets of sessions and shared data ports from GOOD_DAY, keyed by command
+// address of the server
+std::map<std::pair<in_addr_t, in_port_t>, int> server_sessions;
+std::map<std::pair<in_addr_t, in_port_t>, uint16_t> data_ports;
+
+std::map<uint64_t, SwarmDownload> swarms;
+// chunk requests waiting for CONNECT_ME, keyed by cmd_seq
+std::map<uint64_t, ChunkTransfer> seq_to_chunk;
+// chunks being received, keyed by socket
+std::map<int, ChunkTransfer> sock_to_chunk;
 
 void free_memory() {
     close(fds[0].fd);
@@ -61,6 +250,12 @@ void free_memory() {
         close(conn.fd);
         close(conn.sock_fd);
     }
+    for (const auto &swarm : swarms) {
+        close(swarm.second.fd);
+    }
+    // buffers of transfers go back to the pool while it still exists, the
+    // process ends before the kernel could touch them again
+    ring_transfers.clear();
 
     // free the memory
     fds.clear();
@@ -68,11 +263,248 @@ void free_memory() {
     files.clear();
 }
 
+// swarm download is finished when nothing is in flight and nothing more can
+// be asked for, it's complete if every chunk up to the end of file arrived
+void finish_swarm(uint64_t id) {
+    SwarmDownload &swarm = swarms[id];
+    bool complete = swarm.chunk_count != UINT64_MAX;
+    for (uint64_t chunk = 0; complete && chunk < swarm.chunk_count; ++chunk) {
+        complete = chunk < swarm.done.size() && swarm.done[chunk];
+    }
+    std::string addresses;
+    for (const auto &source : swarm.sources) {
+        addresses += (addresses.empty() ? "" : ", ") + source.ip;
+    }
+    std::string path = out_fldr + "/" + swarm.filename;
+    if (!complete) {
+        // chunks past the first missing one are dropped, so that the .part
+        // file is a prefix of the file, which the next fetch resumes
+        uint64_t prefix = 0;
+        while (prefix < swarm.done.size() && swarm.done[prefix]) {
+            ++prefix;
+        }
+        if (prefix == 0 || ftruncate(swarm.fd, prefix * SWARM_CHUNK) < 0) {
+            unlink((path + PART_SUFFIX).c_str());
+        }
+    }
+    close(swarm.fd);
+    if (!complete) {
+        std::cout << "File " << swarm.filename << " downloading failed ("
+                  << addresses << ") No server could send the rest of it\n";
+    }
+    else if (rename((path + PART_SUFFIX).c_str(), path.c_str()) < 0) {
+        std::cout << "File " << swarm.filename << " downloading failed ("
+                  << addresses << ") Rename of downloaded file failed with \""
+                  << strerror(errno) << "\" error\n";
+    }
+    else {
+        std::cout << "File " << swarm.filename << " downloaded (" << addresses
+                  << ")\n";
+    }
+    swarms.erase(id);
+}
+
+// asks the source for one chunk, the request times out like ADD does
+void request_chunk(uint64_t id, size_t source, uint64_t chunk) {
+    SwarmDownload &swarm = swarms[id];
+    int fd = dup(swarm.fd);
+    if (fd < 0) {
+        throw std::logic_error("Failed to duplicate file descriptor");
+    }
+    cmplx_cmd cmd;
+    cmd.cmd = GET_RANGE;
+    cmd.cmd_seq = get_cmd_seq();
+    cmd.param = chunk * SWARM_CHUNK;
+    cmd.addr = swarm.sources[source].addr;
+    cmd.data = append_number(swarm.filename, SWARM_CHUNK);
+    seq_to_conn[cmd.cmd_seq] = ConnectionInfo(
+        monotonic_ms(), main_socket, fd, swarm.filename, false, true, "", 0);
+    seq_to_chunk[cmd.cmd_seq] =
+        ChunkTransfer{id, source, chunk, SWARM_CHUNK, 0, false};
+    seq_to_timer[cmd.cmd_seq] = request_timers.schedule(
+        monotonic_ms() + timeout * 1000, cmd.cmd_seq);
+    ++swarm.sources[source].in_flight;
+    send_cmd(cmd, main_socket);
+}
+
+// keeps SWARM_WINDOW chunks in flight from every working source
+void request_chunks(uint64_t id) {
+    SwarmDownload &swarm = swarms[id];
+    // chunks past the end were asked for before the size was known
+    swarm.retry_chunks.erase(
+        std::remove_if(swarm.retry_chunks.begin(), swarm.retry_chunks.end(),
+                       [&](uint64_t chunk) {
+                           return chunk >= swarm.chunk_count;
+                       }),
+        swarm.retry_chunks.end());
+    bool in_flight = false;
+    for (size_t source = 0; source < swarm.sources.size(); ++source) {
+        while (!swarm.sources[source].failed &&
+               swarm.sources[source].in_flight < SWARM_WINDOW) {
+            uint64_t chunk;
+            if (!swarm.retry_chunks.empty()) {
+                chunk = swarm.retry_chunks.back();
+                swarm.retry_chunks.pop_back();
+            }
+            else if (swarm.next_chunk < swarm.chunk_count) {
+                chunk = swarm.next_chunk++;
+            }
+            else {
+                break;
+            }
+            request_chunk(id, source, chunk);
+        }
+        if (swarm.sources[source].in_flight > 0) {
+            in_flight = true;
+        }
+    }
+    if (!in_flight) {
+        finish_swarm(id);
+    }
+}
+
+// size of the file tells how many chunks there are and how long this one is
+void start_chunk(ChunkTransfer &transfer, uint64_t file_size) {
+    auto it = swarms.find(transfer.swarm);
+    if (it == swarms.end() || file_size == UINT64_MAX) {
+        return;
+    }
+    uint64_t count = (file_size + SWARM_CHUNK - 1) / SWARM_CHUNK;
+    it->second.chunk_count = std::min(it->second.chunk_count, count);
+    uint64_t offset = transfer.chunk * SWARM_CHUNK;
+    transfer.expected =
+        offset < file_size ? std::min(SWARM_CHUNK, file_size - offset) : 0;
+}
+
+// failed chunk is given to another source, the one that failed is dropped
+void finish_chunk(const ChunkTransfer &transfer) {
+    auto it = swarms.find(transfer.swarm);
+    if (it == swarms.end()) {
+        return;
+    }
+    SwarmDownload &swarm = it->second;
+    SwarmSource &source = swarm.sources[transfer.source];
+    --source.in_flight;
+    if (transfer.complete) {
+        if (swarm.done.size() <= transfer.chunk) {
+            swarm.done.resize(transfer.chunk + 1, false);
+        }
+        swarm.done[transfer.chunk] = true;
+    }
+    else {
+        source.failed = true;
+        swarm.retry_chunks.push_back(transfer.chunk);
+    }
+    request_chunks(transfer.swarm);
+}
+
+// chunks covered by a .part file left by a failed fetch are not asked for
+void swarm_fetch(const std::string &filename,
+                 const std::vector<struct sockaddr_in> &sources) {
+    std::vector<SwarmSource> swarm_sources;
+    std::string addresses;
+    for (const auto &addr : sources) {
+        char address[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, (void *)(&addr.sin_addr), address,
+                      sizeof(address)) == NULL) {
+            throw std::logic_error("inet_ntop failed unexpectedly");
+        }
+        swarm_sources.push_back({addr, address, 0, false});
+        addresses += (addresses.empty() ? "" : ", ") + std::string(address);
+    }
+    int fd = open(std::string(out_fldr + "/" + filename + PART_SUFFIX).c_str(),
+                  O_WRONLY | O_CREAT, 0660);
+    if (fd < 0) {
+        int e = errno;
+        throw std::logic_error(
+            std::string("Failed to open requested file for writing ") +
+            strerror(e));
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        throw std::logic_error("Failed to get size of file");
+    }
+    // a .part file of a failed download is a prefix of the file, but one
+    // left by a swarm download that was killed has holes where chunks did
+    // not arrive, and nothing tells which of its data is real
+    off_t hole = lseek(fd, 0, SEEK_HOLE);
+    if (hole >= 0 && hole < statbuf.st_size) {
+        close(fd);
+        std::cout << "File " << filename << " downloading failed ("
+                  << addresses << ") " << filename << PART_SUFFIX
+                  << " has holes left by an interrupted swarm download, "
+                     "remove it to fetch the file again\n";
+        return;
+    }
+    uint64_t id = get_cmd_seq();
+    SwarmDownload &swarm = swarms[id];
+    swarm.filename = filename;
+    swarm.fd = fd;
+    // the last chunk of the .part file may be short, it's asked again
+    swarm.next_chunk = statbuf.st_size / SWARM_CHUNK;
+    swarm.chunk_count = UINT64_MAX;
+    swarm.done.assign(swarm.next_chunk, true);
+    swarm.sources = std::move(swarm_sources);
+    request_chunks(id);
+}
+
+void upload(
+    int sock,
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> servers,
+    const std::string &filename);
+void fetch(int sock, const struct sockaddr_in &remote_address,
+           const std::string &filename, bool try_session);
+
+// connection of a chunk also ends the chunk, successfully or not
 void remove_connection(int i) {
-    close(connections[i - 3].fd);
-    close(connections[i - 3].sock_fd);
-    connections.erase(connections.begin() + i - 3);
+    int sock_fd = connections[i - 4].sock_fd;
+    auto session = sessions.find(sock_fd);
+    // the server may close an idle session while new requests are queued on
+    // it, they are sent again as usual once the connection is gone
+    std::deque<SessionTransfer> unfinished;
+    struct sockaddr_in session_addr;
+    if (session != sessions.end()) {
+        unfinished = std::move(session->second.waiting);
+        session_addr = session->second.addr;
+        server_sessions.erase(std::make_pair(
+            session->second.addr.sin_addr.s_addr,
+            session->second.addr.sin_port));
+        sessions.erase(session);
+    }
+    connection_timers.cancel(connections[i - 4].timer);
+    auto transfer = ring_transfers.find(sock_fd);
+    if (transfer != ring_transfers.end()) {
+        // operations in flight still use both descriptors, the transfer
+        // closes them when they're over
+        transfer->second.release()->abandon();
+        ring_transfers.erase(transfer);
+    }
+    else {
+        close(connections[i - 4].fd);
+        close(connections[i - 4].sock_fd);
+    }
+    connections[i - 4].release_buffer();
+    connections.erase(connections.begin() + i - 4);
     fds.erase(fds.begin() + i);
+    download_sizes.erase(sock_fd);
+    auto chunk = sock_to_chunk.find(sock_fd);
+    if (chunk != sock_to_chunk.end()) {
+        ChunkTransfer transfer = chunk->second;
+        sock_to_chunk.erase(chunk);
+        finish_chunk(transfer);
+    }
+    for (auto &transfer : unfinished) {
+        if (transfer.fd >= 0) {
+            // the .part file holds what has come, the rest is asked for
+            close(transfer.fd);
+            fetch(main_socket, session_addr, transfer.filename, false);
+        }
+        else {
+            upload(main_socket, std::move(transfer.servers),
+                   transfer.filename);
+        }
+    }
 }
 
 void handle_interrupt() {
@@ -96,6 +528,18 @@ void parse_args(int argc, char **argv,
         throw po::validation_error(po::validation_error::invalid_option_value,
                                    "p", std::to_string(cmd_port));
     }
+    if (cache_ttl <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "c", std::to_string(cache_ttl));
+    }
+    if (add_fanout <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "k", std::to_string(add_fanout));
+    }
+    if (upload_limit <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "j", std::to_string(upload_limit));
+    }
 }
 
 struct sockaddr_in get_remote_address(const std::string &colon_address,
@@ -112,139 +556,63 @@ struct sockaddr_in get_remote_address(const std::string &colon_address,
     return remote_address;
 }
 
-// returns servers, where first is sockaddr, and second is mcast_addr and third
-// is their free space
-std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
-discover(int sock, const struct sockaddr_in &remote_address) {
-    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> result;
+// answers are printed as they arrive, until the timeout
+void discover(int sock, const struct sockaddr_in &remote_address) {
     simpl_cmd cmd;
     cmd.cmd = HELLO;
     cmd.cmd_seq = get_cmd_seq();
     cmd.addr = remote_address;
     send_cmd(cmd, sock);
+    servers.clear();
+    user_discover_running = true;
+    user_discover_seq = cmd.cmd_seq;
+    request_timers.schedule(monotonic_ms() + timeout * 1000, cmd.cmd_seq);
+}
 
-    cmplx_cmd reply;
-    struct timeval tval;
-    auto start = boost::posix_time::microsec_clock::local_time();
-    do {
-        tval.tv_sec = timeout;
-        tval.tv_usec = 0;
-        auto elapsed = boost::posix_time::microsec_clock::local_time() - start;
-        int64_t total_microsec = elapsed.total_microseconds();
-        tval.tv_sec -= total_microsec / 1000000;
-        if (tval.tv_sec < 0) {
-            break;
-        }
-
-        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tval,
-                       sizeof(tval)) < 0) {
-            throw std::logic_error("setsockopt " + std::to_string(errno) +
-                                   " " + strerror(errno));
-        }
-        try {
-            recv_cmd(reply, sock);
-            char address[INET_ADDRSTRLEN];
-            if (inet_ntop(AF_INET, (void *)(&reply.addr.sin_addr), address,
-                          sizeof(address)) == NULL) {
-                throw std::logic_error("this should not be happening");
-            }
+// servers with a shared data port append it to their multicast address
+std::string_view read_good_day(const cmd_view &cmd) {
+    uint64_t port;
+    std::string_view mcast = split_number(cmd.data, port);
+    if (port > 0 && port <= PORT_MAX) {
+        data_ports[std::make_pair(cmd.addr.sin_addr.s_addr,
+                                  cmd.addr.sin_port)] = port;
+    }
+    return mcast;
+}
 
-            //                        std::cerr << "Received reply from " <<
-            //                        address << ":"
-            //                                  << ntohs(reply.addr.sin_port)
-            //                                  << " with cmd = " << reply.cmd
-            //                                  << " and seq = " <<
-            //                                  reply.cmd_seq
-            //                                  << " (original seq was " <<
-            //                                  cmd.cmd_seq <<
-            //                                  "). Data is \""
-            //                                  << reply.data << "\"(" <<
-            //                                  reply.data.size()
-            //                                  << ") and param is " <<
-            //                                  reply.param <<
-            //                                  "\n";
-
-            if (reply.cmd_seq != cmd.cmd_seq) {
-                std::cerr << "[PCKG ERROR]  Skipping invalid package from "
-                          << address << ":" << ntohs(reply.addr.sin_port)
-                          << " (invalid cmd_seq)\n";
-                continue;
-            }
-            if (reply.cmd != GOOD_DAY) {
-                std::cerr << "[PCKG ERROR]  Skipping invalid package from "
-                          << address << ":" << reply.addr.sin_port
-                          << "(command is not GOOD_DAY when it should)\n";
-                continue;
-            }
-            result.emplace_back(reply.addr, reply.data, reply.param);
-        }
-        catch (ReceiveTimeOutException &e) {
-            break;
-        }
-    } while (true);
-    return result;
+void handle_good_day(const cmd_view &cmd, const char *address) {
+    std::string_view mcast = read_good_day(cmd);
+    servers.emplace_back(cmd.addr, mcast, cmd.param);
+    std::cout << "Found " << address << " (" << mcast
+              << ") with free space " << cmd.param << "\n";
+    // answers stream in while other commands run
+    std::cout.flush();
 }
 
-// return pairs of <server addres, list of files there>
-std::vector<std::pair<struct sockaddr_in, std::vector<std::string>>>
-search(int sock, const struct sockaddr_in &remote_address,
-       const std::string &needle) {
-    std::vector<std::pair<struct sockaddr_in, std::vector<std::string>>>
-        result;
+// answers are printed as they arrive, until the timeout, previous results
+// are forgotten
+void search(int sock, const struct sockaddr_in &remote_address,
+            const std::string &needle) {
     simpl_cmd cmd;
     cmd.cmd = LIST;
     cmd.cmd_seq = get_cmd_seq();
     cmd.addr = remote_address;
     cmd.data = needle;
     send_cmd(cmd, sock);
+    files.clear();
+    search_running = true;
+    search_seq = cmd.cmd_seq;
+    request_timers.schedule(monotonic_ms() + timeout * 1000, cmd.cmd_seq);
+}
 
-    cmplx_cmd reply;
-    struct timeval tval;
-    auto start = boost::posix_time::microsec_clock::local_time();
-    do {
-        tval.tv_sec = timeout;
-        tval.tv_usec = 0;
-        auto elapsed = boost::posix_time::microsec_clock::local_time() - start;
-        int64_t total_microsec = elapsed.total_microseconds();
-        tval.tv_sec -= total_microsec / 1000000;
-        if (tval.tv_sec < 0) {
-            break;
-        }
-
-        if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *)&tval,
-                       sizeof(tval)) < 0) {
-            throw std::logic_error("setsockopt " + std::to_string(errno) +
-                                   " " + strerror(errno));
-        }
-        try {
-            recv_cmd(reply, sock);
-            char address[INET_ADDRSTRLEN];
-            if (inet_ntop(AF_INET, (void *)(&reply.addr.sin_addr), address,
-                          sizeof(address)) == NULL) {
-                throw std::logic_error("this should not be happening");
-            }
-
-            if (reply.cmd_seq != cmd.cmd_seq) {
-                std::cerr << "[PCKG ERROR]  Skipping invalid package from "
-                          << address << ":" << reply.addr.sin_port
-                          << "(invalid cmd_seq)\n";
-                continue;
-            }
-            if (reply.cmd != MY_LIST) {
-                std::cerr << "[PCKG ERROR]  Skipping invalid package from "
-                          << address << ":" << reply.addr.sin_port
-                          << "(command is not MY_LIST when it should)\n";
-                continue;
-            }
-            std::vector<std::string> tmp;
-            boost::split(tmp, reply.data, [](char c) { return c == '\n'; });
-            result.emplace_back(reply.addr, tmp);
-        }
-        catch (ReceiveTimeOutException &e) {
-            break;
-        }
-    } while (true);
-    return result;
+void handle_my_list(const cmd_view &cmd, const char *address) {
+    std::vector<std::string> tmp;
+    boost::split(tmp, cmd.data, [](char c) { return c == '\n'; });
+    for (const auto &file : tmp) {
+        std::cout << file << " (" << address << ")\n";
+    }
+    std::cout.flush();
+    files.emplace_back(cmd.addr, std::move(tmp));
 }
 
 void remove(int sock, const struct sockaddr_in &remote_address,
@@ -257,83 +625,712 @@ void remove(int sock, const struct sockaddr_in &remote_address,
     send_cmd(cmd, sock);
 }
 
-void fetch(int sock, const struct sockaddr_in &remote_address,
-           const std::string &filename) {
+// answers are collected until the timeout, files queued in the meantime are
+// uploaded then
+void start_pseudo_discover(int sock) {
+    if (discover_running) {
+        return;
+    }
     simpl_cmd cmd;
-    cmd.cmd = GET;
+    cmd.cmd = HELLO;
     cmd.cmd_seq = get_cmd_seq();
-    cmd.addr = remote_address;
-    cmd.data = filename;
-    int fd = open(std::string(out_fldr + "/" + filename).c_str(),
-                  O_WRONLY | O_CREAT, 0660);
+    cmd.addr = get_remote_address(mcast_addr, cmd_port);
+    send_cmd(cmd, sock);
+    discover_running = true;
+    discover_seq = cmd.cmd_seq;
+    request_timers.schedule(monotonic_ms() + timeout * 1000, discover_seq);
+}
+
+// the refresh takes timeout itself, the old contents are used meanwhile
+bool server_cache_fresh() {
+    return server_cache_time != 0 &&
+           monotonic_ms() - server_cache_time <=
+               (uint64_t)(cache_ttl + timeout) * 1000;
+}
+
+void sort_by_free_space(
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
+        &list) {
+    std::sort(list.begin(), list.end(),
+              [](const std::tuple<struct sockaddr_in, std::string, uint64_t>
+                     &a,
+                 const std::tuple<struct sockaddr_in, std::string, uint64_t>
+                     &b) { return std::get<2>(a) < std::get<2>(b); });
+}
+
+// server accepted a file of given size, so it has that much less space
+void reserve_cached_space(const struct sockaddr_in &addr, uint64_t size) {
+    for (auto &server : server_cache) {
+        const struct sockaddr_in &cached = std::get<0>(server);
+        if (cached.sin_addr.s_addr == addr.sin_addr.s_addr &&
+            cached.sin_port == addr.sin_port) {
+            uint64_t &space = std::get<2>(server);
+            space = space > size ? space - size : 0;
+            sort_by_free_space(server_cache);
+            return;
+        }
+    }
+}
+
+void send_packet(const InlineRequest &request) {
+    if (sendto(main_socket, request.packet.data(), request.packet.size(), 0,
+               (const sockaddr *)(&request.addr), sizeof(request.addr)) < 0) {
+        throw std::logic_error(std::string("Failed to send ") +
+                               strerror(errno));
+    }
+}
+
+void start_inline(uint64_t cmd_seq) {
+    InlineRequest &request = inline_requests[cmd_seq];
+    request.sent = monotonic_ms();
+    request.interval = INLINE_RETRY_MS;
+    seq_to_timer[cmd_seq] =
+        request_timers.schedule(request.sent + request.interval, cmd_seq);
+    ++inline_in_flight;
+    send_packet(request);
+}
+
+// packet is sent again until an answer comes or timeout runs out, the
+// timeout starts once it's sent for the first time
+void send_inline(uint64_t cmd_seq, std::string packet,
+                 const struct sockaddr_in &addr) {
+    InlineRequest &request = inline_requests[cmd_seq];
+    request.packet = std::move(packet);
+    request.addr = addr;
+    request.sent = 0;
+    if (inline_in_flight < INLINE_WINDOW) {
+        start_inline(cmd_seq);
+    }
+    else {
+        inline_backlog.push_back(cmd_seq);
+    }
+}
+
+// request is done with, its place in the window goes to the next one
+void finish_inline(uint64_t cmd_seq) {
+    auto it = inline_requests.find(cmd_seq);
+    if (it == inline_requests.end()) {
+        return;
+    }
+    if (it->second.sent != 0) {
+        --inline_in_flight;
+    }
+    inline_requests.erase(it);
+    while (inline_in_flight < INLINE_WINDOW && !inline_backlog.empty()) {
+        uint64_t next = inline_backlog.front();
+        inline_backlog.pop_front();
+        if (inline_requests.count(next) > 0) {
+            start_inline(next);
+        }
+    }
+}
+
+// returns false if the request is not resent, because the timeout is over
+// or it's not inline at all
+bool resend_inline(uint64_t cmd_seq) {
+    auto it = inline_requests.find(cmd_seq);
+    if (it == inline_requests.end()) {
+        return false;
+    }
+    InlineRequest &request = it->second;
+    uint64_t now = monotonic_ms();
+    uint64_t deadline = request.sent + timeout * 1000;
+    if (now >= deadline) {
+        return false;
+    }
+    request.interval *= 2;
+    seq_to_timer[cmd_seq] = request_timers.schedule(
+        std::min(now + request.interval, deadline), cmd_seq);
+    send_packet(request);
+    return true;
+}
+
+// answer came, so the request is neither resent nor timed out
+void cancel_request(uint64_t cmd_seq) {
+    auto it = seq_to_timer.find(cmd_seq);
+    if (it != seq_to_timer.end()) {
+        request_timers.cancel(it->second);
+        seq_to_timer.erase(it);
+    }
+    finish_inline(cmd_seq);
+}
+
+// the whole file goes in ADD_INLINE, returns false if it could not be read,
+// then it's sent with ADD
+bool send_add_inline(const cmplx_cmd &cmd, int fd) {
+    std::string data = cmd.data;
+    data.push_back('\0');
+    size_t start = data.size();
+    data.resize(start + cmd.param);
+    uint64_t done = 0;
+    while (done < cmd.param) {
+        ssize_t len = pread(fd, &data[start + done], cmd.param - done, done);
+        if (len <= 0) {
+            return false;
+        }
+        done += len;
+    }
+    char packet[BUFFER_SIZE];
+    size_t len = pack_cmd(packet, ADD_INLINE, cmd.cmd_seq, cmd.param, data);
+    send_inline(cmd.cmd_seq, std::string(packet, len), cmd.addr);
+    return true;
+}
+
+// keeps up to add_fanout ADDs of the upload in flight, to servers with the
+// most free space first, the upload fails once there is no candidate left
+// and no answer to wait for
+void send_adds(uint64_t id) {
+    auto &servers = seq_to_servers[id];
+    std::vector<uint64_t> &adds = upload_adds[id];
+    // an aborted transfer of an empty file looks just like a complete one,
+    // and a file sent inline is stored by every server that takes it, so
+    // those are offered to one server at a time
+    bool inline_add =
+        inline_mode && fits_inline(servers.second.data, servers.second.param);
+    size_t fanout =
+        servers.second.param > 0 && !inline_add ? add_fanout : 1;
+    while (adds.size() < fanout && !servers.first.empty()) {
+        cmplx_cmd cmd = servers.second;
+        cmd.addr = std::get<0>(servers.first.back());
+        cmd.cmd_seq = get_cmd_seq();
+        servers.first.pop_back();
+        if (!inline_add || !send_add_inline(cmd, seq_to_conn[id].fd)) {
+            send_cmd(cmd, main_socket);
+            seq_to_timer[cmd.cmd_seq] = request_timers.schedule(
+                monotonic_ms() + timeout * 1000, cmd.cmd_seq);
+        }
+        adds.push_back(cmd.cmd_seq);
+        seq_to_upload[cmd.cmd_seq] = id;
+    }
+    if (!adds.empty()) {
+        return;
+    }
+
+    std::string name = servers.second.data;
+    ConnectionInfo info = std::move(seq_to_conn[id]);
+    seq_to_conn.erase(id);
+    seq_to_servers.erase(id);
+    upload_adds.erase(id);
+    close(info.fd);
+    // cached free space may be outdated, so the file gets another chance
+    if (cached_uploads.erase(info.filename) > 0) {
+        files_to_upload.push_back(info.filename);
+        start_pseudo_discover(main_socket);
+        return;
+    }
+    std::cout << "File " << name << " too big\n";
+}
+
+// timeout after ADD is handled the same way
+void handle_no_way(uint64_t seq) {
+    cancel_request(seq);
+    if (released_adds.erase(seq) > 0) {
+        return;
+    }
+    auto upload_it = seq_to_upload.find(seq);
+    if (upload_it == seq_to_upload.end()) {
+        return;
+    }
+    uint64_t id = upload_it->second;
+    seq_to_upload.erase(upload_it);
+    std::vector<uint64_t> &adds = upload_adds[id];
+    adds.erase(std::find(adds.begin(), adds.end(), seq));
+    send_adds(id);
+}
+
+void upload(
+    int sock,
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> servers,
+    const std::string &filename) {
+
+    cmplx_cmd cmd;
+    cmd.cmd = ADD;
+    int fd = open(filename.c_str(), O_RDONLY);
     if (fd < 0) {
-        int e = errno;
+        std::cout << "File " << filename << " does not exist\n";
+        return;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        throw std::logic_error("Failed to get size of file");
+    }
+    cmd.param = statbuf.st_size;
+    cmd.data = get_name_from_path(filename);
+    // the upload is known by this key until some server accepts it, every
+    // ADD sent for it has its own cmd_seq
+    uint64_t id = get_cmd_seq();
+    seq_to_conn[id] =
+        ConnectionInfo(monotonic_ms(), sock, fd, filename, false, false, "",
+                       0);
+    seq_to_servers[id] = std::make_pair(servers, cmd);
+    send_adds(id);
+}
+
+// connection is checked lazily, its start is updated on every activity
+void add_connection(int sock_fd, int fd, const std::string &filename,
+                    bool writing, const std::string &ip, uint16_t port) {
+    uint64_t now = monotonic_ms();
+    connections.emplace_back(now, sock_fd, fd, filename, true, writing, ip,
+                             port);
+    connections.back().timer =
+        connection_timers.schedule(now + timeout * 1000, sock_fd);
+}
+
+// connect is non-blocking, the socket is ready once it's writable
+int open_data_connection(const struct sockaddr_in &addr, uint16_t port) {
+    int new_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (new_socket < 0) {
+        throw std::logic_error("creating new tcp socket failed");
+    }
+    struct sockaddr_in local_address;
+    local_address.sin_family = AF_INET;
+    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_address.sin_port = htons(0);
+    if (bind(new_socket, (struct sockaddr *)&local_address,
+             sizeof(local_address)) < 0) {
+        close(new_socket);
+        throw std::logic_error("Failed to bind new socket");
+    }
+    struct sockaddr_in remote_address = addr;
+    remote_address.sin_port = htons(port);
+    connect(new_socket, (struct sockaddr *)(&remote_address),
+            sizeof(remote_address));
+    return new_socket;
+}
+
+ConnectionInfo &session_connection(int sock) {
+    for (auto &conn : connections) {
+        if (conn.sock_fd == sock) {
+            return conn;
+        }
+    }
+    throw std::logic_error("Data session without connection");
+}
+
+// session is opened on the first transfer, -1 if the server has no shared
+// data port
+int open_session(const struct sockaddr_in &addr) {
+    auto key = std::make_pair(addr.sin_addr.s_addr, addr.sin_port);
+    auto session_it = server_sessions.find(key);
+    if (session_it != server_sessions.end()) {
+        return session_it->second;
+    }
+    auto port_it = data_ports.find(key);
+    if (port_it == data_ports.end()) {
+        return -1;
+    }
+    char address[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, (void *)(&addr.sin_addr), address,
+                  sizeof(address)) == NULL) {
+        throw std::logic_error("inet_ntop failed unexpectedly");
+    }
+    int new_socket = open_data_connection(addr, port_it->second);
+    int nodelay = 1;
+    setsockopt(new_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+               sizeof(nodelay));
+    fds.push_back({new_socket, POLLOUT, 0});
+    add_connection(new_socket, -1, "", false, address, port_it->second);
+    connections.back().token = SESSION_TOKEN;
+    connections.back().phase = SessionPhase::REQUEST;
+    DataSession &session = sessions[new_socket];
+    session.addr = addr;
+    session.out_sent = 0;
+    session.body_left = 0;
+    server_sessions[key] = new_socket;
+    return new_socket;
+}
+
+void queue_frame(int sock, Command cmd, uint64_t cmd_seq, uint64_t param,
+                 std::string_view data) {
+    char frame[BUFFER_SIZE];
+    size_t len = pack_frame(frame, cmd, cmd_seq, param, data);
+    sessions[sock].out.append(frame, len);
+    for (size_t i = 4; i < fds.size(); ++i) {
+        if (fds[i].fd == sock) {
+            fds[i].events |= POLLOUT;
+        }
+    }
+}
+
+// fd is the .part file, offset is its size, returns false if there's no
+// session with the server
+bool session_fetch(const struct sockaddr_in &addr, const std::string &filename,
+                   int fd, uint64_t offset) {
+    int sock = open_session(addr);
+    if (sock < 0) {
+        return false;
+    }
+    SessionTransfer transfer;
+    transfer.cmd_seq = get_cmd_seq();
+    transfer.filename = filename;
+    transfer.fd = fd;
+    transfer.size = 0;
+    if (offset > 0) {
+        queue_frame(sock, GET_RANGE, transfer.cmd_seq, offset, filename);
+    }
+    else {
+        queue_frame(sock, GET, transfer.cmd_seq, 0, filename);
+    }
+    sessions[sock].waiting.push_back(std::move(transfer));
+    return true;
+}
+
+// small files of upload-dir go through the session with their assigned
+// server, the last one of servers, returns false if they can't
+bool session_upload(
+    const std::string &filename,
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>>
+        &servers) {
+    if (!session_mode || servers.empty()) {
+        return false;
+    }
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0 ||
+        (uint64_t)statbuf.st_size > SESSION_FILE_MAX) {
+        close(fd);
+        return false;
+    }
+    int sock = open_session(std::get<0>(servers.back()));
+    if (sock < 0) {
         close(fd);
+        return false;
+    }
+    SessionTransfer transfer;
+    transfer.cmd_seq = get_cmd_seq();
+    transfer.filename = filename;
+    transfer.fd = -1;
+    transfer.size = statbuf.st_size;
+    transfer.servers = servers;
+    queue_frame(sock, ADD, transfer.cmd_seq, transfer.size,
+                get_name_from_path(filename));
+    // the whole file follows ADD, it's small enough to be kept in memory
+    std::string &out = sessions[sock].out;
+    size_t start = out.size();
+    out.resize(start + transfer.size);
+    uint64_t done = 0;
+    while (done < transfer.size) {
+        ssize_t len =
+            pread(fd, &out[start + done], transfer.size - done, done);
+        if (len <= 0) {
+            // the frame is already queued, so zeros keep the stream in sync,
+            // the server gets a damaged file only if it shrank meanwhile
+            break;
+        }
+        done += len;
+    }
+    close(fd);
+    sessions[sock].waiting.push_back(std::move(transfer));
+    return true;
+}
+
+void finish_session_fetch(int sock) {
+    DataSession &session = sessions[sock];
+    SessionTransfer &transfer = session.waiting.front();
+    ConnectionInfo &info = session_connection(sock);
+    close(transfer.fd);
+    std::string path = out_fldr + "/" + transfer.filename;
+    if (rename((path + PART_SUFFIX).c_str(), path.c_str()) < 0) {
+        std::cout << "File " << transfer.filename << " downloading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Rename of downloaded file failed with \""
+                  << strerror(errno) << "\" error\n";
+    }
+    else {
+        std::cout << "File " << transfer.filename << " downloaded ("
+                  << info.ip << ":" << info.port << ")\n";
+    }
+    session.waiting.pop_front();
+}
+
+// reply is matched with the oldest request of the session
+void handle_session_reply(int sock, const cmd_view &cmd) {
+    DataSession &session = sessions[sock];
+    ConnectionInfo &info = session_connection(sock);
+    if (session.waiting.empty() ||
+        session.waiting.front().cmd_seq != cmd.cmd_seq) {
+        throw std::runtime_error("Unexpected reply in data session");
+    }
+    SessionTransfer &transfer = session.waiting.front();
+    if (transfer.fd >= 0) {
+        if (cmd.cmd == CONNECT_ME) {
+            session.body_left = cmd.param;
+            if (session.body_left > 0) {
+                return;
+            }
+            finish_session_fetch(sock);
+            return;
+        }
+        std::cout << "File " << transfer.filename << " downloading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Server refused to send it\n";
+        close(transfer.fd);
+    }
+    else if (cmd.cmd == CAN_ADD) {
+        std::cout << "File " << transfer.filename << " uploaded ("
+                  << info.ip << ":" << info.port << ")\n";
+        reserve_cached_space(session.addr, transfer.size);
+        cached_uploads.erase(transfer.filename);
+    }
+    else {
+        // the remaining servers are asked as usual
+        transfer.servers.pop_back();
+        upload(main_socket, std::move(transfer.servers), transfer.filename);
+    }
+    session.waiting.pop_front();
+}
+
+void read_session(int i) {
+    ConnectionInfo &info = connections[i - 4];
+    DataSession &session = sessions[info.sock_fd];
+    info.attach_buffer();
+    ssize_t len = read(info.sock_fd, info.buffer, BUFFER_SIZE);
+    if (len <= 0) {
+        info.release_buffer();
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        remove_connection(i);
+        return;
+    }
+    size_t used = 0;
+    while (used < (size_t)len) {
+        if (session.body_left > 0) {
+            size_t take = std::min<uint64_t>(session.body_left, len - used);
+            SessionTransfer &transfer = session.waiting.front();
+            if (write(transfer.fd, info.buffer + used, take) !=
+                (ssize_t)take) {
+                std::cout << "File " << transfer.filename
+                          << " downloading failed (" << info.ip << ":"
+                          << info.port << ") Write to disk failed\n";
+                remove_connection(i);
+                return;
+            }
+            used += take;
+            session.body_left -= take;
+            if (session.body_left == 0) {
+                finish_session_fetch(info.sock_fd);
+            }
+            continue;
+        }
+        // length of the frame is read first, then the rest of it
+        size_t wanted = FRAME_LENGTH_SIZE;
+        if (session.in.size() >= FRAME_LENGTH_SIZE) {
+            uint32_t length;
+            memcpy(&length, session.in.data(), sizeof(length));
+            if (length == 0) {
+                remove_connection(i);
+                throw std::runtime_error("Empty frame in data session");
+            }
+            wanted += be32toh(length);
+        }
+        size_t take = std::min(wanted - session.in.size(), len - used);
+        session.in.append(info.buffer + used, take);
+        used += take;
+        if (wanted == FRAME_LENGTH_SIZE || session.in.size() < wanted) {
+            continue;
+        }
+        cmd_view cmd;
+        try {
+            parse_cmd(cmd, session.in.data() + FRAME_LENGTH_SIZE,
+                      session.in.size() - FRAME_LENGTH_SIZE);
+            handle_session_reply(info.sock_fd, cmd);
+        }
+        catch (std::exception &e) {
+            remove_connection(i);
+            throw;
+        }
+        session.in.clear();
+    }
+    info.release_buffer();
+}
+
+void write_session(int i) {
+    ConnectionInfo &info = connections[i - 4];
+    DataSession &session = sessions[info.sock_fd];
+    while (session.out_sent < session.out.size()) {
+        ssize_t len =
+            write(info.sock_fd, session.out.data() + session.out_sent,
+                  session.out.size() - session.out_sent);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // replies are read meanwhile, the server may wait for that
+                fds[i].events = POLLIN | POLLOUT;
+                return;
+            }
+            remove_connection(i);
+            return;
+        }
+        session.out_sent += len;
+    }
+    session.out.clear();
+    session.out_sent = 0;
+    fds[i].events = POLLIN;
+}
+
+// file is downloaded to its .part file, which is renamed when the download
+// finishes, so if a .part file is left from a failed download, only the rest
+// of the file is asked for
+void fetch(int sock, const struct sockaddr_in &remote_address,
+           const std::string &filename, bool try_session) {
+    int fd = open(std::string(out_fldr + "/" + filename + PART_SUFFIX).c_str(),
+                  O_WRONLY | O_CREAT | O_APPEND, 0660);
+    if (fd < 0) {
+        int e = errno;
         throw std::logic_error(
             std::string("Failed to open requested file for writing ") +
             strerror(e));
     }
-    seq_to_conn[cmd.cmd_seq] =
-        ConnectionInfo(boost::posix_time::microsec_clock::local_time(),
-                       main_socket, fd, filename, false, true, "", 0);
-    send_cmd(cmd, sock);
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        throw std::logic_error("Failed to get size of file");
+    }
+    if (try_session && session_mode &&
+        session_fetch(remote_address, filename, fd, statbuf.st_size)) {
+        return;
+    }
+    uint64_t cmd_seq = get_cmd_seq();
+    if (inline_mode && statbuf.st_size == 0) {
+        char packet[BUFFER_SIZE];
+        size_t len = pack_cmd(packet, GET_INLINE, cmd_seq, filename);
+        send_inline(cmd_seq, std::string(packet, len), remote_address);
+    }
+    else if (statbuf.st_size > 0) {
+        cmplx_cmd cmd;
+        cmd.cmd = GET_RANGE;
+        cmd.cmd_seq = cmd_seq;
+        cmd.param = statbuf.st_size;
+        cmd.addr = remote_address;
+        cmd.data = filename;
+        send_cmd(cmd, sock);
+        ranged_fetches.insert(cmd_seq);
+    }
+    else {
+        simpl_cmd cmd;
+        cmd.cmd = GET;
+        cmd.cmd_seq = cmd_seq;
+        cmd.addr = remote_address;
+        cmd.data = filename;
+        send_cmd(cmd, sock);
+    }
+    seq_to_conn[cmd_seq] = ConnectionInfo(monotonic_ms(), main_socket, fd,
+                                          filename, false, true, "", 0);
+}
+
+// first server to accept gets the file, ADDs still in flight are released
+// if they are accepted later
+void accept_add(const cmd_view &cmd, uint64_t id, uint64_t token,
+                const char *address) {
+    ConnectionInfo &info = seq_to_conn[id];
+    int new_socket = open_data_connection(cmd.addr, cmd.param);
+    fds.push_back({new_socket, POLLOUT, 0});
+    add_connection(new_socket, info.fd, info.filename, info.writing, address,
+                   cmd.param);
+    connections.back().token = token;
+    reserve_cached_space(cmd.addr, seq_to_servers[id].second.param);
+    cached_uploads.erase(info.filename);
+    for (uint64_t seq : upload_adds[id]) {
+        seq_to_upload.erase(seq);
+        if (seq == cmd.cmd_seq) {
+            cancel_request(seq);
+        }
+        else {
+            // their timers stay, so that they are forgotten at the timeout
+            released_adds.insert(seq);
+        }
+    }
+    upload_adds.erase(id);
+    seq_to_conn.erase(id);
+    seq_to_servers.erase(id);
 }
 
-auto handle_no_way(uint64_t seq) {
-    auto servers = seq_to_servers.find(seq)->second;
-    cmplx_cmd cmd = servers.second;
-    auto conn_it = seq_to_conn.find(seq);
-    ConnectionInfo info = conn_it->second;
-    seq_to_conn.erase(conn_it);
-    seq_to_servers.erase(seq);
-    auto ret = seq_to_starttime.erase(seq_to_starttime.find(seq));
+// server that accepted an upload placed elsewhere is connected to and the
+// connection is closed without data, so it drops the file at once instead
+// of holding its space until the timeout
+void release_add(const cmd_view &cmd, uint64_t token, const char *address) {
+    released_adds.erase(cmd.cmd_seq);
+    cancel_request(cmd.cmd_seq);
+    int new_socket = open_data_connection(cmd.addr, cmd.param);
+    fds.push_back({new_socket, POLLOUT, 0});
+    add_connection(new_socket, -1, "", false, address, cmd.param);
+    connections.back().token = token;
+}
 
-    if (servers.first.empty()) {
-        std::cout << "File " << cmd.data << " too big\n";
-        return ret;
-    }
-    cmd.addr = std::get<0>(servers.first[servers.first.size() - 1]);
-    cmd.cmd_seq = get_cmd_seq();
-    servers.first.pop_back();
-    send_cmd(cmd, info.sock_fd);
-    auto now = boost::posix_time::microsec_clock::local_time();
-    seq_to_conn[cmd.cmd_seq] = info;
-    seq_to_servers[cmd.cmd_seq] = std::move(servers);
-    seq_to_starttime[cmd.cmd_seq] = std::move(now);
-    return ret;
+// server stored the file from ADD_INLINE, nothing more is sent
+void finish_inline_add(const cmd_view &cmd, uint64_t id,
+                       const char *address) {
+    ConnectionInfo &info = seq_to_conn[id];
+    std::cout << "File " << info.filename << " uploaded (" << address << ":"
+              << ntohs(cmd.addr.sin_port) << ")\n";
+    cancel_request(cmd.cmd_seq);
+    close(info.fd);
+    reserve_cached_space(cmd.addr, seq_to_servers[id].second.param);
+    cached_uploads.erase(info.filename);
+    seq_to_upload.erase(cmd.cmd_seq);
+    upload_adds.erase(id);
+    seq_to_conn.erase(id);
+    seq_to_servers.erase(id);
 }
 
-void upload(
-    int sock,
-    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> servers,
-    const std::string &filename) {
+void handle_add_answer(const cmd_view &cmd, const char *address) {
+    // servers with a shared data port append a transfer token
+    uint64_t token;
+    std::string_view data = split_number(cmd.data, token);
+    auto upload_it = seq_to_upload.find(cmd.cmd_seq);
+    if (cmd.cmd == CAN_ADD && data.empty()) {
+        if (upload_it == seq_to_upload.end()) {
+            release_add(cmd, token, address);
+        }
+        else {
+            accept_add(cmd, upload_it->second, token, address);
+        }
+    }
+    else if (cmd.cmd == ADDED && upload_it != seq_to_upload.end() &&
+             cmd.data == seq_to_servers[upload_it->second].second.data) {
+        finish_inline_add(cmd, upload_it->second, address);
+    }
+    else if (cmd.cmd == NO_WAY &&
+             (upload_it == seq_to_upload.end() ||
+              cmd.data == seq_to_servers[upload_it->second].second.data)) {
+        handle_no_way(cmd.cmd_seq);
+    }
+    else {
+        std::cerr << "[PCKG ERROR]  Skipping invalid package from "
+                  << address << ":" << ntohs(cmd.addr.sin_port) << ".\n";
+    }
+}
 
-    cmplx_cmd cmd;
-    cmd.cmd = ADD;
-    cmd.cmd_seq = get_cmd_seq();
-    int fd = open(filename.c_str(), O_RDONLY);
-    if (fd < 0) {
-        std::cout << "File " << filename << " does not exist\n";
-        return;
+// info is the fetch waiting for the answer, its .part file is empty
+void save_inline_file(const cmd_view &cmd, ConnectionInfo &info,
+                      const char *address) {
+    uint16_t port = ntohs(cmd.addr.sin_port);
+    std::string path = out_fldr + "/" + info.filename;
+    if (write(info.fd, cmd.payload.data(), cmd.payload.size()) !=
+        (ssize_t)cmd.payload.size()) {
+        std::cout << "File " << info.filename << " downloading failed ("
+                  << address << ":" << port << ") Write to disk failed\n";
     }
-    struct stat statbuf;
-    if (fstat(fd, &statbuf) < 0) {
-        close(fd);
-        throw std::logic_error("Failed to get size of file");
+    else if (rename((path + PART_SUFFIX).c_str(), path.c_str()) < 0) {
+        std::cout << "File " << info.filename << " downloading failed ("
+                  << address << ":" << port
+                  << ") Rename of downloaded file failed with \""
+                  << strerror(errno) << "\" error\n";
     }
-    cmd.param = statbuf.st_size;
-    cmd.data = get_name_from_path(filename);
-    auto now = boost::posix_time::microsec_clock::local_time();
-    seq_to_conn[cmd.cmd_seq] =
-        ConnectionInfo(now, sock, fd, filename, false, false, "", 0);
-    seq_to_servers[cmd.cmd_seq] = std::make_pair(servers, cmd);
-    seq_to_starttime[cmd.cmd_seq] = now;
-    handle_no_way(cmd.cmd_seq);
+    else {
+        std::cout << "File " << info.filename << " downloaded (" << address
+                  << ":" << port << ")\n";
+    }
+    close(info.fd);
 }
 
 void handle_server_answer() {
-    cmplx_cmd cmd;
-    recv_cmd(cmd, main_socket);
+    cmd_view cmd;
+    recv_cmd(cmd, recv_buffer, main_socket);
     char address[INET_ADDRSTRLEN];
     if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
                   sizeof(address)) == NULL) {
@@ -342,73 +1339,86 @@ void handle_server_answer() {
     if (discover_seq == cmd.cmd_seq) {
         if (cmd.cmd == GOOD_DAY) {
             // this is an answer to pre-run discover
-            discovered_servers.emplace_back(cmd.addr, cmd.data, cmd.param);
+            discovered_servers.emplace_back(cmd.addr, read_good_day(cmd),
+                                            cmd.param);
             return;
         }
     }
+    if (user_discover_running && user_discover_seq == cmd.cmd_seq &&
+        cmd.cmd == GOOD_DAY) {
+        handle_good_day(cmd, address);
+        return;
+    }
+    if (search_running && search_seq == cmd.cmd_seq && cmd.cmd == MY_LIST) {
+        handle_my_list(cmd, address);
+        return;
+    }
+    if (seq_to_upload.count(cmd.cmd_seq) > 0 ||
+        released_adds.count(cmd.cmd_seq) > 0) {
+        handle_add_answer(cmd, address);
+        return;
+    }
     if (seq_to_conn.find(cmd.cmd_seq) != seq_to_conn.end()) {
         ConnectionInfo &info = seq_to_conn[cmd.cmd_seq];
+        // servers with a shared data port append a transfer token
+        uint64_t token;
+        std::string_view data = split_number(cmd.data, token);
+        // replies to chunk requests and resumed fetches have size of the
+        // file before the token
+        uint64_t file_size = UINT64_MAX;
+        bool ranged = ranged_fetches.erase(cmd.cmd_seq) > 0;
+        if (seq_to_chunk.count(cmd.cmd_seq) > 0 || ranged) {
+            uint64_t number;
+            std::string_view rest = split_number(data, number);
+            if (rest.size() < data.size()) {
+                file_size = number;
+                data = rest;
+            }
+            else {
+                file_size = token;
+                token = 0;
+            }
+        }
         if (info.writing == true) {
-            if (cmd.cmd == CONNECT_ME && cmd.data == info.filename) {
-                // correct arguments
-                int new_socket =
-                    socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-                if (new_socket < 0) {
-                    throw std::logic_error("creating new tcp socket failed");
-                }
-                struct sockaddr_in local_address;
-                local_address.sin_family = AF_INET;
-                local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-                local_address.sin_port = htons(0);
-                if (bind(new_socket, (struct sockaddr *)&local_address,
-                         sizeof(local_address)) < 0) {
-                    close(new_socket);
-                    throw std::logic_error("Failed to bind new socket");
-                }
-                struct sockaddr_in remote_address = cmd.addr;
-                remote_address.sin_port = htons(cmd.param);
-                connect(new_socket, (struct sockaddr *)(&remote_address),
-                        sizeof(remote_address));
-
-                fds.push_back({new_socket, POLLIN, 0});
-                connections.emplace_back(
-                    boost::posix_time::microsec_clock::local_time(),
-                    new_socket, info.fd, cmd.data, true, info.writing, address,
-                    cmd.param);
+            if (cmd.cmd == FILE_DATA && cmd.data == info.filename &&
+                cmd.payload.size() == cmd.param) {
+                cancel_request(cmd.cmd_seq);
+                save_inline_file(cmd, info, address);
                 seq_to_conn.erase(cmd.cmd_seq);
                 return;
             }
-        }
-        else {
-            if (cmd.cmd == CAN_ADD && cmd.data.empty()) {
-                int new_socket =
-                    socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-                struct sockaddr_in local_address;
-                local_address.sin_family = AF_INET;
-                local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-                local_address.sin_port = htons(0);
-                if (bind(new_socket, (struct sockaddr *)&local_address,
-                         sizeof(local_address)) < 0) {
-                    close(new_socket);
-                    throw std::logic_error("Failed to bind new socket");
-                }
-                struct sockaddr_in remote_address = cmd.addr;
-                remote_address.sin_port = htons(cmd.param);
-                connect(new_socket, (struct sockaddr *)(&remote_address),
-                        sizeof(remote_address));
-                fds.push_back({new_socket, POLLOUT, 0});
-                connections.emplace_back(
-                    boost::posix_time::microsec_clock::local_time(),
-                    new_socket, info.fd, info.filename, true, info.writing,
-                    address, cmd.param);
+            if (cmd.cmd == NO_WAY && ranged && data == info.filename) {
+                // the .part file is kept, it may be of another version of
+                // the file, which some other server still has
+                std::cout << "File " << info.filename
+                          << " downloading failed (" << address << ":"
+                          << ntohs(cmd.addr.sin_port)
+                          << ") Server has no such part of the file\n";
+                close(info.fd);
                 seq_to_conn.erase(cmd.cmd_seq);
-                seq_to_starttime.erase(cmd.cmd_seq);
-                seq_to_servers.erase(cmd.cmd_seq);
                 return;
             }
-            else if (cmd.cmd == NO_WAY &&
-                     cmd.data == get_name_from_path(info.filename)) {
-                handle_no_way(cmd.cmd_seq);
+            if (cmd.cmd == CONNECT_ME && data == info.filename) {
+                // correct arguments
+                int new_socket = open_data_connection(cmd.addr, cmd.param);
+                if (ranged && file_size != UINT64_MAX) {
+                    download_sizes[new_socket] = file_size;
+                }
+
+                // the token is sent first, as soon as the socket connects
+                short events = token ? POLLOUT : POLLIN;
+                fds.push_back({new_socket, events, 0});
+                add_connection(new_socket, info.fd, std::string(data),
+                               info.writing, address, cmd.param);
+                connections.back().token = token;
+                seq_to_conn.erase(cmd.cmd_seq);
+                cancel_request(cmd.cmd_seq);
+                auto chunk = seq_to_chunk.find(cmd.cmd_seq);
+                if (chunk != seq_to_chunk.end()) {
+                    start_chunk(chunk->second, file_size);
+                    sock_to_chunk[new_socket] = chunk->second;
+                    seq_to_chunk.erase(chunk);
+                }
                 return;
             }
         }
@@ -426,39 +1436,118 @@ void pseudo_discover(int sock, const std::string &filename) {
         return;
     }
     close(fd);
-    if (discover_start.is_not_a_date_time()) {
-        simpl_cmd cmd;
-        cmd.cmd = HELLO;
-        cmd.cmd_seq = get_cmd_seq();
-        cmd.addr = get_remote_address(mcast_addr, cmd_port);
-        send_cmd(cmd, sock);
-        discover_start = boost::posix_time::microsec_clock::local_time();
-        discover_seq = cmd.cmd_seq;
+    if (server_cache_fresh() && !server_cache.empty()) {
+        cached_uploads.insert(filename);
+        upload(sock, server_cache, filename);
+        return;
     }
+    start_pseudo_discover(sock);
     files_to_upload.push_back(filename);
 }
 
-void handle_user_input(const struct sockaddr_in &remote_address) {
-    std::string line;
-    std::getline(std::cin, line);
+// uploads waiting for a server and uploads being sent
+size_t uploads_in_flight() {
+    size_t count = seq_to_servers.size();
+    for (const auto &session : sessions) {
+        for (const auto &transfer : session.second.waiting) {
+            count += transfer.fd < 0;
+        }
+    }
+    for (const auto &conn : connections) {
+        // released uploads have no file
+        if (!conn.writing && conn.fd >= 0) {
+            ++count;
+        }
+    }
+    return count;
+}
 
-    // Assume discover cannot have whitespace after it
-    if (boost::iequals(line, DISCOVER)) {
-        servers = discover(main_socket, remote_address);
+void start_queued_uploads() {
+    if (upload_queue.empty()) {
+        return;
+    }
+    size_t running = uploads_in_flight();
+    while (!upload_queue.empty() && running < (size_t)upload_limit) {
+        auto next = std::move(upload_queue.front());
+        upload_queue.pop_front();
+        if (!session_upload(next.first, next.second)) {
+            upload(main_socket, std::move(next.second), next.first);
+        }
+        ++running;
+    }
+}
 
-        char address[INET_ADDRSTRLEN];
-        for (const auto &server_info : servers) {
-            if (inet_ntop(AF_INET,
-                          (void *)(&std::get<0>(server_info).sin_addr),
-                          address, sizeof(address)) == NULL) {
-                throw std::logic_error("inet_ntop failed unexpectedly");
-            }
+// files are placed largest first, each on the server with the most space
+// left after the files placed before it, so that the batch keeps all
+// servers busy instead of filling the emptiest one first
+void pack_batch(
+    const std::vector<std::string> &filenames,
+    std::vector<std::tuple<struct sockaddr_in, std::string, uint64_t>> servers,
+    bool from_cache) {
+    std::vector<std::pair<uint64_t, std::string>> sized;
+    for (const auto &filename : filenames) {
+        struct stat statbuf;
+        if (stat(filename.c_str(), &statbuf) < 0 ||
+            !S_ISREG(statbuf.st_mode)) {
+            std::cout << "File " << filename << " does not exist\n";
+            continue;
+        }
+        sized.emplace_back(statbuf.st_size, filename);
+    }
+    std::sort(sized.begin(), sized.end(),
+              [](const std::pair<uint64_t, std::string> &a,
+                 const std::pair<uint64_t, std::string> &b) {
+                  return a.first > b.first;
+              });
+    for (const auto &file : sized) {
+        sort_by_free_space(servers);
+        // if even the emptiest server is too small, ADDs tell for sure
+        upload_queue.emplace_back(file.second, servers);
+        if (!servers.empty() && std::get<2>(servers.back()) >= file.first) {
+            std::get<2>(servers.back()) -= file.first;
+        }
+        if (from_cache) {
+            cached_uploads.insert(file.second);
+        }
+    }
+    start_queued_uploads();
+}
 
-            std::cout << "Found " << address << " ("
-                      << std::get<1>(server_info) << ") with free space "
-                      << std::get<2>(server_info) << "\n";
+// path is either a directory, whose regular files are sent, or a pattern
+void upload_dir(const std::string &path) {
+    struct stat statbuf;
+    std::string pattern = path;
+    if (stat(path.c_str(), &statbuf) == 0 && S_ISDIR(statbuf.st_mode)) {
+        pattern = path + "/*";
+    }
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, NULL, &matches) != 0) {
+        std::cout << "No files match " << path << "\n";
+        globfree(&matches);
+        return;
+    }
+    std::vector<std::string> filenames;
+    for (size_t i = 0; i < matches.gl_pathc; ++i) {
+        if (stat(matches.gl_pathv[i], &statbuf) == 0 &&
+            S_ISREG(statbuf.st_mode)) {
+            filenames.push_back(matches.gl_pathv[i]);
         }
     }
+    globfree(&matches);
+    if (server_cache_fresh() && !server_cache.empty()) {
+        pack_batch(filenames, server_cache, true);
+        return;
+    }
+    start_pseudo_discover(main_socket);
+    batches_to_upload.push_back(std::move(filenames));
+}
+
+void handle_user_command(const std::string &line,
+                         const struct sockaddr_in &remote_address) {
+    // Assume discover cannot have whitespace after it
+    if (boost::iequals(line, DISCOVER)) {
+        discover(main_socket, remote_address);
+    }
     else if (boost::iequals(line.substr(0, SEARCH.size()), SEARCH)) {
         std::string needle;
         if (line.size() > SEARCH.size()) {
@@ -467,30 +1556,50 @@ void handle_user_input(const struct sockaddr_in &remote_address) {
             }
             needle = line.substr(SEARCH.size() + 1, line.size());
         }
-        files = search(main_socket, remote_address, needle);
-        for (const auto &package : files) {
-            char address[INET_ADDRSTRLEN];
-            if (inet_ntop(AF_INET, (void *)(&package.first.sin_addr), address,
-                          sizeof(address)) == NULL) {
-                throw std::logic_error("inet_ntop failed unexpectedly");
-            }
-            for (const auto &file : package.second) {
-                std::cout << file << " (" << address << ")\n";
-            }
-        }
+        search(main_socket, remote_address, needle);
     }
     else if (boost::iequals(line.substr(0, FETCH.size()), FETCH) &&
              line.size() >= FETCH.size() + 2 && line[FETCH.size()] == ' ') {
         std::string needle = line.substr(FETCH.size() + 1, line.size());
+        std::vector<struct sockaddr_in> sources;
         for (const auto &package : files) {
+            bool listed = false;
             for (const auto &file : package.second) {
-                if (file == needle) {
-                    fetch(main_socket, package.first, file);
-                    return;
-                }
+                listed = listed || file == needle;
+            }
+            if (!listed) {
+                continue;
+            }
+            if (!swarm_mode) {
+                fetch(main_socket, package.first, needle, true);
+                return;
+            }
+            // a server sends several MY_LIST packets for long lists
+            bool known = false;
+            for (const auto &source : sources) {
+                known = known ||
+                        (source.sin_addr.s_addr ==
+                             package.first.sin_addr.s_addr &&
+                         source.sin_port == package.first.sin_port);
+            }
+            if (!known) {
+                sources.push_back(package.first);
             }
         }
-        std::cout << "Requested file is not in recently searched\n";
+        if (sources.empty()) {
+            std::cout << "Requested file is not in recently searched\n";
+        }
+        else if (sources.size() == 1) {
+            fetch(main_socket, sources[0], needle, true);
+        }
+        else {
+            swarm_fetch(needle, sources);
+        }
+    }
+    else if (boost::iequals(line.substr(0, UPLOAD_DIR.size()), UPLOAD_DIR) &&
+             line.size() >= UPLOAD_DIR.size() + 2 &&
+             line[UPLOAD_DIR.size()] == ' ') {
+        upload_dir(line.substr(UPLOAD_DIR.size() + 1, line.size()));
     }
     else if (boost::iequals(line.substr(0, UPLOAD.size()), UPLOAD) &&
              line.size() >= UPLOAD.size() + 2 && line[UPLOAD.size()] == ' ') {
@@ -508,6 +1617,37 @@ void handle_user_input(const struct sockaddr_in &remote_address) {
     }
 }
 
+// several lines may arrive at once, e.g. from a script, each of them is
+// handled, a partial line waits for the rest
+void handle_user_input(const struct sockaddr_in &remote_address) {
+    char buffer[BUFFER_SIZE];
+    ssize_t len = read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (len < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return;
+        }
+        throw std::logic_error("Failed to read from stdin");
+    }
+    if (len == 0) {
+        // nothing more will come, the last line may be unterminated
+        fds[2].fd = -1;
+        input_buffer.push_back('\n');
+    }
+    input_buffer.append(buffer, len);
+    size_t start = 0, end;
+    while ((end = input_buffer.find('\n', start)) != std::string::npos) {
+        std::string line = input_buffer.substr(start, end - start);
+        start = end + 1;
+        try {
+            handle_user_command(line, remote_address);
+        }
+        catch (std::exception &e) {
+            std::cerr << "Error occured: " << e.what() << "\n";
+        }
+    }
+    input_buffer.erase(0, start);
+}
+
 void init(int argc, char **argv) {
     namespace po = boost::program_options;
     po::options_description desc(argv[0] + std::string(" flags"));
@@ -516,7 +1656,22 @@ void init(int argc, char **argv) {
                                      po::value<int32_t>(&cmd_port)->required(),
                                      "CMD_PORT (range [1, 65535]")(
         ",o", po::value<std::string>(&out_fldr)->required(), "OUT_FLDR")(
-        ",t", po::value<int32_t>(&timeout), "TIMEOUT (range [1, 300])");
+        ",t", po::value<int32_t>(&timeout), "TIMEOUT (range [1, 300])")(
+        ",s", po::bool_switch(&swarm_mode),
+        "fetch files in chunks from all servers that have them")(
+        ",c", po::value<int32_t>(&cache_ttl),
+        "CACHE_TTL (seconds between refreshes of servers known to upload, "
+        "default 30)")(
+        ",k", po::value<int32_t>(&add_fanout),
+        "FANOUT (servers asked to take an upload at once, default 1)")(
+        ",j", po::value<int32_t>(&upload_limit),
+        "UPLOADS (files of upload-dir sent at once, default 8)")(
+        ",S", po::bool_switch(&session_mode),
+        "send transfers through data sessions, if servers have data ports")(
+        ",i", po::bool_switch(&inline_mode),
+        "fetch and upload files that fit in one datagram inside it")(
+        ",u", po::bool_switch(&ring_mode),
+        "move data of fetched and uploaded files with io_uring");
 
     try {
         parse_args(argc, argv, desc);
@@ -551,6 +1706,16 @@ void init(int argc, char **argv) {
         fds.push_back({main_socket, POLLIN, 0});
 
         fds.push_back({STDIN_FILENO, POLLIN, 0});
+
+        if (ring_mode) {
+            try {
+                ring.reset(new Ring(RING_ENTRIES));
+            }
+            catch (std::exception &e) {
+                std::cerr << e.what() << ", transfers use poll\n";
+            }
+        }
+        fds.push_back({ring ? ring->fd() : -1, POLLIN, 0});
     }
     catch (po::error &e) {
         std::cerr << "INCORRECT USAGE\n" << e.what() << "\n" << desc;
@@ -558,11 +1723,133 @@ void init(int argc, char **argv) {
     }
 }
 
+// token fits in the send buffer of a fresh socket, so it's sent at once
+void send_token(int i) {
+    ConnectionInfo &info = connections[i - 4];
+    uint64_t token = htobe64(info.token);
+    if (write(info.sock_fd, &token, sizeof(token)) != sizeof(token)) {
+        if (sock_to_chunk.count(info.sock_fd) > 0 || info.fd < 0) {
+            remove_connection(i);
+            return;
+        }
+        std::cout << "File " << info.filename
+                  << (info.writing ? " downloading" : " uploading")
+                  << " failed (" << info.ip << ":" << info.port
+                  << ") Sending transfer token failed\n";
+        remove_connection(i);
+        return;
+    }
+    info.token = 0;
+    if (info.writing) {
+        fds[i].events = POLLIN;
+    }
+}
+
+// the server closed the connection, so the whole file is here, unless it
+// was resumed and the .part file is still short of the size of the file,
+// then the .part file is kept for the next attempt
+void finish_download(int i) {
+    ConnectionInfo &info = connections[i - 4];
+    std::string path = out_fldr + "/" + info.filename;
+    auto expected = download_sizes.find(info.sock_fd);
+    struct stat statbuf;
+    if (expected != download_sizes.end() &&
+        (fstat(info.fd, &statbuf) < 0 ||
+         (uint64_t)statbuf.st_size != expected->second)) {
+        std::cout << "File " << info.filename << " downloading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Connection closed before the end of the file\n";
+    }
+    else if (rename((path + PART_SUFFIX).c_str(), path.c_str()) < 0) {
+        std::cout << "File " << info.filename << " downloading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Rename of downloaded file failed with \""
+                  << strerror(errno) << "\" error\n";
+    }
+    else {
+        std::cout << "File " << info.filename << " downloaded (" << info.ip
+                  << ":" << info.port << ")\n";
+    }
+    remove_connection(i);
+}
+
+void finish_ring_transfer(int i, const RingTransfer &transfer,
+                          RingTransfer::Status status) {
+    ConnectionInfo &info = connections[i - 4];
+    if (status == RingTransfer::Status::FAILED) {
+        std::cout << "File " << info.filename
+                  << (info.writing ? " downloading" : " uploading")
+                  << " failed (" << info.ip << ":" << info.port
+                  << ") Transfer failed with \"" << strerror(transfer.error)
+                  << "\" error\n";
+        remove_connection(i);
+    }
+    else if (info.writing) {
+        finish_download(i);
+    }
+    else {
+        std::cout << "File " << info.filename << " uploaded (" << info.ip
+                  << ":" << info.port << ")\n";
+        remove_connection(i);
+    }
+}
+
+// the ring moves the whole file, the socket is not polled until it's done,
+// here writing means that the file is written, so it's received
+void start_ring_transfer(int i) {
+    ConnectionInfo &info = connections[i - 4];
+    fds[i].events = 0;
+    info.release_buffer();
+    std::unique_ptr<RingTransfer> transfer(new RingTransfer(
+        info.sock_fd, info.fd, !info.writing, info.remaining));
+    transfer->key = info.sock_fd;
+    RingTransfer::Status status = transfer->start(*ring);
+    if (status == RingTransfer::Status::RUNNING) {
+        ring_transfers[info.sock_fd] = std::move(transfer);
+        return;
+    }
+    finish_ring_transfer(i, *transfer, status);
+}
+
+// takes completions of ring transfers, a finished transfer reports its
+// file as the poll path would
+void handle_ring() {
+    uint64_t now = monotonic_ms();
+    ring->reap([now](uint64_t user_data, int res) {
+        RingTransfer *transfer = RingTransfer::owner(user_data);
+        RingTransfer::Status status = transfer->complete(*ring, user_data,
+                                                         res);
+        if (transfer->abandoned()) {
+            if (status != RingTransfer::Status::RUNNING) {
+                delete transfer;
+            }
+            return;
+        }
+        size_t i = 4;
+        while (i < fds.size() && fds[i].fd != (int)transfer->key) {
+            ++i;
+        }
+        connections[i - 4].start = now;
+        if (status == RingTransfer::Status::RUNNING) {
+            return;
+        }
+        std::unique_ptr<RingTransfer> finished =
+            std::move(ring_transfers[transfer->key]);
+        ring_transfers.erase(transfer->key);
+        finish_ring_transfer(i, *finished, status);
+    });
+}
+
 void write_to_fd(int i) {
-    ConnectionInfo &info = connections[i - 3];
+    ConnectionInfo &info = connections[i - 4];
+    if (ring) {
+        start_ring_transfer(i);
+        return;
+    }
     int len;
+    info.attach_buffer();
     if (info.position == info.buf_size) {
-        info.buf_size = read(info.fd, info.buffer, sizeof(info.buffer));
+        info.buf_size = read(info.fd, info.buffer, BUFFER_SIZE);
         if (info.buf_size < 0) {
             std::cout << "File " << info.filename << " uploading failed ("
                       << info.ip << ":" << info.port
@@ -590,12 +1877,44 @@ void write_to_fd(int i) {
         return;
     }
     info.position += len;
+    if (info.position == info.buf_size) {
+        info.release_buffer();
+    }
+}
+
+// chunk ends when the server closes the connection, errors are reported
+// for the whole swarm download, not for single chunks
+void read_chunk(int i, ChunkTransfer &transfer) {
+    ConnectionInfo &info = connections[i - 4];
+    info.attach_buffer();
+    int len = read(info.sock_fd, info.buffer, BUFFER_SIZE);
+    if (len == 0) {
+        transfer.complete = transfer.received == transfer.expected;
+    }
+    if (len <= 0 || transfer.received + len > transfer.expected ||
+        pwrite(info.fd, info.buffer, len,
+               transfer.chunk * SWARM_CHUNK + transfer.received) != len) {
+        remove_connection(i);
+        return;
+    }
+    transfer.received += len;
+    info.release_buffer();
 }
 
 void read_from_fd(int i) {
-    ConnectionInfo &info = connections[i - 3];
+    ConnectionInfo &info = connections[i - 4];
+    auto chunk = sock_to_chunk.find(info.sock_fd);
+    if (chunk != sock_to_chunk.end()) {
+        read_chunk(i, chunk->second);
+        return;
+    }
+    if (ring) {
+        start_ring_transfer(i);
+        return;
+    }
     int len;
-    len = read(info.sock_fd, info.buffer, sizeof(info.buffer));
+    info.attach_buffer();
+    len = read(info.sock_fd, info.buffer, BUFFER_SIZE);
     if (len < 0) {
         std::cout << "File " << info.filename << " downloading failed ("
                   << info.ip << ":" << info.port
@@ -605,9 +1924,7 @@ void read_from_fd(int i) {
         return;
     }
     if (len == 0) {
-        std::cout << "File " << info.filename << " downloaded (" << info.ip
-                  << ":" << info.port << ")\n";
-        remove_connection(i);
+        finish_download(i);
         return;
     }
     len = write(info.fd, info.buffer, len);
@@ -619,6 +1936,140 @@ void read_from_fd(int i) {
         remove_connection(i);
         return;
     }
+    info.release_buffer();
+}
+
+// the token is sent first, then requests and replies flow both ways
+void handle_session(int i) {
+    int sock = fds[i].fd;
+    short revents = fds[i].revents;
+    fds[i].revents = 0;
+    connections[i - 4].start = monotonic_ms();
+    if (revents & (POLLIN | POLLHUP | POLLERR)) {
+        read_session(i);
+        if (i >= (int)fds.size() || fds[i].fd != sock) {
+            return;
+        }
+    }
+    if (revents & POLLOUT) {
+        if (connections[i - 4].token != 0) {
+            send_token(i);
+            if (i >= (int)fds.size() || fds[i].fd != sock) {
+                return;
+            }
+        }
+        write_session(i);
+    }
+}
+
+void expire_connection(uint64_t sock_fd) {
+    size_t i = 4;
+    while (i < fds.size() && fds[i].fd != (int)sock_fd) {
+        ++i;
+    }
+    if (i == fds.size()) {
+        return;
+    }
+    ConnectionInfo &info = connections[i - 4];
+    info.timer = NO_TIMER;
+    uint64_t deadline = info.start + timeout * 1000;
+    if (monotonic_ms() < deadline) {
+        info.timer = connection_timers.schedule(deadline, sock_fd);
+        return;
+    }
+    if (sock_to_chunk.count((int)sock_fd) > 0 ||
+        info.phase != SessionPhase::NONE) {
+        // swarm download reports it, and so does data session
+    }
+    else if (info.writing) {
+        // timeout on fetching file
+        std::cout << "File " << info.filename << " downloading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Timeout waiting for server to send data\n";
+    }
+    else {
+        // timeut on uploading file
+        std::cout << "File " << info.filename << " uploading failed ("
+                  << info.ip << ":" << info.port
+                  << ") Timeout waiting for server to receive data\n";
+    }
+    remove_connection(i);
+}
+
+// request is either ADD, chunk request, discover, search, pseudo-discover or
+// GET_INLINE
+void expire_request(uint64_t seq) {
+    if (user_discover_running && seq == user_discover_seq) {
+        user_discover_running = false;
+        return;
+    }
+    if (search_running && seq == search_seq) {
+        search_running = false;
+        return;
+    }
+    auto chunk = seq_to_chunk.find(seq);
+    if (chunk != seq_to_chunk.end()) {
+        ChunkTransfer transfer = chunk->second;
+        seq_to_chunk.erase(chunk);
+        seq_to_timer.erase(seq);
+        auto conn = seq_to_conn.find(seq);
+        if (conn != seq_to_conn.end()) {
+            close(conn->second.fd);
+            seq_to_conn.erase(conn);
+        }
+        finish_chunk(transfer);
+        return;
+    }
+    if (seq == cache_refresh_seq) {
+        start_pseudo_discover(main_socket);
+        return;
+    }
+    if (discover_running && seq == discover_seq) {
+        sort_by_free_space(discovered_servers);
+        server_cache.swap(discovered_servers);
+        server_cache_time = monotonic_ms();
+        // a pseudo-discover started by upload also counts as a refresh
+        request_timers.cancel(cache_refresh_timer);
+        cache_refresh_timer = request_timers.schedule(
+            server_cache_time + cache_ttl * 1000, cache_refresh_seq);
+
+        for (const auto &filename : files_to_upload) {
+            upload(main_socket, server_cache, filename);
+        }
+        files_to_upload.clear();
+        for (const auto &batch : batches_to_upload) {
+            pack_batch(batch, server_cache, false);
+        }
+        batches_to_upload.clear();
+        discover_running = false;
+        discovered_servers.clear();
+        return;
+    }
+    auto timer_it = seq_to_timer.find(seq);
+    if (timer_it == seq_to_timer.end() || resend_inline(seq)) {
+        return;
+    }
+    seq_to_timer.erase(timer_it);
+    auto conn = seq_to_conn.find(seq);
+    if (conn != seq_to_conn.end()) {
+        // GET_INLINE was never answered
+        char address[INET_ADDRSTRLEN];
+        const struct sockaddr_in &addr = inline_requests[seq].addr;
+        if (inet_ntop(AF_INET, (void *)(&addr.sin_addr), address,
+                      sizeof(address)) == NULL) {
+            throw std::logic_error("inet_ntop failed unexpectedly");
+        }
+        std::cout << "File " << conn->second.filename
+                  << " downloading failed (" << address << ":"
+                  << ntohs(addr.sin_port)
+                  << ") Timeout waiting for server to answer\n";
+        close(conn->second.fd);
+        seq_to_conn.erase(conn);
+        finish_inline(seq);
+        return;
+    }
+    // timeout after ADD is handled as if the server answered NO_WAY
+    handle_no_way(seq);
 }
 
 int main(int argc, char **argv) {
@@ -628,65 +2079,16 @@ int main(int argc, char **argv) {
 
     struct sockaddr_in remote_address =
         get_remote_address(mcast_addr, cmd_port);
+    // the cache is filled at start, so that the first upload need not wait
+    cache_refresh_seq = get_cmd_seq();
+    start_pseudo_discover(main_socket);
 
-    int timeout_millis =
-        compute_timeout(connections, seq_to_starttime, timeout);
+    int timeout_millis = -1;
     while (true) {
         int ready = poll(fds.data(), fds.size(), timeout_millis);
-        auto now = boost::posix_time::microsec_clock::local_time();
-        for (size_t i = fds.size() - 1; i >= 3; --i) {
-            auto info = connections[i - 3];
-            auto duration = now - connections[i - 3].start;
-            if (duration.total_milliseconds() / 1000 > timeout) {
-                ConnectionInfo &info = connections[i - 3];
-                if (fds[i].events & POLLIN) {
-                    // timeout on fetching file
-                    std::cout << "File " << info.filename
-                              << " downloading failed (" << info.ip << ":"
-                              << info.port
-                              << ") Timeout waiting for server to send data\n";
-                }
-                else {
-                    // timeut on uploading file
-                    std::cout
-                        << "File " << info.filename << " uploading failed ("
-                        << info.ip << ":" << info.port
-                        << ") Timeout waiting for server to receive data\n";
-                }
-                remove_connection(i);
-            }
-        }
-        for (auto start = seq_to_starttime.begin();
-             start != seq_to_starttime.end();) {
-            auto duration = now - start->second;
-            if (duration.total_milliseconds() / 1000 > timeout) {
-                // this invalidates iterator of the loop, so we need to
-                // manually handle iterators
-                start = handle_no_way(start->first);
-            }
-            else {
-                start++;
-            }
-        }
-        if (!discover_start.is_not_a_date_time()) {
-            auto duration = now - discover_start;
-            if (duration.total_milliseconds() / 1000 > timeout) {
-                std::sort(discovered_servers.begin(), discovered_servers.end(),
-                          [](const std::tuple<struct sockaddr_in, std::string,
-                                              uint64_t> &a,
-                             const std::tuple<struct sockaddr_in, std::string,
-                                              uint64_t> &b) {
-                              return std::get<2>(a) < std::get<2>(b);
-                          });
-
-                for (const auto &filename : files_to_upload) {
-                    upload(main_socket, discovered_servers, filename);
-                }
-                files_to_upload.clear();
-                discover_start = boost::posix_time::ptime();
-                discovered_servers.clear();
-            }
-        }
+        uint64_t now = monotonic_ms();
+        connection_timers.advance(now, expire_connection);
+        request_timers.advance(now, expire_request);
         if (ready <= 0) {
             // timeout
             continue;
@@ -701,35 +2103,59 @@ int main(int argc, char **argv) {
             if (fds[2].revents & POLLIN) {
                 handle_user_input(remote_address);
             }
+            if (fds[3].revents & POLLIN) {
+                handle_ring();
+            }
         }
         catch (std::exception &e) {
             std::cerr << "Error occured: " << e.what() << "\n";
         }
-        for (size_t i = 3; i < fds.size(); ++i) {
+        for (size_t i = 4; i < fds.size(); ++i) {
             try {
+                if (connections[i - 4].phase != SessionPhase::NONE) {
+                    handle_session(i);
+                    continue;
+                }
                 if (fds[i].revents & POLLIN) {
-                    connections[i - 3].start = now;
+                    connections[i - 4].start = monotonic_ms();
                     fds[i].revents = 0;
                     read_from_fd(i);
                 }
                 if (fds[i].revents & POLLOUT) {
-                    connections[i - 3].start = now;
+                    connections[i - 4].start = monotonic_ms();
                     fds[i].revents = 0;
-                    write_to_fd(i);
+                    if (connections[i - 4].token != 0) {
+                        send_token(i);
+                    }
+                    else if (connections[i - 4].fd < 0) {
+                        // released upload, closing it is all that's needed
+                        remove_connection(i);
+                    }
+                    else {
+                        write_to_fd(i);
+                    }
                 }
             }
             catch (std::exception &e) {
                 std::cerr << "Error occured: " << e.what() << "\n";
             }
         }
-        timeout_millis =
-            compute_timeout(connections, seq_to_starttime, timeout);
-        if (!discover_start.is_not_a_date_time()) {
-            auto duration = now - discover_start;
-            int new_timeout = timeout * 1000 - duration.total_milliseconds();
-            if (timeout_millis == -1 || timeout_millis < new_timeout) {
-                timeout_millis = new_timeout;
-            }
+        // chains queued by this round go to the kernel in one call
+        if (ring) {
+            ring->submit();
+        }
+        try {
+            start_queued_uploads();
+        }
+        catch (std::exception &e) {
+            std::cerr << "Error occured: " << e.what() << "\n";
+        }
+        now = monotonic_ms();
+        timeout_millis = connection_timers.next_timeout(now);
+        int request_millis = request_timers.next_timeout(now);
+        if (timeout_millis == -1 ||
+            (request_millis != -1 && request_millis < timeout_millis)) {
+            timeout_millis = request_millis;
         }
     }
 }
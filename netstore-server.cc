@@ -1,70 +1,448 @@
+#include <algorithm>
 #include <arpa/inet.h>
+#include <atomic>
 #include <boost/filesystem.hpp>
 #include <boost/program_options.hpp>
+#include <deque>
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iostream>
 #include <map>
+#include <mutex>
 #include <netinet/in.h>
-#include <poll.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <shared_mutex>
 #include <string>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "catalog.h"
 #include "helper.h"
+#include "manifest.h"
+#include "metrics.h"
+#include "queue.h"
+#include "uring.h"
 
 const int64_t MAX_SPACE_DEFAULT = 52428800;
+const int MAX_EVENTS = 64;
+// epoll data of descriptors that are not connections, every connection socket
+// has index of its slot as epoll data instead, and every reader of metrics
+// its socket
+const uint64_t SIGNAL_TAG = UINT64_MAX;
+const uint64_t CMD_SOCK_TAG = UINT64_MAX - 1;
+const uint64_t DATA_SOCK_TAG = UINT64_MAX - 2;
+const uint64_t QUEUE_TAG = UINT64_MAX - 3;
+const uint64_t RING_TAG = UINT64_MAX - 4;
+const uint64_t INOTIFY_TAG = UINT64_MAX - 5;
+const uint64_t METRICS_TAG = UINT64_MAX - 6;
+// how much sendfile is asked to send in one call
+const size_t SENDFILE_CHUNK = 1 << 20;
+// requested capacity of pipes used for splicing uploads to disk
+const int PIPE_SIZE = 1 << 20;
+
+// how many datagrams are received with one recvmmsg
+const size_t RECV_BATCH = 32;
+// replies are flushed when this many are waiting
+const size_t SEND_BATCH = 64;
+// requested receive buffer of the udp socket
+const int CMD_SOCK_RCVBUF = 4 << 20;
+// how many different LIST needles have their replies cached
+const size_t LIST_CACHE_SIZE = 16;
+// transfers that can wait for a worker to take them
+const size_t HANDOFF_QUEUE_SIZE = 1024;
+// submission queue entries of the io_uring of a worker
+const unsigned RING_ENTRIES = 1024;
+// readers of metrics that are still sent to, others are turned away
+const size_t METRICS_READERS_MAX = 64;
+// changes of the folder are applied once it's quiet for this long, but
+// not later than FOLDER_DELAY_MAX_MS after the first one, so that a bulk
+// copy is applied in a few batches and not file by file
+const uint64_t FOLDER_QUIET_MS = 100;
+const uint64_t FOLDER_DELAY_MAX_MS = 1000;
+// names stated in one go, the control thread answers commands in between
+const size_t FOLDER_BATCH = 1024;
+
+const std::string TRANSFER_COPY = "copy";
+const std::string TRANSFER_ZERO_COPY = "zerocopy";
+const std::string TRANSFER_URING = "uring";
 
 std::string mcast_addr, shrd_fldr;
 int32_t cmd_port, timeout = TIMEOUT_DEFAULT;
 int64_t max_space = MAX_SPACE_DEFAULT;
+// 0 until parsed means one worker per core
+int32_t worker_count = 0;
+std::string transfer_mode = TRANSFER_ZERO_COPY;
+// 0 means that every transfer listens on its own port
+int32_t data_port = 0;
+// whether files that fit in a datagram are sent and taken inline
+bool inline_mode = false;
+// empty means that the folder is scanned on every start
+std::string manifest_path;
+// unix socket that gives metrics to everyone who connects, empty if none
+std::string metrics_path;
+
+// the catalog is shared by the control thread and the workers, free space
+// changes only together with it, under exclusive lock, so that checking
+// and reserving space for an upload is one step; HELLO reads free space
+// without the lock
+Catalog files;
+std::shared_mutex files_mutex;
+std::atomic<int64_t> free_space;
+// changes of the catalog are appended to it under the same lock, nullptr
+// if there is no manifest
+std::unique_ptr<Manifest> manifest;
+// files in UPLOADING state, the folder matches the manifest only when
+// there are none
+size_t uploads_in_progress = 0;
+
+// changes made to the folder outside the server, -1 if it can't be watched
+int inotify_fd = -1;
+// whether the control thread knows of changes not applied to the catalog
+// yet, set before their events are read, so that together with events
+// still queued it says whether the catalog matches the folder
+std::atomic<bool> folder_dirty{false};
+// only the control thread uses these, names are mapped to all inotify
+// events that came for them since the last batch
+std::unordered_map<std::string, uint32_t> changed_names;
+// events were lost, the whole folder has to be compared with the catalog
+bool folder_overflowed = false;
+uint64_t first_change = 0;
+uint64_t folder_deadline = NO_TIMER;
+
+// packed MY_LIST replies for one needle, valid while catalog version matches
+class ListCacheEntry {
+  public:
+    std::string needle;
+    uint64_t version;
+    uint64_t last_used;
+    std::vector<std::string> packets;
+};
+
+std::vector<ListCacheEntry> list_cache;
+uint64_t list_cache_clock = 0;
+
+// every thread has its own epoll, the control thread watches signal_fd,
+// cmd_sock and data_sock, workers watch their connections
+thread_local int epoll_fd;
+int signal_fd;
+// udp socket for most of communications
+int cmd_sock;
+// listening unix socket of metrics_path, -1 if there is none
+int metrics_sock = -1;
+// metrics not yet taken by slow readers, keyed by socket
+std::map<int, std::string> metrics_readers;
+// replies to commands, they are sent after a batch of commands is handled
+SendBatch replies;
+// listening socket shared by all transfers, -1 if data_port is not set
+int data_sock = -1;
+
+// slot table of connections of the worker, free slots have negative
+// sock_fd; deque does not move existing slots when it grows
+thread_local std::deque<ConnectionInfo> connections;
+thread_local std::vector<size_t> free_slots;
+// slots freed while handling current batch of events, they become reusable
+// only after the batch, so that no stale event can hit a reused slot
+thread_local std::vector<size_t> released_slots;
+// timeouts of connections of the worker, keyed by slot
+thread_local TimerWheel timers(monotonic_ms());
 
-std::vector<std::string> files;
+// transfer thread with its own event loop, the control thread gives it new
+// connections through queue and wakes it with event_fd
+class Worker {
+  public:
+    Worker() : queue(HANDOFF_QUEUE_SIZE) {
+    }
+
+    std::thread thread;
+    int epoll_fd;
+    int event_fd;
+    SpscQueue<ConnectionInfo> queue;
+    // connections the worker has or is about to get
+    std::atomic<size_t> load{0};
+    // nullptr unless transfer mode is uring
+    std::unique_ptr<Ring> ring;
+};
 
-// 0 is signalfd
-// 1 is udp socket for most of communications
-// 2+ are sockets for connections with specific clients
-std::vector<struct pollfd> fds;
-std::vector<ConnectionInfo> connections;
+std::vector<std::unique_ptr<Worker>> workers;
+// worker running in this thread, nullptr in the control thread
+thread_local Worker *worker = nullptr;
+// ring of the worker, nullptr if transfers go through epoll
+thread_local Ring *ring = nullptr;
+// transfers moved by the ring, keyed by slot, a connection is here only
+// while operations of its transfer are in flight
+thread_local std::unordered_map<size_t, std::unique_ptr<RingTransfer>>
+    ring_transfers;
 
-// from filename to size (for files that are being read from socket)
-std::map<std::string, uint64_t> filename_to_size;
+// transfers waiting for a connection with their token on data_sock, they
+// have no socket yet, they're added by the control thread and taken by
+// workers
+std::unordered_map<uint64_t, ConnectionInfo> pending_transfers;
+std::mutex transfers_mutex;
+// timeouts of pending transfers, keyed by token, only the control thread
+// uses them, a taken transfer is just not found when its timer expires
+TimerWheel transfer_timers(monotonic_ms());
+// cmd_seq of files stored from ADD_INLINE, a repeated one is acknowledged
+// again, they're forgotten after timeout, when the client gave up resending
+std::unordered_set<uint64_t> inline_adds;
+TimerWheel inline_add_timers(monotonic_ms());
 
-void remove_connection(int i) {
-    close(connections[i - 2].fd);
-    close(connections[i - 2].sock_fd);
-    connections.erase(connections.begin() + i - 2);
-    fds.erase(fds.begin() + i);
+void watch_connection(size_t slot, uint32_t events) {
+    struct epoll_event event;
+    event.events = events | EPOLLET;
+    event.data.u64 = slot;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connections[slot].sock_fd,
+                  &event) < 0) {
+        throw std::logic_error(std::string("Failed to add socket to epoll ") +
+                               strerror(errno));
+    }
 }
 
-void handle_read_from_socket_fail(const std::string &filename) {
-    max_space += filename_to_size[filename];
-    filename_to_size.erase(filename);
-    for (auto it = files.begin(); it != files.end(); ++it) {
-        if (*it == filename) {
-            files.erase(it);
-            break;
+// sock_fd is a listening socket, the connection is watched until it's
+// accepted, returns slot of the connection
+size_t add_connection(int sock_fd, int fd, const std::string &filename,
+                      bool writing, const std::string &ip, uint16_t port) {
+    size_t slot;
+    if (free_slots.empty()) {
+        slot = connections.size();
+        connections.emplace_back();
+    }
+    else {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    }
+    ConnectionInfo &info = connections[slot];
+    info.start = monotonic_ms();
+    info.timer = timers.schedule(info.start + timeout * 1000, slot);
+    info.sock_fd = sock_fd;
+    info.fd = fd;
+    info.filename = filename;
+    info.was_accepted = false;
+    info.writing = writing;
+    info.position = 0;
+    info.buf_size = 0;
+    info.ip = ip;
+    info.port = port;
+    info.zero_copy = transfer_mode == TRANSFER_ZERO_COPY;
+    info.pipe_fds[0] = -1;
+    info.pipe_fds[1] = -1;
+    info.token = 0;
+    info.remaining = UINT64_MAX;
+    info.phase = SessionPhase::NONE;
+    info.cmd_seq = 0;
+    info.began = 0;
+    try {
+        watch_connection(slot, EPOLLIN);
+    }
+    catch (std::exception &e) {
+        timers.cancel(info.timer);
+        info.timer = NO_TIMER;
+        info.sock_fd = -1;
+        free_slots.push_back(slot);
+        throw;
+    }
+    return slot;
+}
+
+// the transfer waits in pending_transfers until a connection with the
+// returned token arrives on data_sock, remaining is as in ConnectionInfo
+uint64_t add_pending_transfer(int fd, const std::string &filename,
+                              bool writing, uint64_t remaining) {
+    std::lock_guard<std::mutex> lock(transfers_mutex);
+    uint64_t token;
+    do {
+        token = get_cmd_seq();
+    } while (token == 0 || token == SESSION_TOKEN ||
+             pending_transfers.count(token) > 0);
+    ConnectionInfo &info = pending_transfers[token];
+    info = ConnectionInfo(monotonic_ms(), -1, fd, filename, false, writing,
+                          "", 0);
+    info.zero_copy = transfer_mode == TRANSFER_ZERO_COPY;
+    info.remaining = remaining;
+    info.timer = transfer_timers.schedule(info.start + timeout * 1000, token);
+    return token;
+}
+
+// connection goes to the worker with the fewest connections, returns false
+// if even its queue is full, info is left untouched then
+bool hand_off(ConnectionInfo &&info) {
+    Worker *target = workers[0].get();
+    for (const auto &candidate : workers) {
+        if (candidate->load.load(std::memory_order_relaxed) <
+            target->load.load(std::memory_order_relaxed)) {
+            target = candidate.get();
         }
     }
+    // counted first, the worker may be done with it before push returns
+    ++target->load;
+    if (!target->queue.push(std::move(info))) {
+        --target->load;
+        return false;
+    }
+    uint64_t one = 1;
+    if (write(target->event_fd, &one, sizeof(one)) < 0) {
+        std::cerr << "Error occured: Failed to wake worker "
+                  << strerror(errno) << "\n";
+    }
+    return true;
+}
+
+// transfer of the connection is over, whether it finished or failed
+void end_transfer(ConnectionInfo &info) {
+    if (info.began != 0) {
+        metrics_record(Histogram::TRANSFER_DURATION,
+                       monotonic_us() - info.began);
+        info.began = 0;
+    }
+}
+
+void remove_connection(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    end_transfer(info);
+    auto transfer = ring_transfers.find(slot);
+    if (transfer != ring_transfers.end()) {
+        // operations in flight still use both descriptors, the transfer
+        // closes them when they're over, the socket leaves epoll now,
+        // because the slot may be reused before that
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, info.sock_fd, NULL);
+        transfer->second.release()->abandon();
+        ring_transfers.erase(transfer);
+        info.fd = -1;
+        info.sock_fd = -1;
+    }
+    // closing the socket removes it from epoll as well
+    close(info.fd);
+    close(info.sock_fd);
+    info.release_buffer();
+    timers.cancel(info.timer);
+    info.timer = NO_TIMER;
+    if (info.pipe_fds[0] >= 0) {
+        close(info.pipe_fds[0]);
+        close(info.pipe_fds[1]);
+        info.pipe_fds[0] = -1;
+        info.pipe_fds[1] = -1;
+    }
+    info.sock_fd = -1;
+    info.fd = -1;
+    info.filename.clear();
+    released_slots.push_back(slot);
+    --worker->load;
+}
+
+// whether the folder has changes that the catalog does not show yet
+bool folder_changes_pending() {
+    int queued = 0;
+    return folder_dirty ||
+           (inotify_fd >= 0 && ioctl(inotify_fd, FIONREAD, &queued) == 0 &&
+            queued > 0);
+}
+
+// files_mutex has to be held exclusively
+void sync_manifest() {
+    if (manifest != nullptr && uploads_in_progress == 0 &&
+        !folder_changes_pending()) {
+        manifest->sync();
+    }
+}
+
+// files_mutex has to be held exclusively, the partial file is removed too,
+// otherwise it would be shared again after a restart
+void drop_upload(const std::string &filename) {
+    const CatalogEntry *entry = files.find(filename);
+    if (entry != nullptr && entry->state == FileState::UPLOADING) {
+        free_space += entry->size;
+        files.erase(filename);
+        unlink(std::string(shrd_fldr + "/" + filename).c_str());
+        --uploads_in_progress;
+        sync_manifest();
+    }
+}
+
+void handle_read_from_socket_fail(const std::string &filename) {
+    std::unique_lock<std::shared_mutex> lock(files_mutex);
+    drop_upload(filename);
+}
+
+// fd is the file being written, a client that closes the connection before
+// sending the announced size gave up on the upload
+void handle_upload_finished(const std::string &filename, int fd) {
+    off_t received = lseek(fd, 0, SEEK_CUR);
+    std::unique_lock<std::shared_mutex> lock(files_mutex);
+    CatalogEntry *entry = files.find(filename);
+    if (entry == nullptr) {
+        return;
+    }
+    if (received >= 0 && (uint64_t)received < entry->size) {
+        drop_upload(filename);
+        return;
+    }
+    entry->state = FileState::COMPLETE;
+    --uploads_in_progress;
+    struct stat st;
+    if (manifest != nullptr && fstat(fd, &st) == 0) {
+        manifest->added(filename, st.st_size,
+                        st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+        sync_manifest();
+    }
+}
+
+// checks whether the file can be taken and reserves space for it at once,
+// the file is UPLOADING in the catalog from now on
+bool reserve_upload(std::string_view name, uint64_t size) {
+    if (name.empty() || name.find('/') != std::string::npos) {
+        return false;
+    }
+    std::unique_lock<std::shared_mutex> lock(files_mutex);
+    // free_space goes below zero when files are copied into the folder
+    int64_t space = free_space.load();
+    if (space < 0 || size > (uint64_t)space || files.find(name) != nullptr) {
+        return false;
+    }
+    free_space -= size;
+    files.insert(name, size, FileState::UPLOADING);
+    ++uploads_in_progress;
+    return true;
 }
 
+// connections of workers are closed by _exit
 void handle_interrupt() {
-    close(fds[0].fd);
-    close(fds[1].fd);
-    for (const auto &conn : connections) {
-        close(conn.fd);
-        close(conn.sock_fd);
+    close(epoll_fd);
+    close(signal_fd);
+    close(cmd_sock);
+    if (data_sock >= 0) {
+        close(data_sock);
+    }
+    if (metrics_sock >= 0) {
+        close(metrics_sock);
+        unlink(metrics_path.c_str());
+    }
+    for (const auto &reader : metrics_readers) {
+        close(reader.first);
+    }
+    std::lock_guard<std::mutex> lock(transfers_mutex);
+    for (const auto &transfer : pending_transfers) {
+        close(transfer.second.fd);
     }
 
-    // free the memory
-    files.clear();
-    fds.clear();
-    connections.clear();
-    exit(EXIT_INTERRUPT);
+    std::unique_lock<std::shared_mutex> files_lock(files_mutex);
+    sync_manifest();
+    // workers are still running, destructors of globals must not run under
+    // them, the kernel frees everything anyway
+    _exit(EXIT_INTERRUPT);
 }
 
 void parse_args(int argc, char **argv,
@@ -86,22 +464,51 @@ void parse_args(int argc, char **argv,
         throw po::validation_error(po::validation_error::invalid_option_value,
                                    "b", std::to_string(max_space));
     }
-}
-
-// returns list of files in shrd_fldr, without prefix (only filenames)
-std::vector<std::string> list_files() {
+    if (transfer_mode != TRANSFER_COPY &&
+        transfer_mode != TRANSFER_ZERO_COPY &&
+        transfer_mode != TRANSFER_URING) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "m", transfer_mode);
+    }
+    if (vm.count("-d") && (data_port <= 0 || data_port > PORT_MAX)) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "d", std::to_string(data_port));
+    }
+    if (vm.count("-w") && worker_count <= 0) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "w", std::to_string(worker_count));
+    }
+    if (worker_count == 0) {
+        worker_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    // it would be shared, and every append would change the folder
     namespace fs = boost::filesystem;
-    std::vector<std::string> result;
-    fs::path p(shrd_fldr);
-    fs::directory_iterator end_it;
+    if (!manifest_path.empty() &&
+        fs::weakly_canonical(manifest_path).parent_path() ==
+            fs::weakly_canonical(shrd_fldr)) {
+        throw po::validation_error(po::validation_error::invalid_option_value,
+                                   "M", manifest_path);
+    }
+}
 
-    for (fs::directory_iterator it(p); it != end_it; ++it) {
-        if (fs::is_regular_file(it->path())) {
-            result.push_back(it->path().filename().string());
-            max_space -= fs::file_size(it->path());
+// returns catalog of files in shrd_fldr, without prefix (only filenames),
+// the folder is scanned only if there is no manifest that still matches it
+Catalog list_files() {
+    Catalog result;
+    auto add = [&result](std::string_view name, uint64_t size) {
+        result.insert(name, size, FileState::COMPLETE);
+        free_space -= size;
+    };
+    if (manifest == nullptr || !manifest->load(add)) {
+        std::vector<FolderEntry> found = scan_folder(shrd_fldr);
+        for (const auto &file : found) {
+            add(file.name, file.size);
+        }
+        if (manifest != nullptr) {
+            manifest->rewrite(found);
         }
     }
-    if (max_space <= 0) {
+    if (free_space <= 0) {
         throw std::logic_error(
             "MAX_SPACE is smaller or equal to sum of sizes of files"
             " in shared_dir");
@@ -141,77 +548,362 @@ int connect_to_mcast(std::string mcast_addr, int32_t port) {
         throw std::logic_error("Failed to connect to multicast group");
     }
 
+    // bursts of commands are queued here while previous batch is handled,
+    // kernel caps it at rmem_max, which is fine too
+    int rcvbuf = CMD_SOCK_RCVBUF;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    return sock;
+}
+
+// returns nonblocking socket listening on given port (0 means any port),
+// port is set to the port it really listens on
+int open_listener(uint16_t &port, int backlog) {
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sock < 0) {
+        throw std::logic_error("Failed to create new socket");
+    }
+    int reuse = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    struct sockaddr_in local_address;
+    local_address.sin_family = AF_INET;
+    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+    local_address.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&local_address,
+             sizeof(local_address)) < 0) {
+        close(sock);
+        throw std::logic_error("Failed to bind new socket");
+    }
+    if (listen(sock, backlog) < 0) {
+        close(sock);
+        throw std::logic_error(
+            "Failed to switch to listening on a new socket");
+    }
+    socklen_t len = sizeof(local_address);
+    if (getsockname(sock, (sockaddr *)(&local_address), &len) < 0) {
+        close(sock);
+        throw std::logic_error("Failed to get port of the new socket");
+    }
+    port = ntohs(local_address.sin_port);
     return sock;
 }
 
-void reply_hello(int sock, const cmplx_cmd &cmd) {
+// files copied into the folder from outside may take more than MAX_SPACE
+uint64_t space_left() {
+    return std::max<int64_t>(free_space.load(), 0);
+}
+
+void reply_hello(SendBatch &replies, const cmd_view &cmd) {
     if (!cmd.data.empty()) {
+        metrics_add(Counter::MALFORMED);
         throw std::runtime_error("Data field not empty in HELLO");
     }
-    cmplx_cmd reply;
-    reply.cmd = GOOD_DAY;
-    reply.cmd_seq = cmd.cmd_seq;
-    reply.param = max_space;
-    reply.data = mcast_addr;
-    reply.addr = cmd.addr;
-    send_cmd(reply, sock);
+    // clients open data sessions on the shared data port
+    if (data_sock >= 0) {
+        replies.add(GOOD_DAY, cmd.cmd_seq, space_left(),
+                    append_number(mcast_addr, data_port), cmd.addr);
+        return;
+    }
+    replies.add(GOOD_DAY, cmd.cmd_seq, space_left(), mcast_addr, cmd.addr);
 }
 
-void reply_list(int sock, const cmplx_cmd &cmd,
-                const std::vector<std::string> &files) {
-    simpl_cmd reply;
-    reply.cmd = MY_LIST;
-    reply.cmd_seq = cmd.cmd_seq;
-    reply.addr = cmd.addr;
-    for (const auto &file : files) {
-        if (file.find(cmd.data) != std::string::npos) {
-            if (reply.data.size() + file.size() +
-                    (reply.data.empty() ? 0 : 1) >
-                DATA_MAX) {
-                send_cmd(reply, sock);
-                reply.data = "";
-            }
-            if (!reply.data.empty()) {
-                reply.data += "\n";
-            }
-            reply.data += file;
+std::vector<std::string> pack_list(std::string_view needle,
+                                   const Catalog &files) {
+    std::vector<std::string> packets;
+    std::string data;
+    auto pack_data = [&]() {
+        std::string packet(CMD_SIZE + sizeof(uint64_t) + data.size(), '\0');
+        pack_cmd(&packet[0], MY_LIST, 0, data);
+        packets.push_back(std::move(packet));
+    };
+    files.for_each_containing(needle, [&](const CatalogEntry &entry) {
+        std::string_view file = entry.name;
+        if (data.size() + file.size() + (data.empty() ? 0 : 1) > DATA_MAX) {
+            pack_data();
+            data = "";
+        }
+        if (!data.empty()) {
+            data += "\n";
+        }
+        data += file;
+    });
+    if (data.size() > 0) {
+        pack_data();
+    }
+    return packets;
+}
+
+// returns cached replies for needle, they are rebuilt if the catalog changed,
+// and the least recently used needle is evicted when the cache is full
+std::vector<std::string> &list_packets(std::string_view needle,
+                                       const Catalog &files) {
+    ListCacheEntry *entry = nullptr;
+    for (auto &cached : list_cache) {
+        if (cached.needle == needle) {
+            entry = &cached;
+            break;
         }
     }
-    if (reply.data.size() > 0) {
-        send_cmd(reply, sock);
+    if (entry == nullptr) {
+        if (list_cache.size() < LIST_CACHE_SIZE) {
+            list_cache.emplace_back();
+            entry = &list_cache.back();
+        }
+        else {
+            entry = &*std::min_element(
+                list_cache.begin(), list_cache.end(),
+                [](const ListCacheEntry &a, const ListCacheEntry &b) {
+                    return a.last_used < b.last_used;
+                });
+        }
+        entry->needle = needle;
+        entry->version = files.version() - 1;
+    }
+    if (entry->version != files.version()) {
+        entry->packets = pack_list(needle, files);
+        entry->version = files.version();
+    }
+    entry->last_used = ++list_cache_clock;
+    return entry->packets;
+}
+
+void reply_list(SendBatch &replies, const cmd_view &cmd,
+                const Catalog &files) {
+    std::shared_lock<std::shared_mutex> lock(files_mutex);
+    for (auto &packet : list_packets(cmd.data, files)) {
+        stamp_cmd_seq(&packet[0], cmd.cmd_seq);
+        replies.add(packet.data(), packet.size(), cmd.addr);
     }
 }
 
-void handle_del(const cmplx_cmd &cmd, std::vector<std::string> &files) {
+void handle_del(const cmd_view &cmd, Catalog &files) {
     namespace fs = boost::filesystem;
-    for (auto it = files.begin(); it != files.end(); ++it) {
-        if (*it == cmd.data) {
-            fs::path p(shrd_fldr + "/" + *it);
-            uint64_t change = fs::file_size(p);
-            if (!fs::remove(p)) {
-                std::cerr << "Failed to remove " << shrd_fldr + "/" + *it
-                          << "\n";
+    std::unique_lock<std::shared_mutex> lock(files_mutex);
+    const CatalogEntry *entry = files.find(cmd.data);
+    // files that are still being uploaded can't be removed
+    if (entry == nullptr || entry->state != FileState::COMPLETE) {
+        return;
+    }
+    std::string path = shrd_fldr + "/" + std::string(cmd.data);
+    fs::path p(path);
+    uint64_t change = fs::file_size(p);
+    if (!fs::remove(p)) {
+        std::cerr << "Failed to remove " << path << "\n";
+    }
+    else {
+        free_space += change;
+        files.erase(cmd.data);
+        if (manifest != nullptr) {
+            manifest->removed(cmd.data);
+            sync_manifest();
+        }
+    }
+}
+
+// reads events of inotify_fd, names are only collected, they're applied by
+// apply_folder_changes once the folder is quiet
+void handle_folder_events() {
+    folder_dirty = true;
+    alignas(struct inotify_event) char buffer[64 * 1024];
+    bool changed = false;
+    while (true) {
+        ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                std::cerr << "Error occured: Failed to read inotify "
+                          << strerror(errno) << "\n";
             }
-            else {
-                max_space += change;
-                files.erase(it);
+            break;
+        }
+        for (ssize_t i = 0; i < length;) {
+            const struct inotify_event *event =
+                (const struct inotify_event *)(buffer + i);
+            i += sizeof(struct inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                folder_overflowed = true;
+                changed = true;
+            }
+            else if (event->mask & IN_IGNORED) {
+                std::cerr << "Error occured: " << shrd_fldr
+                          << " is gone, its changes are not followed\n";
+            }
+            // subfolders are not shared
+            else if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+                changed_names[event->name] |= event->mask;
+                changed = true;
             }
+        }
+    }
+    if (!changed) {
+        folder_dirty = folder_deadline != NO_TIMER;
+        return;
+    }
+    uint64_t now = monotonic_ms();
+    if (first_change == 0) {
+        first_change = now;
+    }
+    folder_deadline = std::min(now + FOLDER_QUIET_MS,
+                               first_change + FOLDER_DELAY_MAX_MS);
+}
+
+// files_mutex has to be held exclusively, found is nullptr if the file is
+// gone, uploads of the server itself are left alone
+void apply_folder_change(const std::string &name, const FolderEntry *found) {
+    const CatalogEntry *entry = files.find(name);
+    if (entry != nullptr && entry->state == FileState::UPLOADING) {
+        return;
+    }
+    if (entry != nullptr && found != nullptr && entry->size == found->size) {
+        return;
+    }
+    if (entry != nullptr) {
+        // erased and inserted again on resize, so that cached LIST replies
+        // are dropped
+        free_space += entry->size;
+        files.erase(name);
+        if (manifest != nullptr) {
+            manifest->removed(name);
+        }
+    }
+    if (found != nullptr) {
+        free_space -= found->size;
+        files.insert(name, found->size, FileState::COMPLETE);
+        if (manifest != nullptr) {
+            manifest->added(name, found->size, found->mtime);
+        }
+    }
+}
+
+// brings the catalog up to date with the folder, files are stated without
+// the lock; if one changes in between, its event comes again and the next
+// batch fixes it
+void apply_folder_changes() {
+    std::vector<FolderEntry> present;
+    std::vector<std::string> gone;
+    if (folder_overflowed) {
+        folder_overflowed = false;
+        changed_names.clear();
+        try {
+            present = scan_folder(shrd_fldr);
+        }
+        catch (std::exception &e) {
+            // the catalog stays as it was, and the manifest is not synced
+            // with a folder it may not match
+            std::cerr << "Error occured: " << e.what() << "\n";
+            first_change = 0;
+            folder_deadline = NO_TIMER;
             return;
         }
+        std::unordered_set<std::string_view> names;
+        for (const auto &file : present) {
+            names.insert(file.name);
+        }
+        std::shared_lock<std::shared_mutex> lock(files_mutex);
+        files.for_each([&](const CatalogEntry &entry) {
+            if (entry.state == FileState::COMPLETE &&
+                names.count(entry.name) == 0) {
+                gone.emplace_back(entry.name);
+            }
+        });
+    }
+    auto it = changed_names.begin();
+    for (size_t n = 0; n < FOLDER_BATCH && it != changed_names.end();
+         ++n, it = changed_names.erase(it)) {
+        std::string path = shrd_fldr + "/" + it->first;
+        struct stat st;
+        // a file that was only created is likely still being written, its
+        // IN_CLOSE_WRITE will come, links are complete at once
+        if ((it->second & ~IN_CREATE) == 0 &&
+            lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) &&
+            st.st_nlink == 1) {
+            continue;
+        }
+        if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            present.push_back({it->first, (uint64_t)st.st_size,
+                               st.st_mtim.tv_sec * 1000000000LL +
+                                   st.st_mtim.tv_nsec});
+        }
+        else {
+            gone.push_back(it->first);
+        }
+    }
+
+    std::unique_lock<std::shared_mutex> lock(files_mutex);
+    for (const auto &name : gone) {
+        apply_folder_change(name, nullptr);
+    }
+    for (const auto &file : present) {
+        apply_folder_change(file.name, &file);
     }
+    if (changed_names.empty()) {
+        folder_dirty = false;
+        first_change = 0;
+        folder_deadline = NO_TIMER;
+    }
+    else {
+        folder_deadline = monotonic_ms();
+    }
+    sync_manifest();
 }
 
-void reply_get(int sock, const cmplx_cmd &cmd,
-               std::vector<std::string> files) {
-    namespace fs = boost::filesystem;
+// files that are still being uploaded are not served, returns false for
+// them, size is set only for complete files
+bool find_complete(const Catalog &files, std::string_view name,
+                   uint64_t &size) {
+    std::shared_lock<std::shared_mutex> lock(files_mutex);
+    const CatalogEntry *entry = files.find(name);
+    if (entry == nullptr || entry->state != FileState::COMPLETE) {
+        return false;
+    }
+    size = entry->size;
+    return true;
+}
 
-    bool have_file = false;
-    for (const auto &file : files) {
-        if (file == cmd.data) {
-            have_file = true;
-            break;
+// sends the whole file in FILE_DATA, returns false if it does not fit or
+// changed size since it was listed, then it's sent over tcp as usual
+// the read blocks the control loop, like open in reply_get does, but it's
+// of less than one datagram, mostly from the page cache, which costs less
+// than the tcp connection it saves
+bool reply_inline(SendBatch &replies, const cmd_view &cmd,
+                  const std::string &filename, int fd, uint64_t size) {
+    if (!fits_inline(filename, size)) {
+        return false;
+    }
+    std::string data(filename);
+    data.push_back('\0');
+    size_t start = data.size();
+    data.resize(start + size);
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t len = pread(fd, &data[start + done], size - done, done);
+        if (len <= 0) {
+            return false;
         }
+        done += len;
     }
+    close(fd);
+    metrics_add(Counter::BYTES_SENT, size);
+    replies.add(FILE_DATA, cmd.cmd_seq, size, data, cmd.addr);
+    return true;
+}
+
+void reply_get(SendBatch &replies, const cmd_view &cmd,
+               const Catalog &files) {
+    namespace fs = boost::filesystem;
+
+    // GET_RANGE has offset in param and may have length after the name,
+    // without length the file is sent up to its end
+    std::string_view name = cmd.data;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    if (cmd.cmd == GET_RANGE) {
+        name = split_number(cmd.data, length);
+        offset = cmd.param;
+    }
+    uint64_t remaining = length > 0 ? length : UINT64_MAX;
+
+    uint64_t size;
+    bool have_file = find_complete(files, name, size);
     char address[INET_ADDRSTRLEN];
     if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
                   sizeof(address)) == NULL) {
@@ -223,187 +915,1182 @@ void reply_get(int sock, const cmplx_cmd &cmd,
                   << ". (Requested file does not exist)\n";
         return;
     }
-
-    int new_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    if (new_socket < 0) {
-        throw std::logic_error("Failed to create new socket");
-    }
-    struct sockaddr_in local_address;
-    local_address.sin_family = AF_INET;
-    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    local_address.sin_port = htons(0);
-    if (bind(new_socket, (struct sockaddr *)&local_address,
-             sizeof(local_address)) < 0) {
-        close(new_socket);
-        throw std::logic_error("Failed to bind new socket");
-    }
-    if (listen(new_socket, 1) < 0) {
-        close(new_socket);
-        throw std::logic_error(
-            "Failed to switch to listening on a new socket");
-    }
-
-    socklen_t len = sizeof(local_address);
-    if (getsockname(new_socket, (sockaddr *)(&local_address), &len) < 0) {
-        close(new_socket);
-        throw std::logic_error("Failed to get port of the new socket");
+    // a range past the end would send nothing, and the client would take
+    // its stale part of the file for the whole one
+    if (offset > size) {
+        metrics_add(Counter::NO_WAY);
+        replies.add(NO_WAY, cmd.cmd_seq, name, cmd.addr);
+        return;
     }
-    cmplx_cmd reply{CONNECT_ME, cmd.cmd_seq, ntohs(local_address.sin_port),
-                    cmd.data, cmd.addr};
 
-    int fd = open(std::string(shrd_fldr + "/" + cmd.data).c_str(), O_RDONLY);
+    std::string filename(name);
+    int fd = open(std::string(shrd_fldr + "/" + filename).c_str(), O_RDONLY);
     if (fd < 0) {
         // TODO czy tu trzeba wysłać NO_WAY?
-        close(new_socket);
         throw std::logic_error("Failed to open requested file");
     }
-    send_cmd(reply, sock);
-    fds.push_back({new_socket, POLLIN, 0});
-    connections.emplace_back(boost::posix_time::microsec_clock::local_time(),
-                             new_socket, fd, cmd.data, false, true, "", 0);
-}
-
-void reply_add(int sock, const cmplx_cmd &cmd,
-               std::vector<std::string> &files) {
-    namespace fs = boost::filesystem;
-
-    if (cmd.param > (uint64_t)(max_space)) {
-        simpl_cmd reply{NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr};
-        send_cmd(reply, sock);
+    if (cmd.cmd == GET_INLINE && inline_mode &&
+        reply_inline(replies, cmd, filename, fd, size)) {
+        return;
+    }
+    // both sendfile and read continue from the file offset, which is
+    // already known to be within the file
+    if (offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
+        throw std::runtime_error("Failed to seek in requested file");
+    }
+    // client asking for a part of the file needs to know where it ends,
+    // because a connection closed early looks the same as a finished one
+    std::string reply_data(name);
+    if (cmd.cmd == GET_RANGE) {
+        reply_data = append_number(name, size);
+    }
+    if (data_sock >= 0) {
+        uint64_t token = add_pending_transfer(fd, filename, true, remaining);
+        replies.add(CONNECT_ME, cmd.cmd_seq, data_port,
+                    append_number(reply_data, token), cmd.addr);
+        return;
+    }
+    uint16_t port = 0;
+    int new_socket;
+    try {
+        new_socket = open_listener(port, 1);
+    }
+    catch (std::exception &e) {
+        close(fd);
+        throw;
+    }
+    ConnectionInfo info(monotonic_ms(), new_socket, fd, filename, false, true,
+                        "", 0);
+    info.remaining = remaining;
+    if (!hand_off(std::move(info))) {
+        // nothing is wrong with the request, the client may ask again
+        close(new_socket);
+        close(fd);
+        metrics_add(Counter::OVERLOAD);
+        std::cerr << "Error occured: All transfer workers are busy\n";
         return;
     }
+    replies.add(CONNECT_ME, cmd.cmd_seq, port, reply_data, cmd.addr);
+}
 
-    for (const auto &file : files) {
-        if (file == cmd.data) {
-            simpl_cmd reply{NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr};
-            send_cmd(reply, sock);
+// file of ADD_INLINE is stored at once, its space is already reserved, a
+// failed write is answered with NO_WAY, so the client tries another server
+void store_inline(SendBatch &replies, const cmd_view &cmd, int fd) {
+    std::string filename(cmd.data);
+    uint64_t done = 0;
+    while (done < cmd.payload.size()) {
+        ssize_t len = write(fd, cmd.payload.data() + done,
+                            cmd.payload.size() - done);
+        if (len < 0) {
+            close(fd);
+            handle_read_from_socket_fail(filename);
+            metrics_add(Counter::NO_WAY);
+            replies.add(NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr);
             return;
         }
+        done += len;
     }
+    metrics_add(Counter::BYTES_RECEIVED, done);
+    handle_upload_finished(filename, fd);
+    close(fd);
+    inline_adds.insert(cmd.cmd_seq);
+    inline_add_timers.schedule(monotonic_ms() + timeout * 1000, cmd.cmd_seq);
+    replies.add(ADDED, cmd.cmd_seq, cmd.data, cmd.addr);
+}
 
-    if (cmd.data.size() == 0 || cmd.data.find('/') != std::string::npos) {
-        simpl_cmd reply{NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr};
-        send_cmd(reply, sock);
+void reply_add(SendBatch &replies, const cmd_view &cmd) {
+    // the first ADDED was lost, the file is already stored
+    if (cmd.cmd == ADD_INLINE && inline_adds.count(cmd.cmd_seq) > 0) {
+        replies.add(ADDED, cmd.cmd_seq, cmd.data, cmd.addr);
         return;
     }
 
-    int new_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
-    struct sockaddr_in local_address;
-    local_address.sin_family = AF_INET;
-    local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    local_address.sin_port = htons(0);
-    if (bind(new_socket, (struct sockaddr *)&local_address,
-             sizeof(local_address)) < 0) {
-        close(new_socket);
-        throw std::logic_error("Failed to bind new socket");
-    }
-    if (listen(new_socket, 1) < 0) {
-        close(new_socket);
-        throw std::logic_error(
-            "Failed to switch to listening on a new socket");
+    if (!reserve_upload(cmd.data, cmd.param)) {
+        metrics_add(Counter::NO_WAY);
+        replies.add(NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr);
+        return;
     }
 
-    int fd = open(std::string(shrd_fldr + "/" + cmd.data).c_str(),
+    std::string filename(cmd.data);
+    int fd = open(std::string(shrd_fldr + "/" + filename).c_str(),
                   O_WRONLY | O_CREAT, 0660);
     if (fd < 0) {
         int e = errno;
-        close(new_socket);
+        handle_read_from_socket_fail(filename);
         throw std::logic_error(
             std::string("Failed to open requested file for writing ") +
             strerror(e));
     }
-    socklen_t len = sizeof(local_address);
-    if (getsockname(new_socket, (sockaddr *)(&local_address), &len) < 0) {
-        close(new_socket);
-        throw std::logic_error("Failed to get port of the new socket");
+    if (cmd.cmd == ADD_INLINE && inline_mode &&
+        cmd.payload.size() == cmd.param) {
+        store_inline(replies, cmd, fd);
+        return;
     }
-    char address[INET_ADDRSTRLEN];
-    if (inet_ntop(AF_INET, (void *)(&local_address.sin_addr), address,
-                  sizeof(address)) == NULL) {
-        throw std::logic_error("inet_ntop failed unexpectedly");
+    // reserve the announced size up front to avoid fragmenting large files,
+    // failure only means the filesystem does not support it
+    if (cmd.param > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, cmd.param);
+    }
+    if (data_sock >= 0) {
+        uint64_t token = add_pending_transfer(fd, filename, false, UINT64_MAX);
+        replies.add(CAN_ADD, cmd.cmd_seq, data_port, append_number("", token),
+                    cmd.addr);
+        return;
+    }
+    uint16_t port = 0;
+    int new_socket;
+    try {
+        new_socket = open_listener(port, 1);
+    }
+    catch (std::exception &e) {
+        close(fd);
+        handle_read_from_socket_fail(filename);
+        throw;
+    }
+    if (!hand_off(ConnectionInfo(monotonic_ms(), new_socket, fd, filename,
+                                 false, false, "", port))) {
+        close(new_socket);
+        close(fd);
+        handle_read_from_socket_fail(filename);
+        // the client offers the file to another server
+        metrics_add(Counter::OVERLOAD);
+        std::cerr << "Error occured: All transfer workers are busy\n";
+        metrics_add(Counter::NO_WAY);
+        replies.add(NO_WAY, cmd.cmd_seq, cmd.data, cmd.addr);
+        return;
     }
+    replies.add(CAN_ADD, cmd.cmd_seq, port, "", cmd.addr);
+}
 
-    cmplx_cmd reply{CAN_ADD, cmd.cmd_seq, ntohs(local_address.sin_port), "",
-                    cmd.addr};
-    max_space -= cmd.param;
-    files.push_back(cmd.data);
-    send_cmd(reply, sock);
-    fds.push_back({new_socket, POLLIN, 0});
-    filename_to_size[cmd.data] = cmd.param;
-    connections.emplace_back(boost::posix_time::microsec_clock::local_time(),
-                             new_socket, fd, cmd.data, false, false, address,
-                             ntohs(local_address.sin_port));
+// uploads in zero copy mode get a pipe to splice through
+void prepare_upload(ConnectionInfo &info) {
+    if (!info.writing && info.zero_copy) {
+        if (pipe2(info.pipe_fds, O_CLOEXEC) < 0) {
+            info.pipe_fds[0] = -1;
+            info.pipe_fds[1] = -1;
+            info.zero_copy = false;
+        }
+        else {
+            // bigger pipe means fewer splice calls, default size is fine too
+            fcntl(info.pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+        }
+    }
 }
 
-void accept_connection(int i) {
-    int new_socket = accept4(fds[i].fd, NULL, NULL, SOCK_NONBLOCK);
+// the listening socket is replaced by the accepted one in the same slot
+void accept_connection(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    int new_socket = accept4(info.sock_fd, NULL, NULL, SOCK_NONBLOCK);
     if (new_socket < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        }
         throw std::logic_error("Failed to accept new connection");
     }
 
-    fds[i].events = 0;
-    ConnectionInfo info = connections[i - 2];
-
+    close(info.sock_fd);
+    info.sock_fd = new_socket;
+    info.was_accepted = true;
+    info.began = monotonic_us();
+    prepare_upload(info);
     if (info.writing) {
-        fds.push_back({new_socket, POLLOUT, 0});
+        watch_connection(slot, EPOLLOUT);
     }
     else {
-        fds.push_back({new_socket, POLLIN, 0});
+        watch_connection(slot, EPOLLIN);
     }
-    connections.push_back({boost::posix_time::microsec_clock::local_time(),
-                           new_socket, info.fd, info.filename, true,
-                           info.writing, info.ip, info.port});
 }
 
-void write_to_fd(int i) {
-    ConnectionInfo &info = connections[i - 2];
-    int len;
-    if (info.position == info.buf_size) {
-        info.buf_size = read(info.fd, info.buffer, sizeof(info.buffer));
-        if (info.buf_size < 0) {
-            remove_connection(i);
-            throw std::runtime_error("Failed to read requested file");
-        }
-        if (info.buf_size == 0) {
-            remove_connection(i);
-            return;
+// single transfers end with their connection, data sessions go on with the
+// next request, unless the file ended before the size given in the reply
+void finish_transfer(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    end_transfer(info);
+    if (info.phase == SessionPhase::NONE || info.remaining > 0) {
+        remove_connection(slot);
+        return;
+    }
+    close(info.fd);
+    info.fd = -1;
+    info.filename.clear();
+    info.release_buffer();
+    info.position = 0;
+    info.buf_size = 0;
+    info.writing = true;
+    info.phase = SessionPhase::REQUEST;
+}
+
+// transfer is over, the connection goes on as after the last event of the
+// poll path
+void finish_ring_transfer(size_t slot, const RingTransfer &transfer,
+                          RingTransfer::Status status) {
+    ConnectionInfo &info = connections[slot];
+    metrics_add(info.writing ? Counter::BYTES_SENT : Counter::BYTES_RECEIVED,
+                transfer.moved);
+    if (status == RingTransfer::Status::FAILED) {
+        std::string message = info.writing
+                                  ? "Failed to send requested file "
+                                  : "Failed to receive requested file ";
+        if (!info.writing) {
+            handle_read_from_socket_fail(info.filename);
         }
-        info.position = 0;
+        remove_connection(slot);
+        throw std::runtime_error(message + strerror(transfer.error));
+    }
+    if (info.writing) {
+        info.remaining = transfer.remaining;
+        finish_transfer(slot);
     }
-    len = write(info.sock_fd, info.buffer + info.position,
-                info.buf_size - info.position);
-    if (len < 0) {
-        remove_connection(i);
-        throw std::runtime_error(
-            std::string("Failed to send requested file ") + strerror(errno));
+    else {
+        handle_upload_finished(info.filename, info.fd);
+        remove_connection(slot);
     }
-    info.position += len;
 }
 
-void read_from_fd(int i) {
-    ConnectionInfo &info = connections[i - 2];
-    int len;
-    len = read(info.sock_fd, info.buffer, sizeof(info.buffer));
-    if (len < 0) {
-        handle_read_from_socket_fail(info.filename);
-        remove_connection(i);
-        throw std::runtime_error("Failed to receive requested file");
-    }
-    if (len == 0) {
-        filename_to_size.erase(info.filename);
-        remove_connection(i);
+// the ring moves the whole file, events of the socket are ignored until
+// it's done
+void start_ring_transfer(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    if (ring_transfers.count(slot) > 0) {
         return;
     }
-    len = write(info.fd, info.buffer, len);
-    if (len < 0) {
-        handle_read_from_socket_fail(info.filename);
-        remove_connection(i);
-        throw std::runtime_error("Failed to write file on the disk");
+    std::unique_ptr<RingTransfer> transfer(new RingTransfer(
+        info.sock_fd, info.fd, info.writing, info.remaining));
+    transfer->key = slot;
+    RingTransfer::Status status = transfer->start(*ring);
+    if (status == RingTransfer::Status::RUNNING) {
+        ring_transfers[slot] = std::move(transfer);
+        return;
     }
+    finish_ring_transfer(slot, *transfer, status);
 }
 
-void init(int argc, char **argv) {
-    namespace po = boost::program_options;
+// sends the file straight from page cache, returns false if sendfile is not
+// supported for this file and buffered sending should be used instead
+bool sendfile_to_fd(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    while (true) {
+        size_t chunk = std::min<uint64_t>(SENDFILE_CHUNK, info.remaining);
+        if (chunk == 0) {
+            finish_transfer(slot);
+            return true;
+        }
+        ssize_t len = sendfile(info.sock_fd, info.fd, NULL, chunk);
+        if (len < 0) {
+            int e = errno;
+            if (e == EAGAIN || e == EWOULDBLOCK) {
+                return true;
+            }
+            if (e == EINVAL || e == ENOSYS) {
+                return false;
+            }
+            remove_connection(slot);
+            throw std::runtime_error(
+                std::string("Failed to send requested file ") + strerror(e));
+        }
+        if (len == 0) {
+            finish_transfer(slot);
+            return true;
+        }
+        metrics_add(Counter::BYTES_SENT, len);
+        info.remaining -= len;
+    }
+}
+
+// epoll is edge-triggered, so write until the socket would block
+void write_to_fd(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    if (ring != nullptr) {
+        start_ring_transfer(slot);
+        return;
+    }
+    if (info.zero_copy) {
+        if (sendfile_to_fd(slot)) {
+            return;
+        }
+        info.zero_copy = false;
+    }
+    info.attach_buffer();
+    int len;
+    while (true) {
+        if (info.position == info.buf_size) {
+            info.buf_size = read(
+                info.fd, info.buffer,
+                std::min<uint64_t>(BUFFER_SIZE, info.remaining));
+            if (info.buf_size < 0) {
+                remove_connection(slot);
+                throw std::runtime_error("Failed to read requested file");
+            }
+            info.remaining -= info.buf_size;
+            if (info.buf_size == 0) {
+                finish_transfer(slot);
+                return;
+            }
+            info.position = 0;
+        }
+        len = write(info.sock_fd, info.buffer + info.position,
+                    info.buf_size - info.position);
+        if (len < 0) {
+            int e = errno;
+            if (e == EAGAIN || e == EWOULDBLOCK) {
+                if (info.position == info.buf_size) {
+                    info.release_buffer();
+                }
+                return;
+            }
+            remove_connection(slot);
+            throw std::runtime_error(
+                std::string("Failed to send requested file ") + strerror(e));
+        }
+        metrics_add(Counter::BYTES_SENT, len);
+        info.position += len;
+    }
+}
+
+// moves data from the socket to the file through a pipe, without copying it
+// to userspace, returns false if splice is not supported for this connection
+bool splice_from_fd(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    while (true) {
+        ssize_t len = splice(info.sock_fd, NULL, info.pipe_fds[1], NULL,
+                             PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            if (errno == EINVAL) {
+                return false;
+            }
+            handle_read_from_socket_fail(info.filename);
+            remove_connection(slot);
+            throw std::runtime_error("Failed to receive requested file");
+        }
+        if (len == 0) {
+            handle_upload_finished(info.filename, info.fd);
+            remove_connection(slot);
+            return true;
+        }
+        metrics_add(Counter::BYTES_RECEIVED, len);
+        // the pipe is always emptied, so it never holds data between calls
+        while (len > 0) {
+            ssize_t written = splice(info.pipe_fds[0], NULL, info.fd, NULL,
+                                     len, SPLICE_F_MOVE);
+            if (written <= 0) {
+                handle_read_from_socket_fail(info.filename);
+                remove_connection(slot);
+                throw std::runtime_error("Failed to write file on the disk");
+            }
+            len -= written;
+        }
+    }
+}
+
+// epoll is edge-triggered, so read until the socket would block
+void read_from_fd(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    if (ring != nullptr) {
+        start_ring_transfer(slot);
+        return;
+    }
+    if (info.zero_copy) {
+        if (splice_from_fd(slot)) {
+            return;
+        }
+        info.zero_copy = false;
+    }
+    // nothing is kept in the buffer between calls
+    info.attach_buffer();
+    int len;
+    while (true) {
+        len = read(info.sock_fd, info.buffer, BUFFER_SIZE);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                info.release_buffer();
+                return;
+            }
+            handle_read_from_socket_fail(info.filename);
+            remove_connection(slot);
+            throw std::runtime_error("Failed to receive requested file");
+        }
+        if (len == 0) {
+            handle_upload_finished(info.filename, info.fd);
+            remove_connection(slot);
+            return;
+        }
+        metrics_add(Counter::BYTES_RECEIVED, len);
+        len = write(info.fd, info.buffer, len);
+        if (len < 0) {
+            handle_read_from_socket_fail(info.filename);
+            remove_connection(slot);
+            throw std::runtime_error("Failed to write file on the disk");
+        }
+    }
+}
+
+// reply is sent from buffer, data is copied first, because it may point
+// into the request in the same buffer
+void set_reply(size_t slot, Command cmd, uint64_t param,
+               const std::string &data) {
+    ConnectionInfo &info = connections[slot];
+    info.attach_buffer();
+    info.buf_size = pack_frame(info.buffer, cmd, info.cmd_seq, param, data);
+    info.position = 0;
+    info.phase = SessionPhase::REPLY;
+}
+
+// reads frame of the next request, returns true once it's whole
+bool read_frame(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    info.attach_buffer();
+    while (true) {
+        size_t wanted = FRAME_LENGTH_SIZE;
+        if ((size_t)info.position >= FRAME_LENGTH_SIZE) {
+            uint32_t length;
+            memcpy(&length, info.buffer, sizeof(length));
+            wanted += be32toh(length);
+            if (wanted > (size_t)BUFFER_SIZE) {
+                remove_connection(slot);
+                throw std::runtime_error("Request frame too long");
+            }
+            if ((size_t)info.position == wanted) {
+                return true;
+            }
+        }
+        ssize_t len = read(info.sock_fd, info.buffer + info.position,
+                           wanted - info.position);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (info.position == 0) {
+                    info.release_buffer();
+                }
+                return false;
+            }
+            remove_connection(slot);
+            throw std::runtime_error("Failed to receive request");
+        }
+        if (len == 0) {
+            // closing between requests is how a session ends
+            bool whole = info.position == 0;
+            remove_connection(slot);
+            if (!whole) {
+                throw std::runtime_error("Session closed inside a request");
+            }
+            return false;
+        }
+        info.position += len;
+    }
+}
+
+void session_get(size_t slot, const cmd_view &cmd) {
+    ConnectionInfo &info = connections[slot];
+    std::string_view name = cmd.data;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    if (cmd.cmd == GET_RANGE) {
+        name = split_number(cmd.data, length);
+        offset = cmd.param;
+    }
+    std::string filename(name);
+    uint64_t file_size;
+    int fd = -1;
+    // a range past the end is refused as it is over datagrams
+    if (find_complete(files, filename, file_size) && offset <= file_size) {
+        fd = open(std::string(shrd_fldr + "/" + filename).c_str(), O_RDONLY);
+    }
+    if (fd >= 0 && offset > 0 && lseek(fd, offset, SEEK_SET) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        metrics_add(Counter::NO_WAY);
+        set_reply(slot, NO_WAY, 0, filename);
+        return;
+    }
+    uint64_t size = offset < file_size ? file_size - offset : 0;
+    if (length > 0) {
+        size = std::min(size, length);
+    }
+    info.fd = fd;
+    info.filename = filename;
+    info.writing = true;
+    info.remaining = size;
+    info.zero_copy = transfer_mode == TRANSFER_ZERO_COPY;
+    info.began = monotonic_us();
+    set_reply(slot, CONNECT_ME, size, filename);
+}
+
+// file of ADD follows right after it, so it's read even if it's refused
+void session_add(size_t slot, const cmd_view &cmd) {
+    ConnectionInfo &info = connections[slot];
+    std::string filename(cmd.data);
+    info.remaining = cmd.param;
+    info.phase = SessionPhase::RECEIVE;
+    // refused file is only skipped, writing keeps the timeout from touching
+    // the catalog entry of another upload with the same name
+    info.fd = -1;
+    info.filename = filename;
+    info.writing = true;
+    info.began = monotonic_us();
+    if (!reserve_upload(filename, cmd.param)) {
+        return;
+    }
+    int fd = open(std::string(shrd_fldr + "/" + filename).c_str(),
+                  O_WRONLY | O_CREAT, 0660);
+    if (fd < 0) {
+        handle_read_from_socket_fail(filename);
+        return;
+    }
+    if (cmd.param > 0) {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, cmd.param);
+    }
+    info.fd = fd;
+    info.writing = false;
+}
+
+void handle_session_request(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    cmd_view cmd;
+    try {
+        parse_cmd(cmd, info.buffer + FRAME_LENGTH_SIZE,
+                  info.position - FRAME_LENGTH_SIZE);
+    }
+    catch (std::exception &e) {
+        metrics_add(Counter::MALFORMED);
+        remove_connection(slot);
+        throw;
+    }
+    info.cmd_seq = cmd.cmd_seq;
+    if (cmd.cmd == GET || cmd.cmd == GET_RANGE) {
+        metrics_add(Counter::GET);
+        session_get(slot, cmd);
+    }
+    else if (cmd.cmd == ADD) {
+        metrics_add(Counter::ADD);
+        session_add(slot, cmd);
+    }
+    else {
+        remove_connection(slot);
+        throw std::runtime_error("Unexpected command in data session");
+    }
+}
+
+// returns true once the whole file of ADD is read
+bool receive_file(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    info.attach_buffer();
+    while (info.remaining > 0) {
+        ssize_t len = read(info.sock_fd, info.buffer,
+                           std::min<uint64_t>(BUFFER_SIZE, info.remaining));
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            info.release_buffer();
+            return false;
+        }
+        if (len <= 0 ||
+            (info.fd >= 0 && write(info.fd, info.buffer, len) != len)) {
+            if (info.fd >= 0) {
+                handle_read_from_socket_fail(info.filename);
+            }
+            remove_connection(slot);
+            throw std::runtime_error("Failed to receive requested file");
+        }
+        metrics_add(Counter::BYTES_RECEIVED, len);
+        info.remaining -= len;
+    }
+    if (info.fd < 0) {
+        metrics_add(Counter::NO_WAY);
+        set_reply(slot, NO_WAY, 0, info.filename);
+        return true;
+    }
+    handle_upload_finished(info.filename, info.fd);
+    close(info.fd);
+    info.fd = -1;
+    info.writing = true;
+    set_reply(slot, CAN_ADD, 0, info.filename);
+    return true;
+}
+
+// returns true once the whole reply is sent
+bool send_reply(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    while (info.position < info.buf_size) {
+        ssize_t len = write(info.sock_fd, info.buffer + info.position,
+                            info.buf_size - info.position);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return false;
+            }
+            remove_connection(slot);
+            throw std::runtime_error("Failed to send reply");
+        }
+        info.position += len;
+    }
+    info.position = 0;
+    info.buf_size = 0;
+    if (info.fd >= 0) {
+        info.phase = SessionPhase::SEND;
+    }
+    else {
+        finish_transfer(slot);
+    }
+    return true;
+}
+
+// runs the session until its socket would block, it's watched for reading
+// and writing at once, because it does both in turns
+void handle_session(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    while (info.sock_fd >= 0) {
+        if (info.phase == SessionPhase::REQUEST) {
+            if (!read_frame(slot)) {
+                return;
+            }
+            handle_session_request(slot);
+        }
+        else if (info.phase == SessionPhase::RECEIVE) {
+            if (!receive_file(slot)) {
+                return;
+            }
+        }
+        else if (info.phase == SessionPhase::REPLY) {
+            if (!send_reply(slot)) {
+                return;
+            }
+        }
+        else {
+            write_to_fd(slot);
+            if (info.phase == SessionPhase::SEND) {
+                return;
+            }
+        }
+    }
+}
+
+// connection on data_sock takes over its pending transfer once the whole
+// token arrives, until then its fd is -1
+void read_token(size_t slot) {
+    ConnectionInfo &info = connections[slot];
+    char *token = (char *)&info.token;
+    while (info.position < (int)TOKEN_SIZE) {
+        ssize_t len = read(info.sock_fd, token + info.position,
+                           TOKEN_SIZE - info.position);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            remove_connection(slot);
+            throw std::runtime_error("Failed to receive transfer token");
+        }
+        if (len == 0) {
+            remove_connection(slot);
+            throw std::runtime_error("Connection closed before its token");
+        }
+        info.position += len;
+    }
+    if (be64toh(info.token) == SESSION_TOKEN) {
+        info.token = 0;
+        info.position = 0;
+        info.phase = SessionPhase::REQUEST;
+        // replies are small and pipelined, don't let them wait for acks
+        int nodelay = 1;
+        setsockopt(info.sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay,
+                   sizeof(nodelay));
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.u64 = slot;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, info.sock_fd, &event) < 0) {
+            remove_connection(slot);
+            throw std::logic_error(
+                std::string("Failed to modify socket in epoll ") +
+                strerror(errno));
+        }
+        handle_session(slot);
+        return;
+    }
+    {
+        // its timer is left to the control thread, it finds nothing
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        auto it = pending_transfers.find(be64toh(info.token));
+        if (it == pending_transfers.end()) {
+            remove_connection(slot);
+            throw std::runtime_error("Unknown transfer token");
+        }
+        ConnectionInfo &transfer = it->second;
+        info.fd = transfer.fd;
+        info.filename = std::move(transfer.filename);
+        info.writing = transfer.writing;
+        info.zero_copy = transfer.zero_copy;
+        info.remaining = transfer.remaining;
+        pending_transfers.erase(it);
+    }
+    info.position = 0;
+    info.buf_size = 0;
+    info.token = 0;
+    info.began = monotonic_us();
+    prepare_upload(info);
+
+    // epoll is edge-triggered and data may be waiting already, so the
+    // transfer is started right away
+    if (info.writing) {
+        struct epoll_event event;
+        event.events = EPOLLOUT | EPOLLET;
+        event.data.u64 = slot;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, info.sock_fd, &event) < 0) {
+            remove_connection(slot);
+            throw std::logic_error(
+                std::string("Failed to modify socket in epoll ") +
+                strerror(errno));
+        }
+        write_to_fd(slot);
+    }
+    else {
+        read_from_fd(slot);
+    }
+}
+
+// accepts every waiting connection on data_sock, they are watched until
+// they send their tokens
+void accept_data_connections() {
+    while (true) {
+        int new_socket = accept4(data_sock, NULL, NULL, SOCK_NONBLOCK);
+        if (new_socket < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            if (errno == ECONNABORTED || errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Error occured: Failed to accept new connection "
+                      << strerror(errno) << "\n";
+            return;
+        }
+        // writing, so that its timeout does not touch the catalog
+        if (!hand_off(ConnectionInfo(monotonic_ms(), new_socket, -1, "", true,
+                                     true, "", 0))) {
+            close(new_socket);
+            metrics_add(Counter::OVERLOAD);
+            std::cerr << "Error occured: All transfer workers are busy\n";
+        }
+    }
+}
+
+// only the time of activity is updated here, timer checks it when it expires
+void handle_connection(size_t slot, uint64_t now) {
+    ConnectionInfo &info = connections[slot];
+    if (info.sock_fd < 0) {
+        return;
+    }
+    info.start = now;
+    try {
+        if (!info.was_accepted) {
+            accept_connection(slot);
+        }
+        else if (info.phase != SessionPhase::NONE) {
+            handle_session(slot);
+        }
+        else if (info.fd < 0) {
+            read_token(slot);
+        }
+        else if (info.writing) {
+            write_to_fd(slot);
+        }
+        else {
+            read_from_fd(slot);
+        }
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error occured: " << e.what() << "\n";
+    }
+}
+
+void handle_command(const cmd_view &cmd) {
+    try {
+        if (cmd.cmd == HELLO) {
+            metrics_add(Counter::HELLO);
+            reply_hello(replies, cmd);
+        }
+        else if (cmd.cmd == LIST) {
+            metrics_add(Counter::LIST);
+            reply_list(replies, cmd, files);
+        }
+        else if (cmd.cmd == GET || cmd.cmd == GET_RANGE ||
+                 cmd.cmd == GET_INLINE) {
+            metrics_add(Counter::GET);
+            reply_get(replies, cmd, files);
+        }
+        else if (cmd.cmd == DEL) {
+            metrics_add(Counter::DEL);
+            handle_del(cmd, files);
+        }
+        else if (cmd.cmd == ADD || cmd.cmd == ADD_INLINE) {
+            metrics_add(Counter::ADD);
+            reply_add(replies, cmd);
+        }
+        else {
+            metrics_add(Counter::MALFORMED);
+            char address[INET_ADDRSTRLEN];
+            if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
+                          sizeof(address)) == NULL) {
+                throw std::logic_error("this should not be happening");
+            }
+            std::cerr << "[PCKG ERROR] Skipping invalid package from "
+                      << address << ":" << ntohs(cmd.addr.sin_port)
+                      << ". (Command " << cmd.name << " is unknown)\n";
+        }
+    }
+    // malformed packets are counted where they're found, errors of the
+    // filesystem end here too
+    catch (std::runtime_error &e) {
+        char address[INET_ADDRSTRLEN];
+        if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
+                      sizeof(address)) == NULL) {
+            throw std::logic_error("this should not be happening");
+        }
+        std::cerr << "[PCKG ERROR] Skipping invalid package from " << address
+                  << ":" << ntohs(cmd.addr.sin_port) << ". (" << e.what()
+                  << ")\n";
+    }
+    catch (std::exception &e) {
+        std::cerr << "Error occured: " << e.what() << "\n";
+    }
+}
+
+// connection is reaped if it was idle for timeout, otherwise the timer is
+// set again for the remaining time
+void expire_connection(uint64_t slot) {
+    ConnectionInfo &info = connections[slot];
+    info.timer = NO_TIMER;
+    if (info.sock_fd < 0) {
+        return;
+    }
+    uint64_t deadline = info.start + timeout * 1000;
+    if (monotonic_ms() < deadline) {
+        info.timer = timers.schedule(deadline, slot);
+        return;
+    }
+    metrics_add(Counter::TIMEOUTS);
+    if (!info.writing) {
+        // we were reading a file
+        handle_read_from_socket_fail(info.filename);
+    }
+    remove_connection(slot);
+}
+
+// pending transfer is dropped if the client did not connect in time
+void expire_transfer(uint64_t token) {
+    ConnectionInfo transfer;
+    {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        auto it = pending_transfers.find(token);
+        if (it == pending_transfers.end()) {
+            return;
+        }
+        transfer = std::move(it->second);
+        pending_transfers.erase(it);
+    }
+    metrics_add(Counter::TIMEOUTS);
+    if (!transfer.writing) {
+        handle_read_from_socket_fail(transfer.filename);
+    }
+    close(transfer.fd);
+}
+
+void expire_inline_add(uint64_t cmd_seq) {
+    inline_adds.erase(cmd_seq);
+}
+
+// counters and histograms with gauges read now
+std::string current_metrics() {
+    // connections of workers, accepted or still awaited
+    int64_t active = 0;
+    for (const auto &worker : workers) {
+        active += worker->load.load(std::memory_order_relaxed);
+    }
+    size_t pending;
+    {
+        std::lock_guard<std::mutex> lock(transfers_mutex);
+        pending = pending_transfers.size();
+    }
+    size_t count;
+    {
+        std::shared_lock<std::shared_mutex> lock(files_mutex);
+        count = files.size();
+    }
+    return format_metrics() +
+           format_gauge("netstore_active_transfers", active) +
+           format_gauge("netstore_pending_transfers", pending) +
+           format_gauge("netstore_files", count) +
+           format_gauge("netstore_free_space_bytes", space_left());
+}
+
+// SIGUSR1 dumps metrics to stderr, SIGINT ends the server
+void handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) {
+            std::cerr << current_metrics();
+        }
+        else {
+            handle_interrupt();
+        }
+    }
+}
+
+// listening unix socket at path, a stale socket file is replaced
+int open_metrics_socket(const std::string &path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::logic_error("Metrics socket path is too long");
+    }
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        throw std::logic_error("Failed to create metrics socket");
+    }
+    unlink(path.c_str());
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(sock, SOMAXCONN) < 0) {
+        int e = errno;
+        close(sock);
+        throw std::logic_error("Failed to listen on " + path + " " +
+                               strerror(e));
+    }
+    return sock;
+}
+
+// sends as much of the metrics as the socket takes, the reader is closed
+// once it has all of them or is gone, false if it has to wait for EPOLLOUT
+bool write_metrics(int client) {
+    std::string &text = metrics_readers[client];
+    while (!text.empty()) {
+        ssize_t len = send(client, text.data(), text.size(), MSG_NOSIGNAL);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        if (len <= 0) {
+            break;
+        }
+        text.erase(0, len);
+    }
+    metrics_readers.erase(client);
+    close(client);
+    return true;
+}
+
+// everyone who connects gets the metrics, then the connection is closed;
+// sockets are nonblocking, what a slow reader does not take at once is
+// sent from the epoll loop, so commands are never held up by it
+void serve_metrics() {
+    while (true) {
+        int client =
+            accept4(metrics_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        if (metrics_readers.size() >= METRICS_READERS_MAX) {
+            close(client);
+            continue;
+        }
+        metrics_readers[client] = current_metrics();
+        if (write_metrics(client)) {
+            continue;
+        }
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.u64 = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &event) < 0) {
+            metrics_readers.erase(client);
+            close(client);
+        }
+    }
+}
+
+// receives commands in batches until the socket would block, replies are
+// sent in batches too
+void handle_commands() {
+    static char buffers[RECV_BATCH][BUFFER_SIZE];
+    static struct sockaddr_in addrs[RECV_BATCH];
+    static struct iovec iovecs[RECV_BATCH];
+    static struct mmsghdr msgs[RECV_BATCH];
+
+    while (true) {
+        for (size_t i = 0; i < RECV_BATCH; ++i) {
+            iovecs[i].iov_base = buffers[i];
+            iovecs[i].iov_len = BUFFER_SIZE;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int count = recvmmsg(cmd_sock, msgs, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if (count < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                std::cerr << "Error occured: Failed to receive "
+                          << strerror(errno) << "\n";
+            }
+            break;
+        }
+        // latency of a reply is counted from the receive of its batch to
+        // its flush, queueing in the socket before that is not seen
+        uint64_t received = monotonic_us();
+        uint64_t handled = 0;
+        for (int i = 0; i < count; ++i) {
+            cmd_view cmd;
+            cmd.addr = addrs[i];
+            try {
+                parse_cmd(cmd, buffers[i], msgs[i].msg_len);
+            }
+            catch (std::runtime_error &e) {
+                metrics_add(Counter::MALFORMED);
+                char address[INET_ADDRSTRLEN];
+                if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
+                              sizeof(address)) == NULL) {
+                    throw std::logic_error("this should not be happening");
+                }
+                std::cerr << "[PCKG ERROR] Skipping invalid package from "
+                          << address << ":" << ntohs(cmd.addr.sin_port)
+                          << ". (" << e.what() << ")\n";
+                continue;
+            }
+            handle_command(cmd);
+            ++handled;
+            if (replies.size() >= SEND_BATCH) {
+                replies.flush(cmd_sock);
+                metrics_record(Histogram::REPLY_LATENCY,
+                               monotonic_us() - received, handled);
+                handled = 0;
+            }
+        }
+        replies.flush(cmd_sock);
+        if (handled > 0) {
+            metrics_record(Histogram::REPLY_LATENCY,
+                           monotonic_us() - received, handled);
+        }
+        // fewer datagrams than asked for means the socket is drained
+        if ((size_t)count < RECV_BATCH) {
+            break;
+        }
+    }
+}
+
+// takes connections the control thread handed to this worker
+void take_connections() {
+    uint64_t count;
+    // only resets the wakeup, the queue itself says what's there
+    if (read(worker->event_fd, &count, sizeof(count)) < 0 &&
+        errno != EAGAIN) {
+        std::cerr << "Error occured: Failed to read eventfd "
+                  << strerror(errno) << "\n";
+    }
+    ConnectionInfo info;
+    while (worker->queue.pop(info)) {
+        try {
+            size_t slot = add_connection(info.sock_fd, info.fd, info.filename,
+                                         info.writing, info.ip, info.port);
+            connections[slot].was_accepted = info.was_accepted;
+            connections[slot].remaining = info.remaining;
+        }
+        catch (std::exception &e) {
+            std::cerr << "Error occured: " << e.what() << "\n";
+            if (!info.writing) {
+                handle_read_from_socket_fail(info.filename);
+            }
+            close(info.sock_fd);
+            close(info.fd);
+            --worker->load;
+        }
+    }
+}
+
+// takes completions of ring transfers, a finished transfer gives its
+// connection back to the event loop
+void handle_ring() {
+    uint64_t now = monotonic_ms();
+    ring->reap([now](uint64_t user_data, int res) {
+        RingTransfer *transfer = RingTransfer::owner(user_data);
+        RingTransfer::Status status = transfer->complete(*ring, user_data,
+                                                         res);
+        if (transfer->abandoned()) {
+            if (status != RingTransfer::Status::RUNNING) {
+                delete transfer;
+            }
+            return;
+        }
+        size_t slot = transfer->key;
+        connections[slot].start = now;
+        if (status == RingTransfer::Status::RUNNING) {
+            return;
+        }
+        std::unique_ptr<RingTransfer> finished =
+            std::move(ring_transfers[slot]);
+        ring_transfers.erase(slot);
+        try {
+            finish_ring_transfer(slot, *finished, status);
+            // a data session reads its next request, its events may have
+            // come while the ring was busy
+            if (connections[slot].sock_fd >= 0 &&
+                connections[slot].phase != SessionPhase::NONE) {
+                handle_session(slot);
+            }
+        }
+        catch (std::exception &e) {
+            std::cerr << "Error occured: " << e.what() << "\n";
+        }
+    });
+}
+
+// event loop of a transfer thread, it never returns, exit ends it
+void run_worker(Worker *self) {
+    worker = self;
+    epoll_fd = self->epoll_fd;
+    ring = self->ring.get();
+    struct epoll_event events[MAX_EVENTS];
+    int timeout_millis = -1;
+    while (true) {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_millis);
+        uint64_t now = monotonic_ms();
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "Error occured: epoll_wait failed " << strerror(errno)
+                      << "\n";
+            exit(-1);
+        }
+        for (int k = 0; k < ready; ++k) {
+            uint64_t tag = events[k].data.u64;
+            if (tag == QUEUE_TAG) {
+                take_connections();
+            }
+            else if (tag == RING_TAG) {
+                handle_ring();
+            }
+            else {
+                handle_connection(tag, now);
+            }
+        }
+        // chains queued by this batch go to the kernel in one call
+        if (ring != nullptr) {
+            ring->submit();
+        }
+        // expired connections are reaped even if the worker is never idle
+        now = monotonic_ms();
+        timers.advance(now, expire_connection);
+        free_slots.insert(free_slots.end(), released_slots.begin(),
+                          released_slots.end());
+        released_slots.clear();
+        timeout_millis = timers.next_timeout(now);
+    }
+}
+
+void init(int argc, char **argv) {
+    namespace po = boost::program_options;
     namespace fs = boost::filesystem;
 
     po::options_description desc(argv[0] + std::string(" flags"));
@@ -414,25 +2101,134 @@ void init(int argc, char **argv) {
         ",b", po::value<int64_t>(&max_space),
         "MAX_SPACE")(",f", po::value<std::string>(&shrd_fldr)->required(),
                      "SHRD_FLDR")(",t", po::value<int32_t>(&timeout),
-                                  "TIMEOUT (range [1, 300], default 5)");
+                                  "TIMEOUT (range [1, 300], default 5)")(
+        ",m", po::value<std::string>(&transfer_mode),
+        "TRANSFER_MODE (copy, zerocopy or uring, default zerocopy)")(
+        ",d", po::value<int32_t>(&data_port),
+        "DATA_PORT (range [1, 65535], by default every transfer listens on "
+        "its own port)")(
+        ",i", po::bool_switch(&inline_mode),
+        "send and take files that fit in one datagram inside it")(
+        ",w", po::value<int32_t>(&worker_count),
+        "WORKERS (transfer threads, default one per core)")(
+        ",M", po::value<std::string>(&manifest_path),
+        "MANIFEST (file that keeps the catalog between restarts, it must not "
+        "be in SHRD_FLDR, by default the folder is scanned on every start)")(
+        ",U", po::value<std::string>(&metrics_path),
+        "METRICS_SOCKET (unix socket that gives metrics in prometheus text "
+        "format to everyone who connects, they're dumped on SIGUSR1 too)");
 
     try {
         parse_args(argc, argv, desc);
+        free_space = max_space;
+        if (!manifest_path.empty()) {
+            manifest.reset(new Manifest(manifest_path, shrd_fldr));
+        }
+        // watched before it's listed, so that no change falls in between
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0 ||
+            inotify_add_watch(inotify_fd, shrd_fldr.c_str(),
+                              IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO |
+                                  IN_MOVED_FROM | IN_DELETE | IN_ONLYDIR) <
+                0) {
+            std::cerr << "Failed to watch " << shrd_fldr << " "
+                      << strerror(errno)
+                      << ", changes made outside the server are not seen\n";
+            if (inotify_fd >= 0) {
+                close(inotify_fd);
+                inotify_fd = -1;
+            }
+        }
         files = list_files();
         sigset_t mask;
         sigemptyset(&mask);
         sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGUSR1);
         if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
             throw std::logic_error("Failed to block default SIGINT handling");
         }
-        int sfd = signalfd(-1, &mask, SFD_NONBLOCK);
-        if (sfd < 0) {
+        signal_fd = signalfd(-1, &mask, SFD_NONBLOCK);
+        if (signal_fd < 0) {
             throw std::logic_error("Failed to open signalfd");
         }
-        fds.push_back({sfd, POLLIN, 0});
+        cmd_sock = connect_to_mcast(mcast_addr, cmd_port);
 
-        int sock = connect_to_mcast(mcast_addr, cmd_port);
-        fds.push_back({sock, POLLIN, 0});
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            throw std::logic_error("Failed to create epoll");
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = SIGNAL_TAG;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &event) < 0) {
+            throw std::logic_error("Failed to add signalfd to epoll");
+        }
+        event.events = EPOLLIN | EPOLLET;
+        event.data.u64 = CMD_SOCK_TAG;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cmd_sock, &event) < 0) {
+            throw std::logic_error("Failed to add socket to epoll");
+        }
+        if (!metrics_path.empty()) {
+            metrics_sock = open_metrics_socket(metrics_path);
+            event.events = EPOLLIN;
+            event.data.u64 = METRICS_TAG;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_sock, &event) <
+                0) {
+                throw std::logic_error("Failed to add socket to epoll");
+            }
+        }
+        if (inotify_fd >= 0) {
+            event.events = EPOLLIN;
+            event.data.u64 = INOTIFY_TAG;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inotify_fd, &event) < 0) {
+                throw std::logic_error("Failed to add inotify to epoll");
+            }
+        }
+        if (data_port > 0) {
+            uint16_t port = data_port;
+            data_sock = open_listener(port, SOMAXCONN);
+            event.events = EPOLLIN | EPOLLET;
+            event.data.u64 = DATA_SOCK_TAG;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, data_sock, &event) < 0) {
+                throw std::logic_error("Failed to add socket to epoll");
+            }
+        }
+        if (transfer_mode == TRANSFER_URING) {
+            try {
+                Ring probe(RING_ENTRIES);
+            }
+            catch (std::exception &e) {
+                std::cerr << e.what() << ", transfers use zerocopy\n";
+                transfer_mode = TRANSFER_ZERO_COPY;
+            }
+        }
+        // SIGINT and SIGUSR1 are blocked by now, so that only signal_fd gets
+        // them
+        for (int32_t i = 0; i < worker_count; ++i) {
+            workers.emplace_back(new Worker());
+            Worker &created = *workers.back();
+            created.epoll_fd = epoll_create1(0);
+            created.event_fd = eventfd(0, EFD_NONBLOCK);
+            if (created.epoll_fd < 0 || created.event_fd < 0) {
+                throw std::logic_error("Failed to create worker");
+            }
+            event.events = EPOLLIN | EPOLLET;
+            event.data.u64 = QUEUE_TAG;
+            if (epoll_ctl(created.epoll_fd, EPOLL_CTL_ADD, created.event_fd,
+                          &event) < 0) {
+                throw std::logic_error("Failed to add eventfd to epoll");
+            }
+            if (transfer_mode == TRANSFER_URING) {
+                created.ring.reset(new Ring(RING_ENTRIES));
+                event.events = EPOLLIN;
+                event.data.u64 = RING_TAG;
+                if (epoll_ctl(created.epoll_fd, EPOLL_CTL_ADD,
+                              created.ring->fd(), &event) < 0) {
+                    throw std::logic_error("Failed to add ring to epoll");
+                }
+            }
+            created.thread = std::thread(run_worker, &created);
+        }
     }
     catch (po::error &e) {
         std::cerr << "INCORRECT USAGE\n" << e.what() << "\n" << desc;
@@ -453,95 +2249,56 @@ int main(int argc, char **argv) {
 
     init(argc, argv);
 
-    int timeout_millis = compute_timeout(connections, {}, timeout);
+    struct epoll_event events[MAX_EVENTS];
+    int timeout_millis = -1;
     while (true) {
-        int ready = poll(fds.data(), fds.size(), timeout_millis);
-        auto now = boost::posix_time::microsec_clock::local_time();
-        if (ready <= 0) {
-            // timeout
-            for (size_t i = fds.size() - 1; i >= 2; --i) {
-                auto duration = now - connections[i - 2].start;
-                if (duration.total_microseconds() / 1000000 > timeout) {
-                    if (fds[i].events & POLLIN) {
-                        // we were reading a file
-                        handle_read_from_socket_fail(
-                            connections[i - 2].filename);
-                    }
-                    remove_connection(i);
-                }
-            }
-            continue;
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_millis);
+        uint64_t now = monotonic_ms();
+        if (ready < 0 && errno != EINTR) {
+            std::cerr << "Error occured: epoll_wait failed " << strerror(errno)
+                      << "\n";
+            exit(-1);
         }
-        if (fds[0].revents & POLLIN) {
-            handle_interrupt();
-        }
-        if (fds[1].revents & POLLIN) {
-            fds[1].revents = 0;
-            cmplx_cmd cmd;
-            try {
-                recv_cmd(cmd, fds[1].fd);
-                if (cmd.cmd == HELLO) {
-                    reply_hello(fds[1].fd, cmd);
-                }
-                else if (cmd.cmd == LIST) {
-                    reply_list(fds[1].fd, cmd, files);
-                }
-                else if (cmd.cmd == GET) {
-                    reply_get(fds[1].fd, cmd, files);
-                }
-                else if (cmd.cmd == DEL) {
-                    handle_del(cmd, files);
-                }
-                else if (cmd.cmd == ADD) {
-                    reply_add(fds[1].fd, cmd, files);
-                }
-                else {
-                    char address[INET_ADDRSTRLEN];
-                    if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr),
-                                  address, sizeof(address)) == NULL) {
-                        throw std::logic_error("this should not be happening");
-                    }
-                    std::cerr << "[PCKG ERROR] Skipping invalid package from "
-                              << address << ":" << ntohs(cmd.addr.sin_port)
-                              << ". (Command " << cmd.cmd << " is unknown)\n";
-                }
+        for (int k = 0; k < ready; ++k) {
+            uint64_t tag = events[k].data.u64;
+            if (tag == SIGNAL_TAG) {
+                handle_signals();
             }
-            catch (std::runtime_error &e) {
-                char address[INET_ADDRSTRLEN];
-                if (inet_ntop(AF_INET, (void *)(&cmd.addr.sin_addr), address,
-                              sizeof(address)) == NULL) {
-                    throw std::logic_error("this should not be happening");
-                }
-                std::cerr << "[PCKG ERROR] Skipping invalid package from "
-                          << address << ":" << ntohs(cmd.addr.sin_port)
-                          << ". (" << e.what() << ")\n";
+            else if (tag == CMD_SOCK_TAG) {
+                handle_commands();
             }
-            catch (std::exception &e) {
-                std::cerr << "Error occured: " << e.what() << "\n";
+            else if (tag == DATA_SOCK_TAG) {
+                accept_data_connections();
             }
-        }
-        for (size_t i = 2; i < fds.size(); ++i) {
-            try {
-                if (fds[i].revents & POLLIN) {
-                    connections[i - 2].start = now;
-                    if (!connections[i - 2].was_accepted) {
-                        accept_connection(i);
-                    }
-                    else {
-                        fds[i].revents = 0;
-                        read_from_fd(i);
-                    }
-                }
-                if (fds[i].revents & POLLOUT) {
-                    connections[i - 2].start = now;
-                    fds[i].revents = 0;
-                    write_to_fd(i);
-                }
+            else if (tag == INOTIFY_TAG) {
+                handle_folder_events();
             }
-            catch (std::exception &e) {
-                std::cerr << "Error occured: " << e.what() << "\n";
+            else if (tag == METRICS_TAG) {
+                serve_metrics();
+            }
+            else if (metrics_readers.count(tag) > 0) {
+                write_metrics(tag);
+            }
+        }
+        // expired transfers are dropped even if the server is never idle
+        now = monotonic_ms();
+        transfer_timers.advance(now, expire_transfer);
+        inline_add_timers.advance(now, expire_inline_add);
+        if (now >= folder_deadline) {
+            apply_folder_changes();
+            now = monotonic_ms();
+        }
+        timeout_millis = transfer_timers.next_timeout(now);
+        int millis = inline_add_timers.next_timeout(now);
+        if (timeout_millis == -1 ||
+            (millis != -1 && millis < timeout_millis)) {
+            timeout_millis = millis;
+        }
+        if (folder_deadline != NO_TIMER) {
+            millis = folder_deadline > now ? folder_deadline - now : 0;
+            if (timeout_millis == -1 || millis < timeout_millis) {
+                timeout_millis = millis;
             }
         }
-        timeout_millis = compute_timeout(connections, {}, timeout);
     }
 }
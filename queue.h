@@ -0,0 +1,56 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+
+// bounded queue for exactly one producer thread and one consumer thread,
+// neither of them ever blocks or takes a lock, capacity is rounded up to a
+// power of two
+template <typename T>
+class SpscQueue {
+  public:
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size *= 2;
+        }
+        mask = size - 1;
+        slots.reset(new T[size]);
+    }
+
+    // returns false if the queue is full, value is left untouched then
+    bool push(T &&value) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[t & mask] = std::move(value);
+        // the slot is written before the consumer can see it
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // returns false if the queue is empty
+    bool pop(T &value) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = std::move(slots[h & mask]);
+        // the slot is read before the producer can reuse it
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+  private:
+    size_t mask;
+    std::unique_ptr<T[]> slots;
+    // each index is written by one side only, they're kept on separate
+    // cache lines, so that the sides don't invalidate each other's line
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+#endif
@@ -0,0 +1,39 @@
+# sourced by the checks, every check runs its own servers on its own ports
+# under a fresh folder, they're stopped and the folder removed on exit
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+SERVER=$REPO/netstore-server
+CLIENT=$REPO/netstore-client
+PROBE=$REPO/tests/probe.py
+MCAST=239.10.11.12
+WORK=$(mktemp -d /tmp/netstore-check-XXXXXX)
+SERVER_PIDS=()
+
+cleanup() {
+    for pid in "${SERVER_PIDS[@]}"; do
+        kill -INT "$pid" 2>/dev/null
+        wait "$pid" 2>/dev/null
+    done
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL $(basename "$0"): $*"
+    exit 1
+}
+
+pass() {
+    echo "PASS $(basename "$0")"
+    exit 0
+}
+
+# start_server NAME PORT FOLDER [server args...], returns once it answers
+# HELLO, its stderr goes to $WORK/NAME.err
+start_server() {
+    local name=$1 port=$2 folder=$3
+    shift 3
+    "$SERVER" -g $MCAST -p "$port" -f "$folder" "$@" 2>"$WORK/$name.err" &
+    SERVER_PIDS+=($!)
+    python3 "$PROBE" hello $MCAST "$port" >/dev/null ||
+        fail "server $name did not start: $(cat "$WORK/$name.err")"
+}
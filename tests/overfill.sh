@@ -0,0 +1,28 @@
+#!/bin/bash
+# files copied into the folder from outside can take more than MAX_SPACE,
+# the server then reports no free space and refuses every upload
+. "$(dirname "$0")/lib.sh"
+PORT=21050
+
+mkdir -p "$WORK/share"
+echo small >"$WORK/share/small.txt"
+start_server server $PORT "$WORK/share" -b 1000000 -U "$WORK/metrics.sock"
+
+head -c 3000000 /dev/zero >"$WORK/big.bin"
+mv "$WORK/big.bin" "$WORK/share/big.bin"
+# changes of the folder are applied within a second
+for _ in $(seq 40); do
+    space=$(python3 "$PROBE" hello $MCAST $PORT)
+    [ "$space" = 0 ] && break
+    sleep 0.05
+done
+[ "$space" = 0 ] || fail "GOOD_DAY reports $space bytes free in a full folder"
+gauge=$(python3 -c "import sys; sys.path.insert(0, '$REPO/tests')
+import probe
+print(int(probe.metric('$WORK/metrics.sock', 'netstore_free_space_bytes')))")
+[ "$gauge" = 0 ] || fail "free space gauge is $gauge in a full folder"
+for size in 0 1 1000; do
+    reply=$(python3 "$PROBE" add $MCAST $PORT "new$size.bin" $size)
+    [ "$reply" = NO_WAY ] || fail "ADD of $size bytes got $reply"
+done
+pass
@@ -0,0 +1,281 @@
+#!/usr/bin/env python3
+# talks to a netstore server at the protocol level, for checks that need
+# more control over a transfer than netstore-client gives:
+#   probe.py hello GROUP PORT
+#   probe.py add GROUP PORT NAME SIZE
+#   probe.py stall GROUP PORT NAME SIZE SMALL PID TIMEOUT
+#   probe.py trickle GROUP PORT NAME SIZE SECONDS
+import os
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+CMD_SIZE = 10
+COMPLEX = {b"GOOD_DAY", b"CONNECT_ME", b"ADD", b"CAN_ADD", b"GET_RANGE",
+           b"FILE_DATA", b"ADD_INLINE"}
+
+
+def pack(cmd, seq, data=b"", param=None):
+    packet = cmd.ljust(CMD_SIZE, b"\0") + struct.pack(">Q", seq)
+    if param is not None:
+        packet += struct.pack(">Q", param)
+    return packet + data
+
+
+def unpack(packet):
+    cmd = packet[:CMD_SIZE].rstrip(b"\0")
+    seq = struct.unpack(">Q", packet[CMD_SIZE:CMD_SIZE + 8])[0]
+    rest = packet[CMD_SIZE + 8:]
+    param = None
+    if cmd in COMPLEX:
+        param = struct.unpack(">Q", rest[:8])[0]
+        rest = rest[8:]
+    return cmd, seq, param, rest
+
+
+# sends cmd and returns (cmd, param, data, address) of the reply, None if
+# nothing came within wait seconds
+def request(sock, target, cmd, data=b"", param=None, wait=1.0):
+    seq = random.getrandbits(63)
+    sock.sendto(pack(cmd, seq, data, param), target)
+    deadline = time.monotonic() + wait
+    while True:
+        left = deadline - time.monotonic()
+        if left <= 0:
+            return None
+        sock.settimeout(left)
+        try:
+            packet, address = sock.recvfrom(65535)
+        except socket.timeout:
+            return None
+        reply, reply_seq, reply_param, reply_data = unpack(packet)
+        if reply_seq == seq:
+            return reply, reply_param, reply_data, address
+
+
+def transfer_socket(reply):
+    cmd, param, data, address = reply
+    token = 0
+    if b"/" in data:
+        token = int(data.rsplit(b"/", 1)[1])
+    sock = socket.create_connection((address[0], param))
+    if token:
+        sock.sendall(struct.pack(">Q", token))
+    return sock
+
+
+# inode of the socket that the server holds for the other end of sock
+def server_inode(sock):
+    local = sock.getsockname()[1]
+    remote = sock.getpeername()[1]
+    with open("/proc/net/tcp") as table:
+        for line in table.readlines()[1:]:
+            fields = line.split()
+            if (int(fields[1].split(":")[1], 16) == remote and
+                    int(fields[2].split(":")[1], 16) == local):
+                return fields[9]
+    raise KeyError(remote)
+
+
+# socket inodes among the descriptors of process pid
+def open_sockets(pid):
+    inodes = set()
+    folder = "/proc/%s/fd" % pid
+    for fd in os.listdir(folder):
+        try:
+            link = os.readlink(os.path.join(folder, fd))
+        except OSError:
+            continue
+        if link.startswith("socket:["):
+            inodes.add(link[len("socket:["):-1])
+    return inodes
+
+
+# value of a metric read from the unix socket of the server
+def metric(path, name):
+    sock = socket.socket(socket.AF_UNIX)
+    sock.connect(path)
+    text = b""
+    while True:
+        chunk = sock.recv(65536)
+        if not chunk:
+            break
+        text += chunk
+    sock.close()
+    for line in text.decode().splitlines():
+        if line.startswith(name + " "):
+            return float(line.split()[1])
+    raise KeyError(name)
+
+
+# waits until the server answers, so that checks don't race its start
+def hello(target):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    for _ in range(100):
+        reply = request(sock, target, b"HELLO", wait=0.1)
+        if reply is not None:
+            print(reply[1])
+            return 0
+    return 1
+
+
+# prints the command that answered ADD, or NONE
+def add(target, name, size):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    reply = request(sock, target, b"ADD", name.encode(), int(size))
+    print("NONE" if reply is None else reply[0].decode())
+    return 0
+
+
+# opens a GET and an ADD that stop moving data right away, and keeps HELLO
+# and GET of the small file going next to them; the stalled transfers have
+# to be reaped within their timeout while the load goes on unhindered, and
+# the partial upload must not be listed afterwards
+def stall(target, name, size, small, pid, timeout):
+    timeout = float(timeout)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    reply = request(sock, target, b"GET", name.encode())
+    if reply is None or reply[0] != b"CONNECT_ME":
+        print("no CONNECT_ME for", name)
+        return 1
+    stalled_get = transfer_socket(reply)
+    reply = request(sock, target, b"ADD", b"stalled.bin", 1 << 20)
+    if reply is None or reply[0] != b"CAN_ADD":
+        print("no CAN_ADD for stalled.bin")
+        return 1
+    stalled_add = transfer_socket(reply)
+    stalled_add.sendall(b"x" * 1000)
+    began = time.monotonic()
+    # the server reaps a transfer by closing its descriptor
+    stalled = {server_inode(stalled_get), server_inode(stalled_add)}
+
+    done = threading.Event()
+    served = [0]
+    slowest = [0.0]
+    failed = []
+
+    def load():
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        while not done.is_set():
+            start = time.monotonic()
+            if request(sock, target, b"HELLO") is None:
+                failed.append("HELLO")
+                continue
+            reply = request(sock, target, b"GET", small.encode())
+            if reply is None or reply[0] != b"CONNECT_ME":
+                failed.append("GET")
+                continue
+            conn = transfer_socket(reply)
+            conn.settimeout(timeout)
+            while conn.recv(65536):
+                pass
+            conn.close()
+            slowest[0] = max(slowest[0], time.monotonic() - start)
+            served[0] += 1
+
+    thread = threading.Thread(target=load)
+    thread.start()
+    reaped = None
+    while time.monotonic() - began < timeout + 3:
+        if not stalled & open_sockets(pid):
+            reaped = time.monotonic() - began
+            break
+        time.sleep(0.05)
+    done.set()
+    thread.join()
+
+    # the server closed both, the download ends short of the file
+    stalled_get.settimeout(1)
+    received = 0
+    try:
+        while True:
+            chunk = stalled_get.recv(1 << 20)
+            if not chunk:
+                break
+            received += len(chunk)
+    except (socket.timeout, ConnectionResetError):
+        pass
+    stalled_add.settimeout(1)
+    try:
+        add_closed = stalled_add.recv(1) == b""
+    except ConnectionResetError:
+        add_closed = True
+    except socket.timeout:
+        add_closed = False
+
+    # and the upload is no longer offered
+    reply = request(sock, target, b"LIST", b"stalled.bin", wait=0.5)
+    listed = reply is not None and reply[0] == b"MY_LIST"
+
+    print("reaped after %s s, %d requests served meanwhile, slowest %.3f s, "
+          "%d failed, stalled GET got %d bytes" %
+          ("%.2f" % reaped if reaped else "never", served[0], slowest[0],
+           len(failed), received))
+    if reaped is None or reaped < timeout - 0.1 or reaped > timeout + 1.5:
+        return 1
+    if served[0] < 10 or failed or slowest[0] > 1.0:
+        return 1
+    if received >= int(size) or listed:
+        return 1
+    return 0 if add_closed else 1
+
+
+# stands in for a server that has only NAME and sends it slowly, spread
+# over the given seconds, so that a client has a download in flight for as
+# long as a check needs; it sends the file once and exits
+def trickle(target, name, size, seconds):
+    size = int(size)
+    seconds = float(seconds)
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", target[1]))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP,
+                    socket.inet_aton(target[0]) + socket.inet_aton("0.0.0.0"))
+    listener = socket.socket()
+    listener.bind(("", 0))
+    listener.listen(1)
+
+    # searches are answered for the whole time the file is being sent
+    def answer():
+        while True:
+            packet, address = sock.recvfrom(65535)
+            cmd, seq, param, data = unpack(packet)
+            if cmd == b"HELLO":
+                sock.sendto(pack(b"GOOD_DAY", seq, target[0].encode(),
+                                 1 << 30), address)
+            elif cmd == b"LIST" and data in name.encode():
+                sock.sendto(pack(b"MY_LIST", seq, name.encode()), address)
+            elif cmd == b"GET" and data == name.encode():
+                port = listener.getsockname()[1]
+                sock.sendto(pack(b"CONNECT_ME", seq, data, port), address)
+
+    threading.Thread(target=answer, daemon=True).start()
+    conn, _ = listener.accept()
+    steps = 50
+    for step in range(steps):
+        sent = size * step // steps
+        conn.sendall(b"x" * (size * (step + 1) // steps - sent))
+        time.sleep(seconds / steps)
+    conn.close()
+    return 0
+
+
+def main(argv):
+    target = (argv[2], int(argv[3]))
+    if argv[1] == "hello":
+        return hello(target)
+    if argv[1] == "add":
+        return add(target, argv[4], argv[5])
+    if argv[1] == "stall":
+        return stall(target, *argv[4:9])
+    if argv[1] == "trickle":
+        return trickle(target, *argv[4:7])
+    print("unknown probe", argv[1])
+    return 2
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,25 @@
+#!/bin/bash
+# a fetch with a .part file left asks only for the rest of the file, and a
+# .part file that does not fit the remote file is kept, not taken for it
+. "$(dirname "$0")/lib.sh"
+PORT=21020
+
+mkdir -p "$WORK/share" "$WORK/out"
+head -c 3000000 /dev/urandom >"$WORK/share/big.bin"
+echo small >"$WORK/share/small.txt"
+head -c 1000000 "$WORK/share/big.bin" >"$WORK/out/big.bin.part"
+head -c 100 /dev/urandom >"$WORK/out/small.txt.part"
+start_server server $PORT "$WORK/share" -t 1
+
+(echo search; sleep 1.5; echo fetch big.bin; echo fetch small.txt; sleep 2;
+ echo exit) | timeout 10 "$CLIENT" -g $MCAST -p $PORT -o "$WORK/out" -t 1 \
+    >"$WORK/client.out" 2>&1
+
+cmp -s "$WORK/share/big.bin" "$WORK/out/big.bin" ||
+    fail "resumed download differs: $(cat "$WORK/client.out")"
+[ -e "$WORK/out/small.txt" ] && fail "stale .part was taken for small.txt"
+[ "$(stat -c %s "$WORK/out/small.txt.part")" = 100 ] ||
+    fail "stale .part of small.txt was changed"
+grep -q "small.txt downloading failed" "$WORK/client.out" ||
+    fail "failure of small.txt not reported: $(cat "$WORK/client.out")"
+pass
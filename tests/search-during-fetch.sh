@@ -0,0 +1,59 @@
+#!/bin/bash
+# a search runs next to a download without holding it up: the file keeps
+# coming in while the search waits for answers, and the download ends long
+# before the search timeout
+. "$(dirname "$0")/lib.sh"
+PORT=21030
+SEARCH_TIMEOUT=4
+
+mkdir -p "$WORK/out"
+# the file is sent over 2 s, a real server would be done before the search
+python3 "$PROBE" trickle $MCAST $PORT big.bin 20000000 2 \
+    2>"$WORK/trickle.err" &
+SERVER_PIDS+=($!)
+python3 "$PROBE" hello $MCAST $PORT >/dev/null ||
+    fail "trickling server did not start: $(cat "$WORK/trickle.err")"
+
+mkfifo "$WORK/input"
+timeout 20 "$CLIENT" -g $MCAST -p $PORT -o "$WORK/out" -t $SEARCH_TIMEOUT \
+    <"$WORK/input" >"$WORK/client.out" 2>&1 &
+CLIENT_PID=$!
+exec 3>"$WORK/input"
+
+echo search >&3
+for _ in $(seq 50); do
+    grep -q "^big.bin" "$WORK/client.out" && break
+    sleep 0.05
+done
+echo fetch big.bin >&3
+sleep 0.3
+echo search >&3
+searched=$(date +%s%N)
+
+part="$WORK/out/big.bin.part"
+sleep 0.3
+before=$(stat -c %s "$part" 2>/dev/null || echo 0)
+sleep 0.5
+after=$(stat -c %s "$part" 2>/dev/null || echo 0)
+[ "$after" -gt "$before" ] ||
+    fail "download stood still during the search ($before, $after bytes)"
+
+while [ ! -e "$WORK/out/big.bin" ] &&
+      [ $(($(date +%s%N) - searched)) -lt $((SEARCH_TIMEOUT * 10 ** 9)) ]; do
+    sleep 0.05
+done
+finished=$(date +%s%N)
+echo exit >&3
+exec 3>&-
+wait $CLIENT_PID
+
+[ -e "$WORK/out/big.bin" ] ||
+    fail "download did not end within the search: $(cat "$WORK/client.out")"
+[ "$(stat -c %s "$WORK/out/big.bin")" = 20000000 ] ||
+    fail "downloaded file has a wrong size"
+grep -q "File big.bin downloaded" "$WORK/client.out" ||
+    fail "download not reported: $(cat "$WORK/client.out")"
+[ "$(grep -c "^big.bin" "$WORK/client.out")" -ge 2 ] ||
+    fail "second search found nothing: $(cat "$WORK/client.out")"
+echo "download ended $(((finished - searched) / 1000000)) ms into the search"
+pass
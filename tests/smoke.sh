@@ -0,0 +1,36 @@
+#!/bin/bash
+# one client session against a server: discover, search, fetch, upload,
+# upload-dir and remove, checked by the files that end up in the folders
+. "$(dirname "$0")/lib.sh"
+PORT=21040
+
+mkdir -p "$WORK/s1" "$WORK/out" "$WORK/up" "$WORK/dir"
+head -c 3000000 /dev/urandom >"$WORK/s1/big.bin"
+echo hello >"$WORK/s1/a.txt"
+echo world >"$WORK/s1/b.txt"
+head -c 200000 /dev/urandom >"$WORK/up/up1.bin"
+for i in 1 2 3 4 5 6; do
+    head -c $((i * 10000)) /dev/urandom >"$WORK/dir/d$i.bin"
+done
+start_server s1 $PORT "$WORK/s1" -t 1 -b 100000000
+
+(echo discover; sleep 1.5; echo search; sleep 1.5; echo fetch big.bin;
+ echo fetch b.txt; sleep 1; echo upload "$WORK/up/up1.bin";
+ echo upload-dir "$WORK/dir"; sleep 2.5; echo remove a.txt; sleep 0.5;
+ echo search; sleep 1.5; echo exit) |
+    timeout 20 "$CLIENT" -g $MCAST -p $PORT -o "$WORK/out" -t 1 \
+        >"$WORK/client.out" 2>"$WORK/client.err"
+
+out=$(cat "$WORK/client.out" "$WORK/client.err")
+grep -q "^Found" "$WORK/client.out" || fail "discover found nothing: $out"
+cmp -s "$WORK/s1/big.bin" "$WORK/out/big.bin" || fail "big.bin differs: $out"
+cmp -s "$WORK/s1/b.txt" "$WORK/out/b.txt" || fail "b.txt differs: $out"
+for file in "$WORK/up/up1.bin" "$WORK/dir"/*; do
+    cmp -s "$file" "$WORK/s1/$(basename "$file")" ||
+        fail "$(basename "$file") was not uploaded: $out"
+done
+[ -e "$WORK/s1/a.txt" ] && fail "a.txt was not removed: $out"
+# listed by the first search only
+[ "$(grep -c "^a.txt" "$WORK/client.out")" = 1 ] ||
+    fail "a.txt listed after remove: $out"
+pass
@@ -0,0 +1,18 @@
+#!/bin/bash
+# stalled transfers are reaped by their timer within TIMEOUT, while HELLO
+# and GET of other clients are answered meanwhile
+. "$(dirname "$0")/lib.sh"
+PORT=21010
+TIMEOUT=2
+BIG=$((64 << 20))
+
+mkdir -p "$WORK/share"
+# bigger than socket buffers, so the download can't end before it stalls
+head -c $BIG /dev/zero >"$WORK/share/big.bin"
+echo small >"$WORK/share/small.txt"
+start_server server $PORT "$WORK/share" -t $TIMEOUT -b $((BIG * 4))
+
+python3 "$PROBE" stall $MCAST $PORT big.bin $BIG small.txt \
+    "${SERVER_PIDS[0]}" $TIMEOUT || fail "stalled transfers were not reaped"
+[ -e "$WORK/share/stalled.bin" ] && fail "stalled upload was left behind"
+pass
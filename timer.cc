@@ -0,0 +1,172 @@
+#include "timer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <time.h>
+
+uint64_t monotonic_ms() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        throw std::logic_error("Failed to read monotonic clock");
+    }
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_us() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+        throw std::logic_error("Failed to read monotonic clock");
+    }
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+TimerWheel::TimerWheel(uint64_t now_ms) : current(now_ms) {
+    for (uint32_t level = 0; level < WHEEL_LEVELS; ++level) {
+        for (uint32_t slot = 0; slot < WHEEL_SLOTS; ++slot) {
+            heads[level][slot] = NONE;
+        }
+    }
+}
+
+uint64_t TimerWheel::schedule(uint64_t deadline_ms, uint64_t key) {
+    uint32_t index;
+    if (free_timers.empty()) {
+        index = timers.size();
+        timers.emplace_back();
+        timers[index].generation = 0;
+    }
+    else {
+        index = free_timers.back();
+        free_timers.pop_back();
+    }
+    Timer &timer = timers[index];
+    // the current tick is already handled, so the earliest is the next one
+    timer.deadline = deadline_ms > current ? deadline_ms : current + 1;
+    timer.key = key;
+    place(index);
+    ++active;
+    return (uint64_t)timer.generation << 32 | index;
+}
+
+void TimerWheel::cancel(uint64_t handle) {
+    if (handle == NO_TIMER) {
+        return;
+    }
+    uint32_t index = handle & UINT32_MAX;
+    uint32_t generation = handle >> 32;
+    if (index >= timers.size() || timers[index].generation != generation ||
+        timers[index].level == NONE) {
+        return;
+    }
+    unlink(index);
+    release(index);
+}
+
+int TimerWheel::next_timeout(uint64_t now_ms) const {
+    uint64_t next = next_event();
+    if (next == NO_TIMER) {
+        return -1;
+    }
+    if (next <= now_ms) {
+        return 0;
+    }
+    return next - now_ms;
+}
+
+uint64_t TimerWheel::next_event() const {
+    if (active == 0) {
+        return NO_TIMER;
+    }
+    uint64_t next = NO_TIMER;
+    for (uint32_t level = 0; level < WHEEL_LEVELS; ++level) {
+        if (occupied[level] == 0) {
+            continue;
+        }
+        // slots of a level are visited in order from the one after the
+        // slot of current, one per 2^(WHEEL_BITS * level) ticks
+        uint32_t shift = WHEEL_BITS * level;
+        uint64_t base = (current >> shift) + 1;
+        uint32_t start = base & (WHEEL_SLOTS - 1);
+        uint64_t rotated = occupied[level] >> start;
+        if (start > 0) {
+            rotated |= occupied[level] << (WHEEL_SLOTS - start);
+        }
+        uint64_t tick = (base + __builtin_ctzll(rotated)) << shift;
+        next = std::min(next, tick);
+    }
+    return next;
+}
+
+size_t TimerWheel::size() const {
+    return active;
+}
+
+void TimerWheel::place(uint32_t index) {
+    Timer &timer = timers[index];
+    // during cascade a deadline can be equal to current, it's still handled
+    // in this tick, because lowest level is expired after cascading
+    uint64_t deadline = timer.deadline > current ? timer.deadline : current;
+    uint64_t delta = deadline - current;
+    uint32_t level = 0;
+    while (level + 1 < WHEEL_LEVELS &&
+           delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+    uint64_t max_delta = ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    if (delta > max_delta) {
+        // it's moved down at the latest possible cascade and placed again
+        deadline = current + max_delta;
+    }
+    uint32_t slot = (deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    timer.level = level;
+    timer.slot = slot;
+    timer.prev = NONE;
+    timer.next = heads[level][slot];
+    if (timer.next != NONE) {
+        timers[timer.next].prev = index;
+    }
+    heads[level][slot] = index;
+    occupied[level] |= (uint64_t)1 << slot;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+    Timer &timer = timers[index];
+    if (timer.prev != NONE) {
+        timers[timer.prev].next = timer.next;
+    }
+    else {
+        heads[timer.level][timer.slot] = timer.next;
+        if (timer.next == NONE) {
+            occupied[timer.level] &= ~((uint64_t)1 << timer.slot);
+        }
+    }
+    if (timer.next != NONE) {
+        timers[timer.next].prev = timer.prev;
+    }
+}
+
+void TimerWheel::release(uint32_t index) {
+    timers[index].level = NONE;
+    ++timers[index].generation;
+    free_timers.push_back(index);
+    --active;
+}
+
+void TimerWheel::cascade() {
+    for (uint32_t level = 1; level < WHEEL_LEVELS; ++level) {
+        // lower level has not wrapped around, so there's nothing to move
+        if ((current >> (WHEEL_BITS * (level - 1))) & (WHEEL_SLOTS - 1)) {
+            return;
+        }
+        uint32_t slot =
+            (current >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+        uint32_t index = heads[level][slot];
+        heads[level][slot] = NONE;
+        occupied[level] &= ~((uint64_t)1 << slot);
+        while (index != NONE) {
+            uint32_t next = timers[index].next;
+            place(index);
+            index = next;
+        }
+    }
+}
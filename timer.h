@@ -0,0 +1,94 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// wheel has WHEEL_LEVELS levels of WHEEL_SLOTS slots, one tick is 1 ms, so
+// deadlines up to 2^24 ms (over 4 hours) ahead are placed exactly
+const uint32_t WHEEL_BITS = 6;
+const uint32_t WHEEL_SLOTS = 1 << WHEEL_BITS;
+const uint32_t WHEEL_LEVELS = 4;
+static_assert(WHEEL_SLOTS == 64, "occupied slots of a level are a word");
+const uint64_t NO_TIMER = UINT64_MAX;
+
+// milliseconds from some fixed point in the past, never goes back
+uint64_t monotonic_ms();
+// the same clock in microseconds
+uint64_t monotonic_us();
+
+// hierarchical timer wheel, scheduling and cancelling are O(1), every timer
+// carries a key given back when it expires
+class TimerWheel {
+  public:
+    explicit TimerWheel(uint64_t now_ms);
+
+    // returns handle that can be used to cancel the timer
+    uint64_t schedule(uint64_t deadline_ms, uint64_t key);
+    // does nothing for NO_TIMER and for timers that already expired
+    void cancel(uint64_t handle);
+    // calls expired(key) for every timer with deadline up to now_ms, expired
+    // may schedule and cancel timers
+    template <typename Function>
+    void advance(uint64_t now_ms, Function expired) {
+        while (current < now_ms) {
+            // ticks with nothing to expire or cascade are skipped, so that
+            // a wheel left alone for hours catches up at once
+            uint64_t next = next_event();
+            if (next > now_ms) {
+                current = now_ms;
+                return;
+            }
+            current = next;
+            cascade();
+            uint32_t slot = current & (WHEEL_SLOTS - 1);
+            uint32_t index;
+            while ((index = heads[0][slot]) != NONE) {
+                unlink(index);
+                uint64_t key = timers[index].key;
+                release(index);
+                expired(key);
+            }
+        }
+    }
+    // milliseconds until next timer may expire (it can be earlier than the
+    // real deadline, but never later), -1 if there are no timers
+    int next_timeout(uint64_t now_ms) const;
+    size_t size() const;
+
+  private:
+    static const uint32_t NONE = UINT32_MAX;
+
+    class Timer {
+      public:
+        uint64_t deadline;
+        uint64_t key;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t generation;
+        // level and slot the timer is in, level is NONE for free timers
+        uint32_t level;
+        uint32_t slot;
+    };
+
+    void place(uint32_t index);
+    void unlink(uint32_t index);
+    void release(uint32_t index);
+    // moves timers from higher levels down when lower level wraps around
+    void cascade();
+    // first tick after current that expires or cascades some timer,
+    // NO_TIMER if there are no timers
+    uint64_t next_event() const;
+
+    uint64_t current;
+    std::vector<Timer> timers;
+    std::vector<uint32_t> free_timers;
+    uint32_t heads[WHEEL_LEVELS][WHEEL_SLOTS];
+    // bit of every slot with timers, so empty slots are skipped at once, a
+    // level of WHEEL_SLOTS slots fits in one word
+    uint64_t occupied[WHEEL_LEVELS] = {};
+    size_t active = 0;
+};
+
+#endif
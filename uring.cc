@@ -0,0 +1,317 @@
+#include "uring.h"
+#include "helper.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <stdexcept>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+Ring::Ring(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    // every queued chain may complete at once, so there is room for more
+    // completions than entries
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = 4 * entries;
+    ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0) {
+        throw std::runtime_error(std::string("Failed to set up io_uring ") +
+                                 strerror(errno));
+    }
+    // one mapping for both rings, completions are never dropped, sockets
+    // are waited for inside the kernel and offset -1 means file position
+    const unsigned needed = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                            IORING_FEAT_FAST_POLL | IORING_FEAT_RW_CUR_POS;
+    if ((params.features & needed) != needed) {
+        close(ring_fd);
+        throw std::runtime_error("io_uring of this kernel is too old");
+    }
+    rings_size = std::max<size_t>(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (rings == MAP_FAILED) {
+        close(ring_fd);
+        throw std::runtime_error("Failed to map io_uring");
+    }
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *mapped_sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd,
+                             IORING_OFF_SQES);
+    if (mapped_sqes == MAP_FAILED) {
+        munmap(rings, rings_size);
+        close(ring_fd);
+        throw std::runtime_error("Failed to map io_uring");
+    }
+    sqes = (struct io_uring_sqe *)mapped_sqes;
+
+    char *base = (char *)rings;
+    sq_head = (unsigned *)(base + params.sq_off.head);
+    sq_tail = (unsigned *)(base + params.sq_off.tail);
+    sq_flags = (unsigned *)(base + params.sq_off.flags);
+    sq_mask = *(unsigned *)(base + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_local_tail = *sq_tail;
+    // entry i of the queue is always sqes[i]
+    unsigned *array = (unsigned *)(base + params.sq_off.array);
+    for (unsigned i = 0; i < sq_entries; ++i) {
+        array[i] = i;
+    }
+    cq_head = (unsigned *)(base + params.cq_off.head);
+    cq_tail = (unsigned *)(base + params.cq_off.tail);
+    cq_mask = *(unsigned *)(base + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+}
+
+Ring::~Ring() {
+    munmap(sqes, sqes_size);
+    munmap(rings, rings_size);
+    close(ring_fd);
+}
+
+int Ring::fd() const {
+    return ring_fd;
+}
+
+bool Ring::reserve(unsigned count) {
+    unsigned queued = sq_local_tail - __atomic_load_n(sq_head,
+                                                      __ATOMIC_ACQUIRE);
+    if (queued + count <= sq_entries) {
+        return true;
+    }
+    submit();
+    queued = sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    return queued + count <= sq_entries;
+}
+
+struct io_uring_sqe *Ring::get_sqe() {
+    struct io_uring_sqe *sqe = &sqes[sq_local_tail & sq_mask];
+    ++sq_local_tail;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+bool Ring::flush_overflow() {
+    if (!(__atomic_load_n(sq_flags, __ATOMIC_ACQUIRE) &
+          IORING_SQ_CQ_OVERFLOW)) {
+        return false;
+    }
+    syscall(__NR_io_uring_enter, ring_fd, 0, 0, IORING_ENTER_GETEVENTS, NULL,
+            0);
+    return true;
+}
+
+void Ring::submit() {
+    // entries are filled before the kernel can see them
+    __atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+    unsigned pending =
+        sq_local_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    while (pending > 0) {
+        int submitted = syscall(__NR_io_uring_enter, ring_fd, pending, 0, 0,
+                                NULL, 0);
+        if (submitted < 0 && errno == EINTR) {
+            continue;
+        }
+        if (submitted <= 0) {
+            // EAGAIN or EBUSY, the kernel is short of memory for now, the
+            // entries stay queued for the next submit
+            return;
+        }
+        pending -= submitted;
+    }
+}
+
+RingTransfer::RingTransfer(int sock_fd_, int fd_, bool sending_,
+                           uint64_t remaining_)
+    : remaining(remaining_), sock_fd(sock_fd_), fd(fd_), sending(sending_) {
+    if (sending) {
+        off_t position = lseek(fd, 0, SEEK_CUR);
+        offset = position < 0 ? 0 : position;
+        struct stat st;
+        if (remaining == UINT64_MAX && fstat(fd, &st) == 0) {
+            remaining = (uint64_t)st.st_size > offset ? st.st_size - offset
+                                                      : 0;
+        }
+    }
+    if (remaining == UINT64_MAX) {
+        depth = 1;
+    }
+}
+
+RingTransfer::~RingTransfer() {
+    for (auto buffer : buffers) {
+        if (buffer != nullptr) {
+            buffer_pool.release(buffer);
+        }
+    }
+    if (abandoned_) {
+        close(sock_fd);
+        close(fd);
+    }
+}
+
+RingTransfer *RingTransfer::owner(uint64_t user_data) {
+    // transfers are aligned to 64, index of the operation is in low bits
+    return (RingTransfer *)(uintptr_t)(user_data & ~(uint64_t)63);
+}
+
+RingTransfer::Status RingTransfer::start(Ring &ring) {
+    return queue_chain(ring);
+}
+
+RingTransfer::Status RingTransfer::complete(Ring &ring, uint64_t user_data,
+                                            int res) {
+    results[user_data & 63] = res;
+    if (--in_flight > 0) {
+        return Status::RUNNING;
+    }
+    if (abandoned_) {
+        return Status::FAILED;
+    }
+    return chain_over(ring);
+}
+
+bool RingTransfer::busy() const {
+    return in_flight > 0;
+}
+
+void RingTransfer::abandon() {
+    abandoned_ = true;
+    shutdown(sock_fd, SHUT_RDWR);
+}
+
+bool RingTransfer::abandoned() const {
+    return abandoned_;
+}
+
+void RingTransfer::queue(Ring &ring, uint8_t opcode, int op_fd,
+                         char *buffer, uint32_t length, uint64_t op_offset,
+                         int index, bool linked) {
+    struct io_uring_sqe *sqe = ring.get_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = op_fd;
+    sqe->addr = (uintptr_t)buffer;
+    sqe->len = length;
+    sqe->off = op_offset;
+    if (opcode == IORING_OP_SEND || opcode == IORING_OP_RECV) {
+        // a short send or recv breaks the chain, as a short read does
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    }
+    sqe->flags = linked ? IOSQE_IO_LINK : 0;
+    sqe->user_data = (uintptr_t)this | index;
+    lengths[index] = length;
+    ++in_flight;
+}
+
+RingTransfer::Status RingTransfer::queue_chain(Ring &ring) {
+    if (sending ? remaining == 0
+                : pending == 0 && (eof || remaining == 0)) {
+        return Status::DONE;
+    }
+    uint64_t chunks = depth;
+    if (remaining != UINT64_MAX) {
+        chunks = std::min<uint64_t>(
+            chunks, (remaining + BUFFER_SIZE - 1) / BUFFER_SIZE);
+    }
+    ops = 2 * (int)chunks + (pending > 0 ? 1 : 0);
+    if (!ring.reserve(ops)) {
+        error = EBUSY;
+        return Status::FAILED;
+    }
+    int index = 0;
+    // receiving writes at file position, it moves with every write
+    const uint64_t position = UINT64_MAX;
+    if (pending > 0) {
+        queue(ring, IORING_OP_WRITE, fd, buffers[0], pending, position,
+              index++, chunks > 0);
+    }
+    for (uint64_t k = 0; k < chunks; ++k) {
+        if (buffers[k] == nullptr) {
+            buffers[k] = buffer_pool.acquire();
+        }
+    }
+    uint64_t left = remaining;
+    for (uint64_t k = 0; k < chunks; ++k) {
+        uint32_t length = std::min<uint64_t>(BUFFER_SIZE, left);
+        left -= left == UINT64_MAX ? 0 : length;
+        bool last = k + 1 == chunks;
+        if (sending) {
+            queue(ring, IORING_OP_READ, fd, buffers[k], length,
+                  offset + k * BUFFER_SIZE, index++, true);
+            queue(ring, IORING_OP_SEND, sock_fd, buffers[k], length, 0,
+                  index++, !last);
+        }
+        else {
+            queue(ring, IORING_OP_RECV, sock_fd, buffers[k], length, 0,
+                  index++, true);
+            queue(ring, IORING_OP_WRITE, fd, buffers[k], length, position,
+                  index++, !last);
+        }
+    }
+    return Status::RUNNING;
+}
+
+RingTransfer::Status RingTransfer::chain_over(Ring &ring) {
+    int index = 0;
+    if (pending > 0) {
+        if (results[0] != (int)pending) {
+            error = results[0] < 0 ? -results[0] : EIO;
+            return Status::FAILED;
+        }
+        pending = 0;
+        index = 1;
+    }
+    const int first_chunk = index;
+    for (; index + 1 < ops; index += 2) {
+        int first = results[index];
+        int second = results[index + 1];
+        uint32_t length = lengths[index];
+        if (first < 0) {
+            error = -first;
+            return Status::FAILED;
+        }
+        if (sending) {
+            if ((uint32_t)first < length) {
+                // the file got shorter, remaining tells how much is missing
+                return Status::DONE;
+            }
+            if (second < 0) {
+                error = -second;
+                return Status::FAILED;
+            }
+            offset += second;
+            remaining -= second;
+            moved += second;
+            if ((uint32_t)second < length) {
+                break;
+            }
+            continue;
+        }
+        if (first == 0) {
+            eof = true;
+            break;
+        }
+        moved += first;
+        if (remaining != UINT64_MAX) {
+            remaining -= first;
+        }
+        if ((uint32_t)first < length) {
+            // its write was cancelled, it goes first in the next chain
+            memmove(buffers[0], buffers[(index - first_chunk) / 2], first);
+            pending = first;
+            break;
+        }
+        if (second != first) {
+            error = second < 0 ? -second : EIO;
+            return Status::FAILED;
+        }
+    }
+    depth = std::min(2 * depth, DEPTH);
+    return queue_chain(ring);
+}
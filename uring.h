@@ -0,0 +1,143 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// io_uring set up with raw syscalls, its fd becomes readable when
+// completions are waiting, so the event loop watches it like a socket
+class Ring {
+  public:
+    // throws if the kernel has no io_uring, or one too old to wait for
+    // sockets by itself
+    explicit Ring(unsigned entries);
+    ~Ring();
+    Ring(const Ring &) = delete;
+    Ring &operator=(const Ring &) = delete;
+
+    int fd() const;
+    // returns false if count entries can't be queued even after submitting
+    // the queued ones
+    bool reserve(unsigned count);
+    // zeroed entry, reserve has to be called for it first
+    struct io_uring_sqe *get_sqe();
+    // hands queued entries to the kernel, never waits for them
+    void submit();
+    // calls done(user_data, res) for every waiting completion, never waits,
+    // done may queue new entries
+    template <typename Function>
+    void reap(Function done) {
+        while (true) {
+            unsigned head = *cq_head;
+            while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                const struct io_uring_cqe &cqe = cqes[head & cq_mask];
+                uint64_t user_data = cqe.user_data;
+                int res = cqe.res;
+                ++head;
+                // the entry is copied, the kernel may reuse it now
+                __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+                done(user_data, res);
+            }
+            if (!flush_overflow()) {
+                return;
+            }
+        }
+    }
+
+  private:
+    // completions that did not fit in the queue are kept by the kernel,
+    // they're moved into it only on request, returns false if there were
+    // none
+    bool flush_overflow();
+
+    int ring_fd;
+    void *rings;
+    size_t rings_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_flags;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    // tail of entries queued here, the kernel sees it on submit
+    unsigned sq_local_tail;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+// moves one file through a connection in chains of linked operations, a
+// chain is up to DEPTH chunks deep, disk read -> socket send for every chunk
+// when sending, socket recv -> disk write when receiving; a chain runs in
+// order, so the stream stays in order, and a short or failed operation
+// cancels the rest of it, the next chain starts where the data really got
+class alignas(64) RingTransfer {
+  public:
+    static constexpr int DEPTH = 8;
+
+    enum class Status { RUNNING, DONE, FAILED };
+
+    // sending reads the file from its current offset, receiving writes it
+    // at its current offset, remaining is as in ConnectionInfo
+    RingTransfer(int sock_fd, int fd, bool sending, uint64_t remaining);
+    // it must not be destroyed while busy
+    ~RingTransfer();
+    RingTransfer(const RingTransfer &) = delete;
+    RingTransfer &operator=(const RingTransfer &) = delete;
+
+    // transfer whose operation completed with user_data
+    static RingTransfer *owner(uint64_t user_data);
+
+    // queues the first chain
+    Status start(Ring &ring);
+    // takes one completion, queues the next chain when the current one is
+    // over, RUNNING means that more completions will come
+    Status complete(Ring &ring, uint64_t user_data, int res);
+    // whether operations are in flight
+    bool busy() const;
+    // shuts the socket down, so that waiting operations fail soon, the
+    // owner deletes the transfer once it is not busy
+    void abandon();
+    bool abandoned() const;
+
+    // chosen by the owner to find its connection
+    uint64_t key = 0;
+    // bytes of the file still to be sent, as in ConnectionInfo
+    uint64_t remaining;
+    // bytes that went through the socket so far
+    uint64_t moved = 0;
+    // errno of the failure, 0 if there was none
+    int error = 0;
+
+  private:
+    Status queue_chain(Ring &ring);
+    Status chain_over(Ring &ring);
+    void queue(Ring &ring, uint8_t opcode, int fd, char *buffer,
+               uint32_t length, uint64_t offset, int index, bool linked);
+
+    int sock_fd;
+    int fd;
+    bool sending;
+    bool abandoned_ = false;
+    // offset of the next byte of the file to read, when sending
+    uint64_t offset = 0;
+    // taken from buffer_pool when a chain first needs them
+    char *buffers[DEPTH] = {};
+    // chunks of the next chain, it grows from 1 when the length of the
+    // file is not known, so that small files don't hold DEPTH buffers
+    int depth = DEPTH;
+    // bytes of buffers[0] still to be written, they came with a short recv
+    uint32_t pending = 0;
+    // whether the peer closed the connection, when receiving
+    bool eof = false;
+    // operations of the current chain, their lengths and results
+    int ops = 0;
+    int in_flight = 0;
+    uint32_t lengths[2 * DEPTH + 1];
+    int results[2 * DEPTH + 1];
+};
+
+#endif